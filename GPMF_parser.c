@@ -26,6 +26,7 @@
 
 #include "GPMF_parser.h"
 #include "GPMF_bitstream.h"
+#include "GPMF_threads.h"
 
 
 #ifdef DBG
@@ -71,24 +72,159 @@ GPMF_ERR SkipLevel(GPMF_stream* ms)
 }
 
 
-GPMF_ERR GPMF_Validate(GPMF_stream *ms, GPMF_LEVELS recurse)
+static void RecordStickyPosition(GPMF_stream *ms, GPMF_stream_entry *entry);
+
+
+// Each further KLV of the samples' key within the STRM, as GPMF_PayloadSampleCount() would count them
+static void RecordInstance(GPMF_directory *dir, GPMF_stream_entry *entry, uint32_t pos)
 {
-	if (ms)
+	if (entry->instances == 0) // too many to index
+		return;
+
+	if (entry->instances == 1)
 	{
-		GPMF_ERR ret = GPMF_OK;
-		uint32_t currpos = ms->pos;
-		uint32_t nestsize = ms->nest_size[ms->nest_level];
-		if (nestsize == 0 && ms->nest_level == 0)
-			nestsize = ms->buffer_size_longs;
-		
-		while (ms->pos+1 < ms->buffer_size_longs && nestsize > 0)
+		if (dir->instance_count + 2 > GPMF_DIRECTORY_INSTANCE_LIMIT)
+		{
+			entry->instances = 0;
+			return;
+		}
+		entry->instance_index = dir->instance_count;
+		dir->instance_pos[dir->instance_count++] = entry->sample_pos;
+	}
+	else if (dir->instance_count + 1 > GPMF_DIRECTORY_INSTANCE_LIMIT)
+	{
+		dir->instance_count = entry->instance_index; // release this entry's positions, it will be counted by searching
+		entry->instances = 0;
+		return;
+	}
+
+	dir->instance_pos[dir->instance_count++] = pos;
+	entry->instances++;
+}
+
+// Directory entry being filled while validating, for the STRM currently open
+typedef struct GPMF_index_state
+{
+	GPMF_directory *dir;
+	GPMF_stream_entry *entry;	// NULL when not within a STRM, or once its samples are found
+	GPMF_stream_entry *samples;	// once found, until the STRM ends, for any further instances
+	uint32_t depth;				// validation depth of the STRM's contents
+	uint32_t children;
+	uint32_t device_id;			// as GPMF_Next() would have parsed them so far
+	char device_name[32];
+	GPMF_ERR ret;
+} GPMF_index_state;
+
+
+static void IndexDevice(GPMF_stream *ms, GPMF_index_state *ix)
+{
+	uint32_t key = ms->buffer[ms->pos];
+
+	if (key == GPMF_KEY_DEVICE_ID && ms->pos + 2 < ms->buffer_size_longs)
+		ix->device_id = BYTESWAP32(ms->buffer[ms->pos + 2]);
+	if (key == GPMF_KEY_DEVICE_NAME)
+	{
+		uint32_t size = GPMF_DATA_SIZE(ms->buffer[ms->pos + 1]); // in bytes
+		if (size > sizeof(ix->device_name) - 1)
+			size = sizeof(ix->device_name) - 1;
+
+		if ((ms->pos + 1 + ((size + 3) >> 2)) < ms->buffer_size_longs)
+		{
+			memcpy(ix->device_name, &ms->buffer[ms->pos + 2], size);
+			ix->device_name[size] = 0;
+		}
+	}
+}
+
+
+// Each child of the open STRM is tested as SeekToSamples() would, the samples are the first nest, the last KLV, or the first of repeated KLVs
+static void IndexChild(GPMF_stream *ms, GPMF_index_state *ix, uint32_t *start, uint32_t *nest_longs, uint32_t depth, uint32_t size)
+{
+	GPMF_stream_entry *entry = ix->entry;
+	uint32_t level_end = start[depth] + nest_longs[depth];
+	uint32_t found = 0, q;
+
+	RecordStickyPosition(ms, entry);
+
+	if (ix->children++ == 0)
+		return;
+
+	if (GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_NEST)
+		found = 1;
+	else if (ms->pos + size + 2 == level_end)
+	{
+		if (GPMF_ERROR_RESERVED == GPMF_Reserved(ms->buffer[ms->pos]))
+		{
+			ix->entry = NULL;
+			return;
+		}
+		found = 1;
+	}
+	else if (ms->pos + size + 2 >= ms->buffer_size_longs)
+	{
+		ix->entry = NULL;
+		return;
+	}
+	else if (ms->buffer[ms->pos] == ms->buffer[ms->pos + size + 2]) // Matching tags
+		found = 1;
+
+	if (!found)
+		return;
+
+	entry->device_id = ix->device_id;
+	memcpy(entry->device_name, ix->device_name, sizeof(entry->device_name));
+	entry->fourcc = GPMF_Key(ms);
+	entry->type = (uint32_t)GPMF_Type(ms);
+	entry->struct_size = GPMF_StructSize(ms);
+	entry->repeat = GPMF_Repeat(ms);
+	entry->sample_pos = ms->pos;
+	entry->instances = 1;
+
+	// The parser state GPMF_Next() leaves, where the top DEVC is level 0 and each open nest is recorded one level up
+	entry->nest_level = depth - 1;
+	for (q = 0; q < depth - 1; q++)
+	{
+		entry->last_level_pos[q] = start[q + 2] - 2;
+		entry->nest_size[q] = start[q + 1] + nest_longs[q + 1] - (start[q + 2] + nest_longs[q + 2]);
+	}
+	entry->nest_size[depth - 1] = level_end - ms->pos;
+
+	ix->dir->entry_count++;
+	ix->entry = NULL;
+	ix->samples = entry;
+}
+
+
+// A single pass over the nest structure with an explicit stack. The checks, their order, the returned errors and the 
+// state left in ms match the recursive validator this replaced, each nest level is as if GPMF_Validate() had been called on it.
+static GPMF_ERR ValidateWalk(GPMF_stream *ms, GPMF_LEVELS recurse, GPMF_index_state *ix)
+{
+	GPMF_ERR ret = GPMF_OK;
+	uint32_t start[GPMF_NEST_LIMIT + 1];		// where each level begins, the read position is returned there
+	uint32_t remaining[GPMF_NEST_LIMIT + 1];	// longs still to validate within each level
+	uint32_t nest_longs[GPMF_NEST_LIMIT + 1];
+	uint32_t base_level = ms->nest_level;
+	uint32_t depth = 0;
+
+	start[0] = ms->pos;
+	nest_longs[0] = remaining[0] = ms->nest_size[ms->nest_level];
+	if (remaining[0] == 0 && ms->nest_level == 0)
+		nest_longs[0] = remaining[0] = ms->buffer_size_longs;
+
+	while (1)
+	{
+		uint32_t level_done = 1;
+
+		if (ms->pos + 1 < ms->buffer_size_longs && remaining[depth] > 0)
 		{
 			uint32_t key = ms->buffer[ms->pos];
+			level_done = 0;
 
 			if (ms->nest_level == 0 && key != GPMF_KEY_DEVICE && ms->device_count == 0 && ms->pos == 0)
 			{
 				DBG_MSG("ERROR: uninitized -- GPMF_ERROR_BAD_STRUCTURE\n");
-				return GPMF_ERROR_BAD_STRUCTURE;
+				ret = GPMF_ERROR_BAD_STRUCTURE;
+				goto cleanup;
 			}
 
 			if (GPMF_VALID_FOURCC(key))
@@ -96,7 +232,8 @@ GPMF_ERR GPMF_Validate(GPMF_stream *ms, GPMF_LEVELS recurse)
 				uint32_t type_size_repeat = ms->buffer[ms->pos + 1];
 				uint32_t size = GPMF_DATA_SIZE(type_size_repeat) >> 2;
 				uint8_t type = GPMF_SAMPLE_TYPE(type_size_repeat);
-				if(type != GPMF_TYPE_NEST && type != GPMF_TYPE_COMPLEX && type != GPMF_TYPE_COMPRESSED && GPMF_SizeofType((GPMF_SampleType)type) == 0)
+				uint32_t unknown = (type != GPMF_TYPE_NEST && type != GPMF_TYPE_COMPLEX && type != GPMF_TYPE_COMPRESSED && GPMF_SizeofType((GPMF_SampleType)type) == 0);
+				if (unknown)
 				{
 					ret = GPMF_ERROR_UNKNOWN_TYPE;
 					DBG_MSG("MINOR ERROR: unknown datatype-- GPMF_ERROR_UNKNOWN_TYPE\n");
@@ -106,62 +243,66 @@ GPMF_ERR GPMF_Validate(GPMF_stream *ms, GPMF_LEVELS recurse)
 				if (GPMF_SAMPLE_SIZE(type_size_repeat) == 0)
 				{
 					DBG_MSG("ERROR: zero for datatype size-- GPMF_ERROR_BAD_STRUCTURE\n");
-					return GPMF_ERROR_BAD_STRUCTURE;
+					ret = GPMF_ERROR_BAD_STRUCTURE;
+					goto cleanup;
 				}
 
-				if (size + 2 > nestsize)
+				if (size + 2 > remaining[depth])
 				{
 					DBG_MSG("ERROR: nest size too small within %c%c%c%c-- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-					return GPMF_ERROR_BAD_STRUCTURE;
+					ret = GPMF_ERROR_BAD_STRUCTURE;
+					goto cleanup;
+				}
+
+				if (ix && !unknown) // GPMF_Next() steps over unknown types when tolerant
+				{
+					if (ix->entry && depth == ix->depth)
+						IndexChild(ms, ix, start, nest_longs, depth, size);
+					else if (ix->samples && depth == ix->depth && key == ix->samples->fourcc)
+						RecordInstance(ix->dir, ix->samples, ms->pos);
+					IndexDevice(ms, ix);
 				}
 
 				if (type == GPMF_TYPE_NEST && recurse == GPMF_RECURSE_LEVELS)
 				{
-					uint32_t validnest;
 					ms->pos += 2;
 					ms->nest_level++;
-					if (ms->nest_level > GPMF_NEST_LIMIT)
+					if (ms->nest_level >= GPMF_NEST_LIMIT)
 					{
 						DBG_MSG("ERROR: nest level within %c%c%c%c too deep -- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-						return GPMF_ERROR_BAD_STRUCTURE;
+						ret = GPMF_ERROR_BAD_STRUCTURE;
+						goto cleanup;
 					}
 					ms->nest_size[ms->nest_level] = size;
-					validnest = GPMF_Validate(ms, recurse);
-					ms->nest_level--;
-					if (GPMF_ERROR_BAD_STRUCTURE == validnest)
-					{
-						DBG_MSG("ERROR: invalid nest within %c%c%c%c -- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-						return GPMF_ERROR_BAD_STRUCTURE;
-					}
-					else
-					{
-						if (GPMF_ERROR_UNKNOWN_TYPE == validnest)
-							ret = GPMF_ERROR_UNKNOWN_TYPE;
-
-						if (ms->nest_level == 0)
-							ms->device_count++;
-					}
 
-					ms->pos += size;
-					nestsize -= 2 + size;
+					depth++;
+					start[depth] = ms->pos;
+					nest_longs[depth] = remaining[depth] = size;
 
-					while (ms->pos < ms->buffer_size_longs && nestsize > 0 && ms->buffer[ms->pos] == GPMF_KEY_END)
+					if (ix && ix->entry == NULL && key == GPMF_KEY_STREAM && depth == 2 && base_level == 0 && ix->ret == GPMF_OK) // STRMs within the top DEVCs
 					{
-						ms->pos++;
-						nestsize--;
+						if (ix->dir->entry_count < GPMF_DIRECTORY_LIMIT)
+						{
+							ix->entry = &ix->dir->entry[ix->dir->entry_count];
+							memset(ix->entry, 0, sizeof(GPMF_stream_entry));
+							ix->entry->strm_pos = ms->pos - 2;
+							ix->depth = depth;
+							ix->children = 0;
+							ix->samples = NULL;
+						}
+						else
+							ix->ret = GPMF_ERROR_MEMORY;
 					}
+					continue;
 				}
 				else
 				{
 					ms->pos += 2 + size;
-					nestsize -= 2 + size;
+					remaining[depth] -= 2 + size;
 				}
 
 				if (ms->pos == ms->buffer_size_longs)
-				{
-					ms->pos = currpos;
-					return ret;
-				}
+					level_done = 1;
 			}
 			else
 			{
@@ -170,24 +311,64 @@ GPMF_ERR GPMF_Validate(GPMF_stream *ms, GPMF_LEVELS recurse)
 					do
 					{
 						ms->pos++;
-						nestsize--;
-					} while (ms->pos < ms->buffer_size_longs && nestsize > 0 && ms->buffer[ms->pos] == 0);
+						remaining[depth]--;
+					} while (ms->pos < ms->buffer_size_longs && remaining[depth] > 0 && ms->buffer[ms->pos] == 0);
 				}
 				else if (ms->nest_level == 0 && ms->device_count > 0)
 				{
-					ms->pos = currpos;
-					return ret;
+					level_done = 1;
 				}
 				else
 				{
 					DBG_MSG("ERROR: bad struct within %c%c%c%c -- GPMF_ERROR_BAD_STRUCTURE\n", PRINTF_4CC(key));
-					return GPMF_ERROR_BAD_STRUCTURE;
+					ret = GPMF_ERROR_BAD_STRUCTURE;
+					goto cleanup;
 				}
 			}
 		}
 
-		ms->pos = currpos;
-		return ret;
+		while (level_done)
+		{
+			ms->pos = start[depth];
+			if (depth == 0)
+				return ret;
+
+			if (ix && depth == ix->depth) // no samples found within this STRM, or no more instances
+			{
+				ix->entry = NULL;
+				ix->samples = NULL;
+			}
+
+			// back within the parent, after the nest
+			depth--;
+			ms->nest_level--;
+			if (ms->nest_level == 0)
+				ms->device_count++;
+
+			ms->pos += nest_longs[depth + 1];
+			remaining[depth] -= 2 + nest_longs[depth + 1];
+
+			while (ms->pos < ms->buffer_size_longs && remaining[depth] > 0 && ms->buffer[ms->pos] == GPMF_KEY_END)
+			{
+				ms->pos++;
+				remaining[depth]--;
+			}
+
+			level_done = (ms->pos == ms->buffer_size_longs);
+		}
+	}
+
+cleanup:
+	ms->nest_level = base_level;
+	return ret;
+}
+
+
+GPMF_ERR GPMF_Validate(GPMF_stream *ms, GPMF_LEVELS recurse)
+{
+	if (ms)
+	{
+		return ValidateWalk(ms, recurse, NULL);
 	}
 	else
 	{
@@ -197,6 +378,29 @@ GPMF_ERR GPMF_Validate(GPMF_stream *ms, GPMF_LEVELS recurse)
 }
 
 
+GPMF_ERR GPMF_ValidateAndIndex(GPMF_stream *ms, GPMF_directory *dir)
+{
+	if (ms && dir)
+	{
+		GPMF_index_state ix;
+		GPMF_ERR ret;
+
+		memset(&ix, 0, sizeof(ix));
+		ix.dir = dir; // device ID and name start empty, as GPMF_BuildDirectory() from the start of the payload
+		dir->entry_count = 0;
+		dir->instance_count = 0;
+
+		ret = ValidateWalk(ms, GPMF_RECURSE_LEVELS, &ix);
+		if (ret == GPMF_OK)
+			ret = ix.ret;
+
+		return ret;
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
 GPMF_ERR GPMF_ResetState(GPMF_stream *ms)
 {
 	if (ms)
@@ -535,23 +739,80 @@ GPMF_ERR GPMF_Reserved(uint32_t key)
 	return GPMF_OK;
 }
 
+GPMF_ERR GPMF_AttachDirectory(GPMF_stream *ms, GPMF_directory *dir)
+{
+	if (ms)
+	{
+		ms->directory = dir;
+		return GPMF_OK;
+	}
+	return GPMF_ERROR_MEMORY;
+}
+
+
+// Instances from the current KLV to the end of its STRM, from the attached directory, 0 if it wasn't indexed
+static uint32_t CachedInstances(GPMF_stream *ms)
+{
+	GPMF_directory *dir = ms->directory;
+	uint32_t i;
+
+	if (dir == NULL || ms->pos >= ms->buffer_size_longs)
+		return 0;
+
+	for (i = 0; i < dir->entry_count && i < GPMF_DIRECTORY_LIMIT; i++)
+	{
+		GPMF_stream_entry *entry = &dir->entry[i];
+
+		if (entry->fourcc != ms->buffer[ms->pos] || entry->instances == 0)
+			continue;
+
+		if (entry->sample_pos == ms->pos)
+			return entry->instances;
+
+		if (entry->instances > 1 && entry->sample_pos < ms->pos && entry->instance_index + entry->instances <= dir->instance_count)
+		{
+			uint32_t *instance_pos = &dir->instance_pos[entry->instance_index];
+			uint32_t lo = 1, hi = entry->instances;
+
+			while (lo < hi)
+			{
+				uint32_t mid = (lo + hi) >> 1;
+				if (instance_pos[mid] < ms->pos)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			if (lo < entry->instances && instance_pos[lo] == ms->pos)
+				return entry->instances - lo;
+		}
+	}
+
+	return 0;
+}
+
+
 uint32_t GPMF_PayloadSampleCount(GPMF_stream *ms)
 {
 	uint32_t count = 0;
 	if (ms)
 	{
 		uint32_t fourcc = GPMF_Key(ms);
+		uint32_t instances = CachedInstances(ms);
+
+		if (instances == 0)
+		{
+			GPMF_stream find_stream;
+			GPMF_CopyState(ms, &find_stream);
 
-		GPMF_stream find_stream;
-		GPMF_CopyState(ms, &find_stream);
+			instances = 1;
+			while (GPMF_OK == GPMF_FindNext(&find_stream, fourcc, GPMF_CURRENT_LEVEL|GPMF_TOLERANT)) // Count the instances, not the repeats
+				instances++;
+		}
 
-		if (GPMF_OK == GPMF_FindNext(&find_stream, fourcc, GPMF_CURRENT_LEVEL|GPMF_TOLERANT)) // Count the instances, not the repeats
+		if (instances > 1)
 		{
-			count=2;
-			while (GPMF_OK == GPMF_FindNext(&find_stream, fourcc, GPMF_CURRENT_LEVEL|GPMF_TOLERANT))
-			{
-				count++;
-			} 
+			count = instances;
 		}
 		else
 		{
@@ -564,7 +825,27 @@ uint32_t GPMF_PayloadSampleCount(GPMF_stream *ms)
 }
 
 
-GPMF_ERR GPMF_SeekToSamples(GPMF_stream *ms)
+static void RecordStickyPosition(GPMF_stream *ms, GPMF_stream_entry *entry)
+{
+	uint32_t *sticky_pos = NULL;
+
+	switch (ms->buffer[ms->pos])
+	{
+	case GPMF_KEY_SCALE:			sticky_pos = &entry->scal_pos; break;
+	case GPMF_KEY_SI_UNITS:			sticky_pos = &entry->siun_pos; break;
+	case GPMF_KEY_TYPE:				sticky_pos = &entry->type_pos; break;
+	case GPMF_KEY_MATRIX:			sticky_pos = &entry->mtrx_pos; break;
+	case GPMF_KEY_ORIENTATION_IN:	sticky_pos = &entry->orin_pos; break;
+	case GPMF_KEY_ORIENTATION_OUT:	sticky_pos = &entry->orio_pos; break;
+	default: break;
+	}
+
+	if (sticky_pos && *sticky_pos == 0) // GPMF_FindPrev() returns the first match within the stream
+		*sticky_pos = ms->pos;
+}
+
+
+static GPMF_ERR SeekToSamples(GPMF_stream *ms, GPMF_stream_entry *entry)
 {
 	GPMF_stream prevstate;
 
@@ -587,8 +868,14 @@ GPMF_ERR GPMF_SeekToSamples(GPMF_stream *ms)
 				return ret;
 			}
 
+			if (entry)
+				RecordStickyPosition(ms, entry);
+
 			while (GPMF_OK == (ret = GPMF_Next(ms, GPMF_CURRENT_LEVEL | GPMF_TOLERANT)))
 			{
+				if (entry)
+					RecordStickyPosition(ms, entry);
+
 				if (ms->pos + 1 >= ms->buffer_size_longs)
 				{
 					memcpy(ms, &prevstate, sizeof(GPMF_stream));
@@ -645,6 +932,99 @@ GPMF_ERR GPMF_SeekToSamples(GPMF_stream *ms)
 }
 
 
+GPMF_ERR GPMF_SeekToSamples(GPMF_stream *ms)
+{
+	return SeekToSamples(ms, NULL);
+}
+
+
+GPMF_ERR GPMF_BuildDirectory(GPMF_stream *ms, GPMF_directory *dir)
+{
+	GPMF_stream walk, find_stream;
+
+	if (ms == NULL || dir == NULL || ms->buffer == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	dir->entry_count = 0;
+	dir->instance_count = 0;
+
+	GPMF_CopyState(ms, &walk);
+	GPMF_ResetState(&walk);
+
+	// Each STRM is walked up to its samples, then only its remaining KLVs are searched for further instances. 
+	// The search for the next STRM continues from the samples.
+	while (GPMF_OK == GPMF_FindNext(&walk, GPMF_KEY_STREAM, GPMF_RECURSE_LEVELS | GPMF_TOLERANT))
+	{
+		GPMF_stream_entry *entry;
+		uint32_t strm_pos = walk.pos;
+
+		if (dir->entry_count >= GPMF_DIRECTORY_LIMIT)
+			return GPMF_ERROR_MEMORY;
+
+		entry = &dir->entry[dir->entry_count];
+		memset(entry, 0, sizeof(GPMF_stream_entry));
+
+		if (GPMF_OK == SeekToSamples(&walk, entry))
+		{
+			entry->device_id = walk.device_id;
+			memcpy(entry->device_name, walk.device_name, sizeof(entry->device_name));
+			entry->fourcc = GPMF_Key(&walk);
+			entry->type = (uint32_t)GPMF_Type(&walk);
+			entry->struct_size = GPMF_StructSize(&walk);
+			entry->repeat = GPMF_Repeat(&walk);
+			entry->strm_pos = strm_pos;
+			entry->sample_pos = walk.pos;
+			entry->nest_level = walk.nest_level;
+			memcpy(entry->last_level_pos, walk.last_level_pos, sizeof(entry->last_level_pos));
+			memcpy(entry->nest_size, walk.nest_size, sizeof(entry->nest_size));
+
+			entry->instances = 1;
+			GPMF_CopyState(&walk, &find_stream);
+			while (GPMF_OK == GPMF_FindNext(&find_stream, entry->fourcc, GPMF_CURRENT_LEVEL | GPMF_TOLERANT))
+				RecordInstance(dir, entry, find_stream.pos);
+
+			dir->entry_count++;
+		}
+	}
+
+	return GPMF_OK;
+}
+
+
+GPMF_stream_entry *GPMF_DirectoryFind(GPMF_directory *dir, uint32_t fourcc, uint32_t device_id)
+{
+	if (dir)
+	{
+		uint32_t i;
+		for (i = 0; i < dir->entry_count && i < GPMF_DIRECTORY_LIMIT; i++)
+		{
+			if (dir->entry[i].fourcc == fourcc && (device_id == 0 || dir->entry[i].device_id == device_id))
+				return &dir->entry[i];
+		}
+	}
+	return NULL;
+}
+
+
+GPMF_ERR GPMF_SeekToEntry(GPMF_stream *ms, GPMF_stream_entry *entry)
+{
+	if (ms == NULL || entry == NULL || ms->buffer == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	if (entry->sample_pos + 1 >= ms->buffer_size_longs || entry->nest_level >= GPMF_NEST_LIMIT || ms->buffer[entry->sample_pos] != entry->fourcc)
+		return GPMF_ERROR_BAD_STRUCTURE;
+
+	ms->pos = entry->sample_pos;
+	ms->nest_level = entry->nest_level;
+	memcpy(ms->last_level_pos, entry->last_level_pos, sizeof(ms->last_level_pos));
+	memcpy(ms->nest_size, entry->nest_size, sizeof(ms->nest_size));
+	ms->device_id = entry->device_id;
+	memcpy(ms->device_name, entry->device_name, sizeof(ms->device_name));
+
+	return GPMF_OK;
+}
+
+
 GPMF_ERR GPMF_FindPrev(GPMF_stream *ms, uint32_t fourcc, GPMF_LEVELS recurse)
 {
 	GPMF_stream prevstate;
@@ -1153,53 +1533,217 @@ uint32_t GPMF_SizeOfComplexTYPE(char *type, uint32_t typestringlength)
 }
 
 
-GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples)
+// Big endian to native conversion of a run of same width elements. The output may
+// overlap the input when it starts at or before it (in-place decompressed data.)
+static void ByteSwapBlockScalar(uint8_t *output, const uint8_t *data, uint32_t count, uint32_t typesize)
 {
-	if (ms && buffer)
+	uint32_t i;
+
+	switch (typesize)
 	{
-		uint8_t *data = (uint8_t *)&ms->buffer[ms->pos + 2];
-		uint8_t *output = (uint8_t *)buffer;
-		uint32_t sample_size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 1]);
-		uint32_t remaining_sample_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
-		uint8_t type = GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
-		uint32_t typesize = 1;
-		uint32_t elements = 0;
-		uint32_t typestringlength = 1;
-		char complextype[64] = "L";
+	case 2:
+		for (i = 0; i < count; i++, data += 2, output += 2)
+		{
+			uint16_t v;
+			memcpy(&v, data, 2);
+			v = (uint16_t)BYTESWAP16(v);
+			memcpy(output, &v, 2);
+		}
+		break;
+	case 4:
+		for (i = 0; i < count; i++, data += 4, output += 4)
+		{
+			uint32_t v;
+			memcpy(&v, data, 4);
+			v = BYTESWAP32(v);
+			memcpy(output, &v, 4);
+		}
+		break;
+	case 8:
+		for (i = 0; i < count; i++, data += 8, output += 8)
+		{
+			uint32_t v[2], o[2];
+			memcpy(v, data, 8);
+			o[0] = BYTESWAP32(v[1]);
+			o[1] = BYTESWAP32(v[0]);
+			memcpy(output, o, 8);
+		}
+		break;
+	default: //1, 16 or more not byteswapped
+		memmove(output, data, (size_t)count * typesize);
+		break;
+	}
+}
 
-		if (type == GPMF_TYPE_NEST)
-			return GPMF_ERROR_BAD_STRUCTURE;
-		
-		if (GPMF_OK != IsValidSize(ms, remaining_sample_size>>2))
-			return GPMF_ERROR_BAD_STRUCTURE;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GPMF_BYTESWAP_SSE2 1
 
-		if (type == GPMF_TYPE_COMPRESSED)
+static uint32_t ByteSwapBlockSSE2(uint8_t *output, const uint8_t *data, uint32_t count, uint32_t typesize)
+{
+	uint32_t bytes = (count * typesize) & ~15, i;
+
+	for (i = 0; i < bytes; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		if (typesize == 4)
 		{
-			if (GPMF_OK == GPMF_Decompress(ms, (uint32_t *)output, buffersize))
-			{
-				uint32_t compressed_typesize = ms->buffer[ms->pos + 2];
-				sample_size = GPMF_SAMPLE_SIZE(compressed_typesize);
-				remaining_sample_size = GPMF_DATA_PACKEDSIZE(compressed_typesize);
-				type = GPMF_SAMPLE_TYPE(compressed_typesize);
-				data = output;
-			}
-			else
-				return GPMF_ERROR_MEMORY;
+			v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		}
+		else if (typesize == 8)
+		{
+			v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
 		}
+		_mm_storeu_si128((__m128i *)(output + i), v);
+	}
+	return bytes / typesize;
+}
+#endif
 
-		if (sample_size * read_samples > buffersize)
-			return GPMF_ERROR_MEMORY;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GPMF_BYTESWAP_AVX2 1
 
-		remaining_sample_size -= sample_offset * sample_size; // skip samples
-		data += sample_offset * sample_size;
+__attribute__((target("avx2")))
+static uint32_t ByteSwapBlockAVX2(uint8_t *output, const uint8_t *data, uint32_t count, uint32_t typesize)
+{
+	uint32_t bytes = (count * typesize) & ~31, i;
+	__m256i mask;
 
-		if (remaining_sample_size < sample_size * read_samples)
-			return GPMF_ERROR_MEMORY;
+	if (typesize == 2)
+		mask = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14, 1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+	else if (typesize == 4)
+		mask = _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12, 3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+	else
+		mask = _mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8, 7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
 
-		if (type == GPMF_TYPE_COMPLEX)
-		{
-			GPMF_stream find_stream;
-			GPMF_CopyState(ms, &find_stream);
+	for (i = 0; i < bytes; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+		_mm256_storeu_si256((__m256i *)(output + i), _mm256_shuffle_epi8(v, mask));
+	}
+	return bytes / typesize;
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GPMF_BYTESWAP_NEON 1
+
+static uint32_t ByteSwapBlockNEON(uint8_t *output, const uint8_t *data, uint32_t count, uint32_t typesize)
+{
+	uint32_t bytes = (count * typesize) & ~15, i;
+
+	for (i = 0; i < bytes; i += 16)
+	{
+		uint8x16_t v = vld1q_u8(data + i);
+		if (typesize == 2)
+			v = vrev16q_u8(v);
+		else if (typesize == 4)
+			v = vrev32q_u8(v);
+		else
+			v = vrev64q_u8(v);
+		vst1q_u8(output + i, v);
+	}
+	return bytes / typesize;
+}
+#endif
+
+static void ByteSwapBlock(uint8_t *output, const uint8_t *data, uint32_t count, uint32_t typesize)
+{
+	uint32_t done = 0;
+
+	if (typesize == 2 || typesize == 4 || typesize == 8)
+	{
+#if GPMF_BYTESWAP_AVX2
+		if (__builtin_cpu_supports("avx2"))
+			done = ByteSwapBlockAVX2(output, data, count, typesize);
+#endif
+#if GPMF_BYTESWAP_SSE2
+		if (done == 0)
+			done = ByteSwapBlockSSE2(output, data, count, typesize);
+#endif
+#if GPMF_BYTESWAP_NEON
+		done = ByteSwapBlockNEON(output, data, count, typesize);
+#endif
+	}
+
+	// the tail, or everything without a vector unit
+	ByteSwapBlockScalar(output + done * typesize, data + done * typesize, count - done, typesize);
+}
+
+
+// Format samples to local endian, the complex TYPE from ctx when given, otherwise searched for
+static GPMF_ERR FormatSamples(GPMF_stream *ms, GPMF_stream_context *ctx, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples)
+{
+	if (ms && buffer)
+	{
+		uint8_t *data = (uint8_t *)&ms->buffer[ms->pos + 2];
+		uint8_t *output = (uint8_t *)buffer;
+		uint32_t sample_size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 1]);
+		uint32_t remaining_sample_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
+		uint8_t type = GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
+		uint32_t typesize = 1;
+		uint32_t elements = 0;
+		uint32_t typestringlength = 1;
+		char complextype[64] = "L";
+
+		if (type == GPMF_TYPE_NEST)
+			return GPMF_ERROR_BAD_STRUCTURE;
+		
+		if (GPMF_OK != IsValidSize(ms, remaining_sample_size>>2))
+			return GPMF_ERROR_BAD_STRUCTURE;
+
+		if (type == GPMF_TYPE_COMPRESSED)
+		{
+			GPMF_decompressor dc;
+			uint32_t compressed_typesize = ms->buffer[ms->pos + 2];
+			sample_size = GPMF_SAMPLE_SIZE(compressed_typesize);
+			remaining_sample_size = GPMF_DATA_PACKEDSIZE(compressed_typesize);
+			type = GPMF_SAMPLE_TYPE(compressed_typesize);
+			data = output;
+
+			if (GPMF_OK == GPMF_DecompressInit(ms, &dc)) // decode only the samples requested
+			{
+				if (GPMF_OK != GPMF_DecompressSeek(&dc, sample_offset) ||
+					GPMF_OK != GPMF_DecompressNext(&dc, output, buffersize, read_samples))
+					return GPMF_ERROR_MEMORY;
+
+				remaining_sample_size = sample_size * read_samples;
+				sample_offset = 0;
+			}
+			else if (GPMF_OK != GPMF_Decompress(ms, (uint32_t *)output, buffersize))
+				return GPMF_ERROR_MEMORY;
+		}
+
+		if (sample_size * read_samples > buffersize)
+			return GPMF_ERROR_MEMORY;
+
+		remaining_sample_size -= sample_offset * sample_size; // skip samples
+		data += sample_offset * sample_size;
+
+		if (remaining_sample_size < sample_size * read_samples)
+			return GPMF_ERROR_MEMORY;
+
+		if (type == GPMF_TYPE_COMPLEX && ctx)
+		{
+			if (ctx->type_error != GPMF_OK)
+				return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+
+			memcpy(complextype, ctx->complextype, sizeof(complextype));
+			typestringlength = ctx->complextype_len;
+			elements = (uint32_t)strlen(complextype);
+
+			if (sample_size != GPMF_SizeOfComplexTYPE(complextype, typestringlength))
+				return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		}
+		else if (type == GPMF_TYPE_COMPLEX)
+		{
+			GPMF_stream find_stream;
+			GPMF_CopyState(ms, &find_stream);
 
 			if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_TYPE, GPMF_RECURSE_LEVELS|GPMF_TOLERANT))
 			{
@@ -1233,6 +1777,12 @@ GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize,
 			elements = sample_size / typesize;
 		}
 
+		if (type != GPMF_TYPE_COMPLEX) // homogeneous, every element has the same width
+		{
+			ByteSwapBlock(output, data, elements * read_samples, typesize);
+			return GPMF_OK;
+		}
+
 		while (read_samples--)
 		{
 			uint32_t i,j;
@@ -1307,6 +1857,21 @@ GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize,
 }
 
 
+GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples)
+{
+	return FormatSamples(ms, NULL, buffer, buffersize, sample_offset, read_samples);
+}
+
+
+GPMF_ERR GPMF_FormattedDataWithContext(GPMF_stream *ms, GPMF_stream_context *ctx, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples)
+{
+	if (ctx)
+		return FormatSamples(ms, ctx, buffer, buffersize, sample_offset, read_samples);
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
 #define MACRO_CAST_SCALE_UNSIGNED_TYPE(casttype)		\
 {																												\
 	casttype *tmp = (casttype *)output;																			\
@@ -1472,812 +2037,2342 @@ GPMF_ERR GPMF_FormattedData(GPMF_stream *ms, void *buffer, uint32_t buffersize,
 
 
 
-GPMF_ERR GPMF_ScaledData(GPMF_stream *ms, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType outputType)
-{
-	if (ms && buffer)
-	{
-		GPMF_ERR ret = GPMF_OK;
-		uint8_t *data = (uint8_t *)&ms->buffer[ms->pos + 2];
-		uint8_t *output = (uint8_t *)buffer;
-		uint32_t sample_size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 1]);
-		uint32_t output_sample_size = GPMF_SizeofType(outputType);
-		uint32_t remaining_sample_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
-		uint32_t total_sample_data_bytes = remaining_sample_size;
-		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
-		char complextype[64] = "L";
-		uint32_t inputtypesize = 0;
-		uint32_t inputtypeelements = 0;
-
-		uint8_t scal_type = 0;
-		uint8_t scal_count = 0;
-		uint32_t scal_typesize = 0;
-		uint32_t *scal_data = NULL;
-		uint32_t scal_buffer[64];
-		uint32_t scal_buffersize = sizeof(scal_buffer);
-
-		uint8_t mtrx_type = 0;
-		uint8_t mtrx_count = 0;
-		uint32_t mtrx_typesize = 0;
-		uint32_t mtrx_sample_size = 0;
-		uint32_t *mtrx_data = NULL;
-		uint32_t mtrx_buffer[64];
-		uint32_t mtrx_buffersize = sizeof(mtrx_buffer);
-		uint32_t mtrx_calibration = 0;
-
-		char *orin_data = NULL;
-		uint32_t orin_len = 0;
-		char *orio_data = NULL;
-		uint32_t orio_len = 0;
+// Fast path for the common IMU case: integer samples scaled into float or double. Whole blocks are
+// converted, divided by a repeating pattern of scales, then any ORIN/ORIO reordering or MTRX calibration
+// is applied. The operations and their order match the per-element macros above, so results are identical.
 
-		uint32_t *uncompressedSamples = NULL;
-		uint32_t elements = 1;
-		uint32_t noswap = 0;
+#define GPMF_SCALE_FAST_ELEMENTS	8	// MACRO_APPLY_CALIBRATION is limited to 8 elements too
+#define GPMF_SCALE_FAST_BLOCK		8	// samples per scale pattern, a multiple of every vector width used below
+#if GPMF_SCALE_FAST_ELEMENTS * GPMF_SCALE_FAST_BLOCK > GPMF_SCRATCH_PATTERN
+#error GPMF_scratch.pattern is too small for the scale pattern
+#endif
 
-		type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
+#define MACRO_CONVERT_BLOCK(outputcast, inputcast, swap, tempcast)	\
+{																	\
+	for (; i < count; i++)											\
+	{																\
+		tempcast temp;												\
+		memcpy(&temp, data + i * sizeof(tempcast), sizeof(tempcast));	\
+		if (!noswap) temp = (tempcast)swap(temp);					\
+		out[i] = (outputcast)(inputcast)temp;						\
+	}																\
+}
 
-		if (type == GPMF_TYPE_NEST)
-			return GPMF_ERROR_MEMORY;
+#if GPMF_BYTESWAP_SSE2
+static uint32_t ConvertBlockSSE2(uint8_t *output, GPMF_SampleType outputType, const uint8_t *data, uint8_t type, uint32_t noswap, uint32_t count)
+{
+	uint32_t i, done = 0;
 
-		if (type == GPMF_TYPE_COMPRESSED)
+	if (type == GPMF_TYPE_SIGNED_SHORT || type == GPMF_TYPE_UNSIGNED_SHORT)
+	{
+		done = count & ~7;
+		for (i = 0; i < done; i += 8)
 		{
-			uint32_t neededunc = GPMF_FormattedDataSize(ms);
-			uint32_t samples = GPMF_Repeat(ms);
+			__m128i v = _mm_loadu_si128((const __m128i *)(data + i * 2)), lo, hi;
+			if (!noswap) v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			if (type == GPMF_TYPE_SIGNED_SHORT)
+			{
+				lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+				hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+			}
+			else
+			{
+				lo = _mm_unpacklo_epi16(v, _mm_setzero_si128());
+				hi = _mm_unpackhi_epi16(v, _mm_setzero_si128());
+			}
 
-			remaining_sample_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 2]);
-			total_sample_data_bytes = remaining_sample_size;
+			if (outputType == GPMF_TYPE_FLOAT)
+			{
+				float *out = (float *)output + i;
+				_mm_storeu_ps(out, _mm_cvtepi32_ps(lo));
+				_mm_storeu_ps(out + 4, _mm_cvtepi32_ps(hi));
+			}
+			else
+			{
+				double *out = (double *)output + i;
+				_mm_storeu_pd(out, _mm_cvtepi32_pd(lo));
+				_mm_storeu_pd(out + 2, _mm_cvtepi32_pd(_mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2))));
+				_mm_storeu_pd(out + 4, _mm_cvtepi32_pd(hi));
+				_mm_storeu_pd(out + 6, _mm_cvtepi32_pd(_mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2))));
+			}
+		}
+	}
+	else if (type == GPMF_TYPE_SIGNED_LONG)
+	{
+		done = count & ~3;
+		for (i = 0; i < done; i += 4)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(data + i * 4));
+			if (!noswap)
+			{
+				v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+				v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+				v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+			}
 
-			uncompressedSamples = (uint32_t *)malloc(neededunc + 12);
-			if (uncompressedSamples)
+			if (outputType == GPMF_TYPE_FLOAT)
+				_mm_storeu_ps((float *)output + i, _mm_cvtepi32_ps(v));
+			else
 			{
-				if (GPMF_OK == GPMF_FormattedData(ms, uncompressedSamples, neededunc, 0, samples))
-				{
-					read_samples = samples;
-					elements = GPMF_ElementsInStruct(ms);
-					type = GPMF_Type(ms);
-					complextype[0] = (char)type;
-					inputtypesize = GPMF_SizeofType((GPMF_SampleType)type);
-					if (inputtypesize == 0)
-					{
-						ret = GPMF_ERROR_MEMORY;
-						goto cleanup;
-					}
-					inputtypeelements = 1;
-					noswap = 1; // data is formatted to LittleEndian
+				double *out = (double *)output + i;
+				_mm_storeu_pd(out, _mm_cvtepi32_pd(v));
+				_mm_storeu_pd(out + 2, _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2))));
+			}
+		}
+	}
 
-					data = (uint8_t *)uncompressedSamples;
+	return done;
+}
 
-					remaining_sample_size -= sample_offset * sample_size; // skip samples
-					data += sample_offset * sample_size;
+static void DivideBlockSSE2(uint8_t *output, GPMF_SampleType outputType, const uint8_t *pattern, uint32_t period, uint32_t blocks)
+{
+	uint32_t b, j;
 
-					if (remaining_sample_size < sample_size * read_samples)
-					{
-						ret = GPMF_ERROR_MEMORY;
-						goto cleanup;
-					}
-				}
-			}
-		}
-		else if (type == GPMF_TYPE_COMPLEX)
-		{
+	if (outputType == GPMF_TYPE_FLOAT)
+	{
+		float *out = (float *)output;
+		const float *pat = (const float *)pattern;
+		for (b = 0; b < blocks; b++, out += period)
+			for (j = 0; j < period; j += 4)
+				_mm_storeu_ps(out + j, _mm_div_ps(_mm_loadu_ps(out + j), _mm_loadu_ps(pat + j)));
+	}
+	else
+	{
+		double *out = (double *)output;
+		const double *pat = (const double *)pattern;
+		for (b = 0; b < blocks; b++, out += period)
+			for (j = 0; j < period; j += 2)
+				_mm_storeu_pd(out + j, _mm_div_pd(_mm_loadu_pd(out + j), _mm_loadu_pd(pat + j)));
+	}
+}
+#endif
 
-			GPMF_stream find_stream;
-			GPMF_CopyState(ms, &find_stream);
+#if GPMF_BYTESWAP_AVX2
+__attribute__((target("avx")))
+static void DivideBlockAVX(uint8_t *output, GPMF_SampleType outputType, const uint8_t *pattern, uint32_t period, uint32_t blocks)
+{
+	uint32_t b, j;
 
-			remaining_sample_size -= sample_offset * sample_size; // skip samples
-			data += sample_offset * sample_size;
+	if (outputType == GPMF_TYPE_FLOAT)
+	{
+		float *out = (float *)output;
+		const float *pat = (const float *)pattern;
+		for (b = 0; b < blocks; b++, out += period)
+			for (j = 0; j < period; j += 8)
+				_mm256_storeu_ps(out + j, _mm256_div_ps(_mm256_loadu_ps(out + j), _mm256_loadu_ps(pat + j)));
+	}
+	else
+	{
+		double *out = (double *)output;
+		const double *pat = (const double *)pattern;
+		for (b = 0; b < blocks; b++, out += period)
+			for (j = 0; j < period; j += 4)
+				_mm256_storeu_pd(out + j, _mm256_div_pd(_mm256_loadu_pd(out + j), _mm256_loadu_pd(pat + j)));
+	}
+}
+#endif
 
-			if (remaining_sample_size < sample_size * read_samples)
-				return GPMF_ERROR_MEMORY;
+#if GPMF_BYTESWAP_NEON && defined(__aarch64__)
+static uint32_t ConvertBlockNEON(uint8_t *output, GPMF_SampleType outputType, const uint8_t *data, uint8_t type, uint32_t noswap, uint32_t count)
+{
+	uint32_t i, done = 0;
 
-			if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_TYPE, GPMF_RECURSE_LEVELS|GPMF_TOLERANT))
+	if (type == GPMF_TYPE_SIGNED_SHORT || type == GPMF_TYPE_UNSIGNED_SHORT)
+	{
+		done = count & ~7;
+		for (i = 0; i < done; i += 8)
+		{
+			uint8x16_t v = vld1q_u8(data + i * 2);
+			int32x4_t lo, hi;
+			if (!noswap) v = vrev16q_u8(v);
+			if (type == GPMF_TYPE_SIGNED_SHORT)
 			{
-				char *data1 = (char *)GPMF_RawData(&find_stream);
-				uint32_t size = GPMF_RawDataSize(&find_stream);
-				uint32_t typestringlength = sizeof(complextype);
-				if (GPMF_OK == GPMF_ExpandComplexTYPE(data1, size, complextype, &typestringlength))
-				{
-					inputtypeelements = elements = typestringlength;
+				int16x8_t s = vreinterpretq_s16_u8(v);
+				lo = vmovl_s16(vget_low_s16(s));
+				hi = vmovl_s16(vget_high_s16(s));
+			}
+			else
+			{
+				uint16x8_t u = vreinterpretq_u16_u8(v);
+				lo = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(u)));
+				hi = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(u)));
+			}
 
-					if (sample_size != GPMF_SizeOfComplexTYPE(complextype, typestringlength))
-						return GPMF_ERROR_TYPE_NOT_SUPPORTED;
-				}
-				else
-					return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+			if (outputType == GPMF_TYPE_FLOAT)
+			{
+				float *out = (float *)output + i;
+				vst1q_f32(out, vcvtq_f32_s32(lo));
+				vst1q_f32(out + 4, vcvtq_f32_s32(hi));
 			}
 			else
-				return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+			{
+				double *out = (double *)output + i;
+				vst1q_f64(out, vcvtq_f64_s64(vmovl_s32(vget_low_s32(lo))));
+				vst1q_f64(out + 2, vcvtq_f64_s64(vmovl_s32(vget_high_s32(lo))));
+				vst1q_f64(out + 4, vcvtq_f64_s64(vmovl_s32(vget_low_s32(hi))));
+				vst1q_f64(out + 6, vcvtq_f64_s64(vmovl_s32(vget_high_s32(hi))));
+			}
 		}
-		else
+	}
+	else if (type == GPMF_TYPE_SIGNED_LONG)
+	{
+		done = count & ~3;
+		for (i = 0; i < done; i += 4)
 		{
+			uint8x16_t v = vld1q_u8(data + i * 4);
+			int32x4_t s;
+			if (!noswap) v = vrev32q_u8(v);
+			s = vreinterpretq_s32_u8(v);
 
-			remaining_sample_size -= sample_offset * sample_size; // skip samples
-			data += sample_offset * sample_size;
+			if (outputType == GPMF_TYPE_FLOAT)
+				vst1q_f32((float *)output + i, vcvtq_f32_s32(s));
+			else
+			{
+				double *out = (double *)output + i;
+				vst1q_f64(out, vcvtq_f64_s64(vmovl_s32(vget_low_s32(s))));
+				vst1q_f64(out + 2, vcvtq_f64_s64(vmovl_s32(vget_high_s32(s))));
+			}
+		}
+	}
 
-			if (remaining_sample_size < sample_size * read_samples)
-				return GPMF_ERROR_MEMORY;
+	return done;
+}
 
-			complextype[0] = type;
-			inputtypesize = GPMF_SizeofType((GPMF_SampleType)type);
-			if (inputtypesize == 0)
-				return GPMF_ERROR_MEMORY;
-			inputtypeelements = 1;
-			elements = sample_size / inputtypesize;
-		}
+static void DivideBlockNEON(uint8_t *output, GPMF_SampleType outputType, const uint8_t *pattern, uint32_t period, uint32_t blocks)
+{
+	uint32_t b, j;
+
+	if (outputType == GPMF_TYPE_FLOAT)
+	{
+		float *out = (float *)output;
+		const float *pat = (const float *)pattern;
+		for (b = 0; b < blocks; b++, out += period)
+			for (j = 0; j < period; j += 4)
+				vst1q_f32(out + j, vdivq_f32(vld1q_f32(out + j), vld1q_f32(pat + j)));
+	}
+	else
+	{
+		double *out = (double *)output;
+		const double *pat = (const double *)pattern;
+		for (b = 0; b < blocks; b++, out += period)
+			for (j = 0; j < period; j += 2)
+				vst1q_f64(out + j, vdivq_f64(vld1q_f64(out + j), vld1q_f64(pat + j)));
+	}
+}
+#define GPMF_SCALE_NEON 1
+#endif
+
+static void ConvertBlock(uint8_t *output, GPMF_SampleType outputType, const uint8_t *data, uint8_t type, uint32_t noswap, uint32_t count)
+{
+	uint32_t i = 0;
+
+#if GPMF_BYTESWAP_SSE2
+	i = ConvertBlockSSE2(output, outputType, data, type, noswap, count);
+#elif GPMF_SCALE_NEON
+	i = ConvertBlockNEON(output, outputType, data, type, noswap, count);
+#endif
 
-		if (output_sample_size * elements * read_samples > buffersize)
+	if (outputType == GPMF_TYPE_FLOAT)
+	{
+		float *out = (float *)output;
+		switch (type)
 		{
-			ret = GPMF_ERROR_MEMORY;
-			goto cleanup;
+		case GPMF_TYPE_SIGNED_BYTE:		MACRO_CONVERT_BLOCK(float, int8_t, NOSWAP8, uint8_t) break;
+		case GPMF_TYPE_UNSIGNED_BYTE:	MACRO_CONVERT_BLOCK(float, uint8_t, NOSWAP8, uint8_t) break;
+		case GPMF_TYPE_SIGNED_SHORT:	MACRO_CONVERT_BLOCK(float, int16_t, BYTESWAP16, uint16_t) break;
+		case GPMF_TYPE_UNSIGNED_SHORT:	MACRO_CONVERT_BLOCK(float, uint16_t, BYTESWAP16, uint16_t) break;
+		case GPMF_TYPE_SIGNED_LONG:		MACRO_CONVERT_BLOCK(float, int32_t, BYTESWAP32, uint32_t) break;
+		case GPMF_TYPE_UNSIGNED_LONG:	MACRO_CONVERT_BLOCK(float, uint32_t, BYTESWAP32, uint32_t) break;
+		default: break;
 		}
-
-		if (read_samples * sample_size > total_sample_data_bytes)
+	}
+	else
+	{
+		double *out = (double *)output;
+		switch (type)
 		{
-			ret = GPMF_ERROR_MEMORY;
-			goto cleanup;
+		case GPMF_TYPE_SIGNED_BYTE:		MACRO_CONVERT_BLOCK(double, int8_t, NOSWAP8, uint8_t) break;
+		case GPMF_TYPE_UNSIGNED_BYTE:	MACRO_CONVERT_BLOCK(double, uint8_t, NOSWAP8, uint8_t) break;
+		case GPMF_TYPE_SIGNED_SHORT:	MACRO_CONVERT_BLOCK(double, int16_t, BYTESWAP16, uint16_t) break;
+		case GPMF_TYPE_UNSIGNED_SHORT:	MACRO_CONVERT_BLOCK(double, uint16_t, BYTESWAP16, uint16_t) break;
+		case GPMF_TYPE_SIGNED_LONG:		MACRO_CONVERT_BLOCK(double, int32_t, BYTESWAP32, uint32_t) break;
+		case GPMF_TYPE_UNSIGNED_LONG:	MACRO_CONVERT_BLOCK(double, uint32_t, BYTESWAP32, uint32_t) break;
+		default: break;
 		}
+	}
+}
 
-		switch (outputType)	{
-		case GPMF_TYPE_SIGNED_BYTE:
-		case GPMF_TYPE_UNSIGNED_BYTE:
-		case GPMF_TYPE_SIGNED_SHORT:
-		case GPMF_TYPE_UNSIGNED_SHORT:
-		case GPMF_TYPE_FLOAT:
-		case GPMF_TYPE_SIGNED_LONG:
+static void DivideBlock(uint8_t *output, GPMF_SampleType outputType, const uint8_t *pattern, uint32_t period, uint32_t count)
+{
+	uint32_t blocks = count / period, i = blocks * period;
+
+#if GPMF_BYTESWAP_AVX2
+	if (__builtin_cpu_supports("avx"))
+		DivideBlockAVX(output, outputType, pattern, period, blocks);
+	else
+		DivideBlockSSE2(output, outputType, pattern, period, blocks);
+#elif GPMF_BYTESWAP_SSE2
+	DivideBlockSSE2(output, outputType, pattern, period, blocks);
+#elif GPMF_SCALE_NEON
+	DivideBlockNEON(output, outputType, pattern, period, blocks);
+#else
+	i = 0;
+#endif
+
+	if (outputType == GPMF_TYPE_FLOAT)
+	{
+		float *out = (float *)output;
+		const float *pat = (const float *)pattern;
+		for (; i < count; i++)
+			out[i] = out[i] / pat[i % period];
+	}
+	else
+	{
+		double *out = (double *)output;
+		const double *pat = (const double *)pattern;
+		for (; i < count; i++)
+			out[i] = out[i] / pat[i % period];
+	}
+}
+
+#define MACRO_SCALE_VALUE(outputcast, scal_type, scal_data8, value)									\
+{																									\
+	switch (scal_type)																				\
+	{																								\
+	case GPMF_TYPE_SIGNED_BYTE:		value = (outputcast)*((int8_t *)scal_data8);	break;			\
+	case GPMF_TYPE_UNSIGNED_BYTE:	value = (outputcast)*((uint8_t *)scal_data8);	break;			\
+	case GPMF_TYPE_SIGNED_SHORT:	value = (outputcast)*((int16_t *)scal_data8);	break;			\
+	case GPMF_TYPE_UNSIGNED_SHORT:	value = (outputcast)*((uint16_t *)scal_data8);	break;			\
+	case GPMF_TYPE_SIGNED_LONG:		value = (outputcast)*((int32_t *)scal_data8);	break;			\
+	case GPMF_TYPE_UNSIGNED_LONG:	value = (outputcast)*((uint32_t *)scal_data8);	break;			\
+	case GPMF_TYPE_FLOAT:			value = (outputcast)*((float *)scal_data8);		break;			\
+	default: value = 0; break;																		\
+	}																								\
+}
+
+// Reorder each sample by a signed permutation, result[y] = sign[y] * sample[src[y]], and leave
+// zeros positive as summing the orientation matrix rows does.
+#define MACRO_PERMUTE_SAMPLES(outputcast)															\
+{																									\
+	outputcast *out = (outputcast *)output, tmp[GPMF_SCALE_FAST_ELEMENTS];							\
+	for (s = 0; s < samples; s++, out += elements)													\
+	{																								\
+		for (y = 0; y < elements; y++) tmp[y] = out[y];												\
+		for (y = 0; y < elements; y++) out[y] = tmp[src[y]] * (outputcast)sign[y];					\
+	}																								\
+}
+
+#define MACRO_POSITIVE_ZEROS(outputcast)															\
+{																									\
+	outputcast *out = (outputcast *)output;															\
+	for (s = 0; s < samples * elements; s++) out[s] += (outputcast)0;								\
+}
+
+#define MACRO_APPLY_CALIBRATION_BLOCK(outputcast)													\
+{																									\
+	outputcast *out = (outputcast *)output, tmpbuf[GPMF_SCALE_FAST_ELEMENTS], m[GPMF_SCALE_FAST_ELEMENTS*GPMF_SCALE_FAST_ELEMENTS];	\
+	for (y = 0; y < elements*elements; y++)															\
+	{																								\
+		switch (mtrx_type)																			\
+		{																							\
+		case GPMF_TYPE_SIGNED_BYTE:		m[y] = (outputcast)((int8_t *)mtrx_data)[y];	break;		\
+		case GPMF_TYPE_UNSIGNED_BYTE:	m[y] = (outputcast)((uint8_t *)mtrx_data)[y];	break;		\
+		case GPMF_TYPE_SIGNED_SHORT:	m[y] = (outputcast)((int16_t *)mtrx_data)[y];	break;		\
+		case GPMF_TYPE_UNSIGNED_SHORT:	m[y] = (outputcast)((uint16_t *)mtrx_data)[y];	break;		\
+		case GPMF_TYPE_SIGNED_LONG:		m[y] = (outputcast)((int32_t *)mtrx_data)[y];	break;		\
+		case GPMF_TYPE_UNSIGNED_LONG:	m[y] = (outputcast)((uint32_t *)mtrx_data)[y];	break;		\
+		case GPMF_TYPE_FLOAT:			m[y] = (outputcast)((float *)mtrx_data)[y];		break;		\
+		case GPMF_TYPE_DOUBLE:			m[y] = (outputcast)((double *)mtrx_data)[y];	break;		\
+		default: m[y] = 0; break;																	\
+		}																							\
+	}																								\
+	for (s = 0; s < samples; s++, out += elements)													\
+	{																								\
+		for (y = 0; y < elements; y++) tmpbuf[y] = 0;												\
+		for (y = 0; y < elements; y++) for (x = 0; x < elements; x++) tmpbuf[y] += out[x] * m[y*elements + x];	\
+		for (y = 0; y < elements; y++) out[y] = tmpbuf[y];											\
+	}																								\
+}
+
+// Returns GPMF_ERROR_TYPE_NOT_SUPPORTED, without touching the output, when the general path is needed.
+static GPMF_ERR ScaledDataFast(uint8_t *output, GPMF_SampleType outputType, const uint8_t *data, uint8_t type, uint32_t noswap,
+	uint32_t elements, uint32_t samples, uint8_t scal_type, uint32_t scal_count, const uint32_t *scal_data,
+	uint8_t mtrx_type, const uint32_t *mtrx_data, uint32_t mtrx_calibration, uint32_t mtrx_orientation, double *pattern)
+{
+	uint32_t src[GPMF_SCALE_FAST_ELEMENTS];
+	int32_t sign[GPMF_SCALE_FAST_ELEMENTS];
+	uint32_t period = elements * GPMF_SCALE_FAST_BLOCK;
+	uint32_t s, x, y;
+
+	if (outputType != GPMF_TYPE_FLOAT && outputType != GPMF_TYPE_DOUBLE)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+
+	switch (type)
+	{
+	case GPMF_TYPE_SIGNED_BYTE:
+	case GPMF_TYPE_UNSIGNED_BYTE:
+	case GPMF_TYPE_SIGNED_SHORT:
+	case GPMF_TYPE_UNSIGNED_SHORT:
+	case GPMF_TYPE_SIGNED_LONG:
+	case GPMF_TYPE_UNSIGNED_LONG:
+		break;
+	default:
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+	}
+
+	if (elements == 0 || elements > GPMF_SCALE_FAST_ELEMENTS || scal_data == NULL)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+
+	if (mtrx_calibration && !mtrx_orientation)
+	{
+		switch (mtrx_type)
+		{
+		case GPMF_TYPE_SIGNED_BYTE:
+		case GPMF_TYPE_UNSIGNED_BYTE:
+		case GPMF_TYPE_SIGNED_SHORT:
+		case GPMF_TYPE_UNSIGNED_SHORT:
+		case GPMF_TYPE_SIGNED_LONG:
 		case GPMF_TYPE_UNSIGNED_LONG:
+		case GPMF_TYPE_FLOAT:
 		case GPMF_TYPE_DOUBLE:
-			// All supported formats.
+			break;
+		default:
+			return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		}
+	}
+
+	if (mtrx_orientation) // a signed permutation, otherwise summing the matrix row differs from a reorder
+	{
+		for (y = 0; y < elements; y++)
 		{
-			GPMF_stream fs;
-			GPMF_CopyState(ms, &fs);
+			uint32_t found = 0;
+			for (x = 0; x < elements; x++)
+			{
+				double m = (outputType == GPMF_TYPE_FLOAT) ? (double)((float *)mtrx_data)[y*elements + x] : ((double *)mtrx_data)[y*elements + x];
+				if (m != 0.0)
+				{
+					src[y] = x;
+					sign[y] = m > 0.0 ? 1 : -1;
+					found++;
+				}
+			}
+			if (found != 1)
+				return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		}
+	}
+
+	for (x = 0; x < elements; x++) // inf/NaN from a zero scale propagate differently through the matrix
+	{
+		const uint8_t *scal_data8 = (const uint8_t *)scal_data;
+		double value;
+
+		if (scal_count > 1)
+			scal_data8 += x * GPMF_SizeofType((GPMF_SampleType)scal_type);
+		MACRO_SCALE_VALUE(double, scal_type, scal_data8, value);
+		if (value == 0.0)
+			return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+	}
+
+	// The scale for each output element, repeated for a block of samples. A reordered sample is divided
+	// by the scale of the element it came from.
+	for (x = 0; x < period; x++)
+	{
+		uint32_t e = x % elements;
+		const uint8_t *scal_data8 = (const uint8_t *)scal_data;
+
+		if (mtrx_orientation)
+			e = src[e];
+		if (scal_count > 1)
+			scal_data8 += e * GPMF_SizeofType((GPMF_SampleType)scal_type);
+
+		if (outputType == GPMF_TYPE_FLOAT)
+		{
+			float value;
+			MACRO_SCALE_VALUE(float, scal_type, scal_data8, value);
+			((float *)pattern)[x] = value;
+		}
+		else
+		{
+			double value;
+			MACRO_SCALE_VALUE(double, scal_type, scal_data8, value);
+			pattern[x] = value;
+		}
+	}
+
+	ConvertBlock(output, outputType, data, type, noswap, samples * elements);
+
+	if (mtrx_orientation)
+	{
+		if (outputType == GPMF_TYPE_FLOAT)
+			MACRO_PERMUTE_SAMPLES(float)
+		else
+			MACRO_PERMUTE_SAMPLES(double)
+	}
+
+	DivideBlock(output, outputType, (const uint8_t *)pattern, period, samples * elements);
+
+	if (mtrx_orientation)
+	{
+		if (outputType == GPMF_TYPE_FLOAT)
+			MACRO_POSITIVE_ZEROS(float)
+		else
+			MACRO_POSITIVE_ZEROS(double)
+	}
+	else if (mtrx_calibration)
+	{
+		if (outputType == GPMF_TYPE_FLOAT)
+			MACRO_APPLY_CALIBRATION_BLOCK(float)
+		else
+			MACRO_APPLY_CALIBRATION_BLOCK(double)
+	}
+
+	return GPMF_OK;
+}
+
+
+// Sticky metadata used for scaling, in GPMF_stream_context.sticky[] order
+enum
+{
+	STICKY_SCAL = 0,
+	STICKY_TYPE,
+	STICKY_MTRX,
+	STICKY_ORIN,
+	STICKY_ORIO
+};
+
+static const uint32_t StickyKeys[GPMF_CONTEXT_STICKY] =
+{
+	GPMF_KEY_SCALE, GPMF_KEY_TYPE, GPMF_KEY_MATRIX, GPMF_KEY_ORIENTATION_IN, GPMF_KEY_ORIENTATION_OUT
+};
+
+
+// One walk of the current level finding what GPMF_FindPrev(CURRENT_LEVEL) would for every sticky key,
+// the first match between the start of the level and the current position. 0 when not found.
+static void FindStickyPositions(GPMF_stream *ms, uint32_t *found)
+{
+	GPMF_stream fs;
+	uint32_t curr_level = ms->nest_level;
+	uint32_t i;
+
+	for (i = 0; i < GPMF_CONTEXT_STICKY; i++)
+		found[i] = 0;
+
+	if (ms->pos >= ms->buffer_size_longs || curr_level == 0)
+		return;
+
+	GPMF_CopyState(ms, &fs);
+	fs.last_seek[curr_level] = fs.pos;
+	fs.pos = fs.last_level_pos[curr_level - 1] + 2;
+	fs.nest_size[curr_level] += fs.last_seek[curr_level] - fs.pos;
+	do
+	{
+		if (fs.last_seek[curr_level] > fs.pos)
+		{
+			for (i = 0; i < GPMF_CONTEXT_STICKY; i++)
+			{
+				if (fs.buffer[fs.pos] == StickyKeys[i] && found[i] == 0)
+					found[i] = fs.pos;
+			}
+		}
+	} while (fs.last_seek[curr_level] > fs.pos && GPMF_OK == GPMF_Next(&fs, GPMF_CURRENT_LEVEL|GPMF_TOLERANT));
+}
+
+
+// Derive the scaling state for one captured sticky KLV, errors are kept to be returned where GPMF_ScaledData() found them
+static void DeriveSticky(GPMF_stream_context *ctx, uint32_t sticky)
+{
+	GPMF_stream fs;
+	uint32_t size = ctx->sticky_size[sticky];
+	uint32_t captured = (size > 0 && size <= GPMF_CONTEXT_KLV_LIMIT);
+
+	memset(&fs, 0, sizeof(GPMF_stream));
+	fs.buffer = ctx->sticky[sticky];
+	fs.buffer_size_longs = captured ? size : 0;
+
+	switch (sticky)
+	{
+	case STICKY_SCAL:
+		ctx->scal_error = GPMF_OK;
+		if (size == 0)
+		{
+			ctx->scal_type = 'L';
+			ctx->scal_count = 1;
+			ctx->scal_typesize = 4;
+			ctx->scal_buffer[0] = 1; // set the scale to 1 is no scale was provided
+		}
+		else if (!captured)
+			ctx->scal_error = GPMF_ERROR_SCALE_COUNT;
+		else
+		{
+			ctx->scal_type = GPMF_SAMPLE_TYPE(fs.buffer[1]);
+
+			switch (ctx->scal_type)
+			{
+			case GPMF_TYPE_SIGNED_BYTE:
+			case GPMF_TYPE_UNSIGNED_BYTE:
+			case GPMF_TYPE_SIGNED_SHORT:
+			case GPMF_TYPE_UNSIGNED_SHORT:
+			case GPMF_TYPE_SIGNED_LONG:
+			case GPMF_TYPE_UNSIGNED_LONG:
+			case GPMF_TYPE_FLOAT:
+				ctx->scal_count = GPMF_SAMPLES(fs.buffer[1]);
+				ctx->scal_typesize = GPMF_SizeofType((GPMF_SampleType)ctx->scal_type);
+				GPMF_FormattedData(&fs, ctx->scal_buffer, sizeof(ctx->scal_buffer), 0, ctx->scal_count);
+				break;
+			default:
+				ctx->scal_error = GPMF_ERROR_SCALE_NOT_SUPPORTED;
+				break;
+			}
+		}
+		break;
+
+	case STICKY_TYPE:
+		ctx->type_error = GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		ctx->complextype_len = sizeof(ctx->complextype);
+		if (captured && GPMF_OK == GPMF_ExpandComplexTYPE((char *)GPMF_RawData(&fs), GPMF_RawDataSize(&fs), ctx->complextype, &ctx->complextype_len))
+			ctx->type_error = GPMF_OK;
+		break;
+
+	case STICKY_MTRX:
+		ctx->mtrx_error = GPMF_OK;
+		ctx->mtrx_type = 0;
+		if (size == 0)
+			break;
+		if (!captured)
+		{
+			ctx->mtrx_error = GPMF_ERROR_SCALE_COUNT;
+			break;
+		}
+
+		ctx->mtrx_type = GPMF_SAMPLE_TYPE(fs.buffer[1]);
+		switch (ctx->mtrx_type)
+		{
+		case GPMF_TYPE_SIGNED_BYTE:
+		case GPMF_TYPE_UNSIGNED_BYTE:
+		case GPMF_TYPE_SIGNED_SHORT:
+		case GPMF_TYPE_UNSIGNED_SHORT:
+		case GPMF_TYPE_SIGNED_LONG:
+		case GPMF_TYPE_UNSIGNED_LONG:
+		case GPMF_TYPE_FLOAT:
+		case GPMF_TYPE_DOUBLE:
+			ctx->mtrx_count = GPMF_SAMPLES(fs.buffer[1]);
+			ctx->mtrx_size = ctx->mtrx_count * GPMF_SAMPLE_SIZE(fs.buffer[1]) / GPMF_SizeofType((GPMF_SampleType)ctx->mtrx_type);
+			GPMF_FormattedData(&fs, ctx->mtrx_buffer, sizeof(ctx->mtrx_buffer), 0, ctx->mtrx_count);
+			break;
+		default:
+			ctx->mtrx_error = GPMF_ERROR_SCALE_NOT_SUPPORTED;
+			break;
+		}
+		break;
+
+	default: // ORIN and ORIO are used as captured
+		break;
+	}
+}
+
+
+// Compare the sticky KLVs at the found positions with those captured, copying and re-deriving only those that differ
+static void RefreshContext(GPMF_stream *ms, GPMF_stream_context *ctx, uint32_t *found)
+{
+	uint32_t i;
+
+	if (found[STICKY_TYPE] == 0 && ms->pos + 1 < ms->buffer_size_longs &&
+		GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_COMPLEX) // a complex TYPE may be stored in the parent
+	{
+		GPMF_stream fs;
+		GPMF_CopyState(ms, &fs);
+		if (GPMF_OK == GPMF_FindPrev(&fs, GPMF_KEY_TYPE, GPMF_RECURSE_LEVELS|GPMF_TOLERANT))
+			found[STICKY_TYPE] = fs.pos;
+	}
+
+	ctx->refreshed = 0;
+	for (i = 0; i < GPMF_CONTEXT_STICKY; i++)
+	{
+		uint32_t *klv = NULL;
+		uint32_t size = 0;
+
+		if (found[i] && found[i] + 1 < ms->buffer_size_longs)
+		{
+			klv = &ms->buffer[found[i]];
+			size = 2 + (GPMF_DATA_SIZE(klv[1]) >> 2);
+			if (found[i] + size > ms->buffer_size_longs)
+				size = 0;
+		}
+
+		if (size == ctx->sticky_size[i] && (size == 0 || (size <= GPMF_CONTEXT_KLV_LIMIT && 0 == memcmp(ctx->sticky[i], klv, size * 4))))
+			continue;
+
+		ctx->sticky_size[i] = size;
+		if (size > 0 && size <= GPMF_CONTEXT_KLV_LIMIT)
+			memcpy(ctx->sticky[i], klv, size * 4);
+
+		DeriveSticky(ctx, i);
+		ctx->refreshed++;
+	}
+}
+
+
+GPMF_ERR GPMF_InitContext(GPMF_stream_context *ctx)
+{
+	if (ctx)
+	{
+		uint32_t i;
+
+		for (i = 0; i < GPMF_CONTEXT_STICKY; i++)
+			ctx->sticky_size[i] = 0xffffffff; // matches nothing, so the first update derives everything
+		ctx->refreshed = 0;
+
+		return GPMF_OK;
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+GPMF_ERR GPMF_UpdateContext(GPMF_stream *ms, GPMF_stream_context *ctx)
+{
+	if (ms && ctx && ms->buffer)
+	{
+		uint32_t found[GPMF_CONTEXT_STICKY];
+
+		FindStickyPositions(ms, found);
+		RefreshContext(ms, ctx, found);
+
+		return GPMF_OK;
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+#define MACRO_SCATTER_COLUMN(typesize)										\
+{																			\
+	for (i = 0; i < samples; i++, out += stride, in += elements * typesize)	\
+		memcpy(out, in, typesize);											\
+}
+
+// Copy a chunk of interleaved output into the caller's columns while it is still in cache
+static void ScatterColumns(GPMF_column *columns, uint32_t elements, const uint8_t *tile, uint32_t typesize, uint32_t first, uint32_t samples)
+{
+	uint32_t i, j;
+
+	for (j = 0; j < elements; j++)
+	{
+		uint32_t stride = columns[j].stride ? columns[j].stride : typesize;
+		uint8_t *out = (uint8_t *)columns[j].buffer + (size_t)first * stride;
+		const uint8_t *in = tile + j * typesize;
+
+		switch (typesize)
+		{
+		case 1: MACRO_SCATTER_COLUMN(1) break;
+		case 2: MACRO_SCATTER_COLUMN(2) break;
+		case 4: MACRO_SCATTER_COLUMN(4) break;
+		case 8: MACRO_SCATTER_COLUMN(8) break;
+		default: break;
+		}
+	}
+}
+
+
+// Scale into buffer, or when columns are given, each element into its own column. All working memory is in sc.
+static GPMF_ERR ScaleSamples(GPMF_stream *ms, GPMF_stream_context *ctx, GPMF_scratch *sc, void *buffer, uint32_t buffersize, GPMF_column *columns, uint32_t column_count,
+	uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType outputType)
+{
+	if (ms && ctx && sc && (buffer || columns))
+	{
+		GPMF_ERR ret = GPMF_OK;
+		uint8_t *data = (uint8_t *)&ms->buffer[ms->pos + 2];
+		uint8_t *output = (uint8_t *)buffer;
+		uint32_t sample_size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 1]);
+		uint32_t output_sample_size = GPMF_SizeofType(outputType);
+		uint32_t remaining_sample_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
+		uint32_t total_sample_data_bytes = remaining_sample_size;
+		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
+		char complextype[64] = "L";
+		uint32_t inputtypesize = 0;
+		uint32_t inputtypeelements = 0;
+
+		uint8_t scal_type = 0;
+		uint8_t scal_count = 0;
+		uint32_t scal_typesize = 0;
+		uint32_t *scal_data = NULL;
+
+		uint8_t mtrx_type = 0;
+		uint32_t *mtrx_data = NULL;
+		uint32_t mtrx_calibration = 0;
+		uint32_t mtrx_orientation = 0;	// the matrix was built from ORIN/ORIO
+
+		char *orin_data = NULL;
+		uint32_t orin_len = 0;
+		char *orio_data = NULL;
+		uint32_t orio_len = 0;
 
-			if (GPMF_OK == GPMF_FindPrev(&fs, GPMF_KEY_SCALE, GPMF_CURRENT_LEVEL|GPMF_TOLERANT))
+		uint32_t *uncompressedSamples = NULL;
+		GPMF_decompressor *dc = NULL;
+		uint32_t chunk_samples = read_samples;
+		uint32_t column_pos = 0;
+		uint32_t elements = 1;
+		uint32_t noswap = 0;
+
+		type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]);
+
+		if (type == GPMF_TYPE_NEST)
+			return GPMF_ERROR_MEMORY;
+
+		if (type == GPMF_TYPE_COMPRESSED)
+		{
+			uint32_t samples = GPMF_Repeat(ms);
+
+			sample_size = GPMF_StructSize(ms);
+			remaining_sample_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 2]);
+			total_sample_data_bytes = remaining_sample_size;
+
+			if (sample_offset > samples || read_samples > samples - sample_offset)
+				return GPMF_ERROR_MEMORY;
+
+			// only the samples requested are decompressed
+			if (sample_size <= sizeof(sc->samples) && GPMF_OK == GPMF_DecompressInit(ms, &sc->decompressor))
+			{
+				if (GPMF_OK != GPMF_DecompressSeek(&sc->decompressor, sample_offset))
+					return GPMF_ERROR_MEMORY;
+
+				dc = &sc->decompressor;
+				chunk_samples = sizeof(sc->samples) / sample_size;
+			}
+			else // too many channels to decode in windows
 			{
-				scal_data = (uint32_t *)GPMF_RawData(&fs);
-				scal_type = GPMF_SAMPLE_TYPE(fs.buffer[fs.pos + 1]);
+				uncompressedSamples = (uint32_t *)malloc(sample_size * read_samples + 12);
+				if (uncompressedSamples == NULL)
+					return GPMF_ERROR_MEMORY;
+
+				if (GPMF_OK != GPMF_FormattedData(ms, uncompressedSamples, sample_size * read_samples, sample_offset, read_samples))
+				{
+					ret = GPMF_ERROR_MEMORY;
+					goto cleanup;
+				}
+				noswap = 1; // data is formatted to LittleEndian
+				data = (uint8_t *)uncompressedSamples;
+			}
+
+			elements = GPMF_ElementsInStruct(ms);
+			type = GPMF_Type(ms);
+			complextype[0] = (char)type;
+			inputtypesize = GPMF_SizeofType((GPMF_SampleType)type);
+			if (inputtypesize == 0)
+			{
+				ret = GPMF_ERROR_MEMORY;
+				goto cleanup;
+			}
+			inputtypeelements = 1;
+		}
+		else if (type == GPMF_TYPE_COMPLEX)
+		{
+
+			remaining_sample_size -= sample_offset * sample_size; // skip samples
+			data += sample_offset * sample_size;
+
+			if (remaining_sample_size < sample_size * read_samples)
+				return GPMF_ERROR_MEMORY;
+
+			if (ctx->type_error != GPMF_OK)
+				return ctx->type_error;
+
+			memcpy(complextype, ctx->complextype, sizeof(complextype));
+			inputtypeelements = elements = ctx->complextype_len;
+
+			if (sample_size != GPMF_SizeOfComplexTYPE(complextype, ctx->complextype_len))
+				return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		}
+		else
+		{
+
+			remaining_sample_size -= sample_offset * sample_size; // skip samples
+			data += sample_offset * sample_size;
+
+			if (remaining_sample_size < sample_size * read_samples)
+				return GPMF_ERROR_MEMORY;
+
+			complextype[0] = type;
+			inputtypesize = GPMF_SizeofType((GPMF_SampleType)type);
+			if (inputtypesize == 0)
+				return GPMF_ERROR_MEMORY;
+			inputtypeelements = 1;
+			elements = sample_size / inputtypesize;
+		}
+
+		if (columns)
+		{
+			if (column_count != elements || output_sample_size == 0 || output_sample_size * elements > sizeof(sc->tile))
+			{
+				ret = GPMF_ERROR_MEMORY;
+				goto cleanup;
+			}
+			if (chunk_samples > sizeof(sc->tile) / (output_sample_size * elements))
+				chunk_samples = sizeof(sc->tile) / (output_sample_size * elements);
+		}
+		else if (output_sample_size * elements * read_samples > buffersize)
+		{
+			ret = GPMF_ERROR_MEMORY;
+			goto cleanup;
+		}
+
+		if (read_samples * sample_size > total_sample_data_bytes)
+		{
+			ret = GPMF_ERROR_MEMORY;
+			goto cleanup;
+		}
+
+		switch (outputType)	{
+		case GPMF_TYPE_SIGNED_BYTE:
+		case GPMF_TYPE_UNSIGNED_BYTE:
+		case GPMF_TYPE_SIGNED_SHORT:
+		case GPMF_TYPE_UNSIGNED_SHORT:
+		case GPMF_TYPE_FLOAT:
+		case GPMF_TYPE_SIGNED_LONG:
+		case GPMF_TYPE_UNSIGNED_LONG:
+		case GPMF_TYPE_DOUBLE:
+			// All supported formats.
+		{
+			if (ctx->scal_error != GPMF_OK)
+			{
+				ret = ctx->scal_error;
+				goto cleanup;
+			}
+
+			scal_type = ctx->scal_type;
+			scal_count = ctx->scal_count;
+			scal_typesize = ctx->scal_typesize;
+			scal_data = ctx->scal_buffer;
+
+			if (scal_count > 1 && scal_count != elements)
+			{
+				ret = GPMF_ERROR_SCALE_COUNT;
+				goto cleanup;
+			}
+
+			if (ctx->mtrx_error != GPMF_OK)
+			{
+				ret = ctx->mtrx_error;
+				goto cleanup;
+			}
+
+			if (ctx->mtrx_type)
+			{
+				if (ctx->mtrx_size != elements * elements)  // e.g XYZ is a 3x3 matrix, RGBA is a 4x4 matrix
+				{
+					ret = GPMF_ERROR_SCALE_COUNT;
+					goto cleanup;
+				}
+
+				mtrx_type = ctx->mtrx_type;
+				mtrx_data = ctx->mtrx_buffer;
+
+				switch (mtrx_type)
+				{
+				case GPMF_TYPE_SIGNED_BYTE:  MACRO_IS_MATRIX_CALIBRATION(int8_t) break;
+				case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_IS_MATRIX_CALIBRATION(uint8_t) break;
+				case GPMF_TYPE_SIGNED_SHORT:  MACRO_IS_MATRIX_CALIBRATION(int16_t) break;
+				case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_IS_MATRIX_CALIBRATION(uint16_t) break;
+				case GPMF_TYPE_SIGNED_LONG:  MACRO_IS_MATRIX_CALIBRATION(int32_t) break;
+				case GPMF_TYPE_UNSIGNED_LONG:  MACRO_IS_MATRIX_CALIBRATION(uint32_t) break;
+				case GPMF_TYPE_FLOAT: MACRO_IS_MATRIX_CALIBRATION(float); break;
+				case GPMF_TYPE_DOUBLE: MACRO_IS_MATRIX_CALIBRATION(double); break;
+				}
+			}
+
+			if (!mtrx_calibration)
+			{
+				if (ctx->sticky_size[STICKY_ORIN] > 0 && ctx->sticky_size[STICKY_ORIN] <= GPMF_CONTEXT_KLV_LIMIT)
+				{
+					orin_data = (char *)&ctx->sticky[STICKY_ORIN][2];
+					orin_len = GPMF_DATA_PACKEDSIZE(ctx->sticky[STICKY_ORIN][1]);
+				}
+				if (ctx->sticky_size[STICKY_ORIO] > 0 && ctx->sticky_size[STICKY_ORIO] <= GPMF_CONTEXT_KLV_LIMIT)
+				{
+					orio_data = (char *)&ctx->sticky[STICKY_ORIO][2];
+					orio_len = GPMF_DATA_PACKEDSIZE(ctx->sticky[STICKY_ORIO][1]);
+				}
+				if (orio_len == orin_len && orin_len > 1 && orio_len == elements)
+				{
+					uint32_t x, y, pos = 0;
+
+					mtrx_data = sc->mtrx;
+					mtrx_type = outputType;
+
+					for (y = 0; y < elements; y++)
+					{
+						for (x = 0; x < elements; x++)
+						{
+							switch (mtrx_type)
+							{
+							case GPMF_TYPE_FLOAT:			MACRO_SET_MATRIX(float,       orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_DOUBLE:			MACRO_SET_MATRIX(double,      orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_SIGNED_BYTE:		MACRO_SET_MATRIX(int8_t,      orio_data[y], orin_data[x], pos);   break;
+							case GPMF_TYPE_UNSIGNED_BYTE:	MACRO_SET_MATRIX(uint8_t,     orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_SIGNED_SHORT:	MACRO_SET_MATRIX(int16_t,     orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_SET_MATRIX(uint16_t,    orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_SIGNED_LONG:		MACRO_SET_MATRIX(int32_t,     orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_UNSIGNED_LONG:	MACRO_SET_MATRIX(uint32_t,    orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_SIGNED_64BIT_INT:  MACRO_SET_MATRIX(int64_t,   orio_data[y], orin_data[x], pos);  break;
+							case GPMF_TYPE_UNSIGNED_64BIT_INT: MACRO_SET_MATRIX(uint64_t, orio_data[y], orin_data[x], pos);  break;
+							default:
+								ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
+								goto cleanup;
+								break;
+							}
+
+							pos++;
+						}
+					}
+
+					mtrx_calibration = 1;
+					mtrx_orientation = 1;
+				}
+			}
+		}
+
+		do
+		{
+			uint32_t samples = read_samples < chunk_samples ? read_samples : chunk_samples;
+			uint32_t chunk = samples;
+
+			if (columns)
+				output = (uint8_t *)sc->tile;
+
+			if (dc) // the next chunk, big endian as stored uncompressed
+			{
+				if (GPMF_OK != GPMF_DecompressNext(dc, sc->samples, sizeof(sc->samples), samples))
+				{
+					ret = GPMF_ERROR_MEMORY;
+					goto cleanup;
+				}
+				data = (uint8_t *)sc->samples;
+			}
+			read_samples -= samples;
+
+			if (inputtypeelements == 1 && GPMF_OK == ScaledDataFast(output, outputType, data, (uint8_t)complextype[0], noswap, elements, samples,
+				scal_type, scal_count, scal_data, mtrx_type, mtrx_data, mtrx_calibration, mtrx_orientation, sc->pattern))
+			{
+				output += output_sample_size * elements * samples;
+				data += sample_size * samples;
+				if (columns)
+				{
+					ScatterColumns(columns, elements, (uint8_t *)sc->tile, output_sample_size, column_pos, chunk);
+					column_pos += chunk;
+				}
+				continue;
+			}
+
+			while (samples--)
+			{
+				uint32_t i;
+				uint8_t *scal_data8 = (uint8_t *)scal_data;
+
+				for (i = 0; i < elements; i++)
+				{
+					if (inputtypeelements == 0)
+					{
+						ret = GPMF_ERROR_MEMORY;
+						goto cleanup;
+					}
+
+					if (noswap)
+					{
+						switch (complextype[i % inputtypeelements])
+						{
+						case GPMF_TYPE_FLOAT:  MACRO_NOSWAP_CAST_SCALE(float) break;
+						case GPMF_TYPE_SIGNED_BYTE:  MACRO_NOSWAP_CAST_SCALE(int8_t) break;
+						case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint8_t) break;
+						case GPMF_TYPE_SIGNED_SHORT:  MACRO_NOSWAP_CAST_SCALE(int16_t) break;
+						case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint16_t) break;
+						case GPMF_TYPE_SIGNED_LONG:  MACRO_NOSWAP_CAST_SCALE(int32_t) break;
+						case GPMF_TYPE_UNSIGNED_LONG:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint32_t) break;
+						case GPMF_TYPE_SIGNED_64BIT_INT:  MACRO_NOSWAP_CAST_SCALE(int64_t) break;
+						case GPMF_TYPE_UNSIGNED_64BIT_INT:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint64_t) break;
+						default:
+							ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
+							goto cleanup;
+							break;
+						}
+					}
+					else
+					{
+						switch (complextype[i % inputtypeelements])
+						{
+						case GPMF_TYPE_FLOAT:  MACRO_BSWAP_CAST_SCALE(BYTESWAP32, float, uint32_t) break;
+						case GPMF_TYPE_SIGNED_BYTE:  MACRO_BSWAP_CAST_SCALE(NOSWAP8, int8_t, uint8_t) break;
+						case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(NOSWAP8, uint8_t, uint8_t) break;
+						case GPMF_TYPE_SIGNED_SHORT:  MACRO_BSWAP_CAST_SCALE(BYTESWAP16, int16_t, uint16_t) break;
+						case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(BYTESWAP16, uint16_t, uint16_t) break;
+						case GPMF_TYPE_SIGNED_LONG:  MACRO_BSWAP_CAST_SCALE(BYTESWAP32, int32_t, uint32_t) break;
+						case GPMF_TYPE_UNSIGNED_LONG:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(BYTESWAP32, uint32_t, uint32_t) break;
+						case GPMF_TYPE_SIGNED_64BIT_INT:  MACRO_BSWAP_CAST_SCALE(BYTESWAP64, int64_t, uint64_t) break;
+						case GPMF_TYPE_UNSIGNED_64BIT_INT:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(BYTESWAP64, uint64_t, uint64_t) break;
+						case GPMF_TYPE_FOURCC: // Don't scale, just store, if it will fit.
+							{					
+							uint32_t* out = (uint32_t*)output;
+							switch (outputType) {
+								case GPMF_TYPE_FLOAT:	
+								case GPMF_TYPE_SIGNED_LONG:	
+								case GPMF_TYPE_UNSIGNED_LONG:	
+									*out++ = *(uint32_t*)data;
+									data += 4;
+									output += 4;
+									break;
+								case GPMF_TYPE_DOUBLE:			
+									*out++ = *(uint32_t*)data;
+									*out++ = 0;
+									data += 4;
+									output += 8;
+									break;
+								default: //bytes and shorts
+									ret = GPMF_ERROR_SCALE_NOT_SUPPORTED; // FourCC can't fit in these target buffers
+									goto cleanup;
+									break;
+								}			
+							} break;
+						default:
+							ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
+							goto cleanup;
+							break;
+						}
+					}
+					if (scal_count > 1)
+						scal_data8 += scal_typesize;
+				}
+
+
+				if (inputtypeelements == 1)
+				{
+					if (mtrx_calibration)
+					{
+						switch (mtrx_type)
+						{
+						case GPMF_TYPE_SIGNED_BYTE:  MACRO_APPLY_MATRIX_CALIBRATION(int8_t) break;
+						case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_APPLY_MATRIX_CALIBRATION(uint8_t) break;
+						case GPMF_TYPE_SIGNED_SHORT:  MACRO_APPLY_MATRIX_CALIBRATION(int16_t) break;
+						case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_APPLY_MATRIX_CALIBRATION(uint16_t) break;
+						case GPMF_TYPE_SIGNED_LONG:  MACRO_APPLY_MATRIX_CALIBRATION(int32_t) break;
+						case GPMF_TYPE_UNSIGNED_LONG:  MACRO_APPLY_MATRIX_CALIBRATION(uint32_t) break;
+						case GPMF_TYPE_FLOAT: MACRO_APPLY_MATRIX_CALIBRATION(float); break;
+						case GPMF_TYPE_DOUBLE: MACRO_APPLY_MATRIX_CALIBRATION(double); break;
+						default: break;
+						}
+					}
+				}
+			}
+
+			if (columns)
+			{
+				ScatterColumns(columns, elements, (uint8_t *)sc->tile, output_sample_size, column_pos, chunk);
+				column_pos += chunk;
+			}
+		} while (read_samples > 0);
+		break;
+
+		default:
+			ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
+			goto cleanup;
+			break;
+		}
+
+cleanup:
+		if(uncompressedSamples)
+			free(uncompressedSamples);
+
+		return ret;
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+GPMF_ERR GPMF_ScaledData(GPMF_stream *ms, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType outputType)
+{
+	if (ms && buffer)
+	{
+		GPMF_stream_context ctx;
+		GPMF_scratch sc;
+
+		GPMF_InitContext(&ctx);
+		GPMF_UpdateContext(ms, &ctx);
+
+		return ScaleSamples(ms, &ctx, &sc, buffer, buffersize, NULL, 0, sample_offset, read_samples, outputType);
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+GPMF_ERR GPMF_ScaledDataWithContext(GPMF_stream *ms, GPMF_stream_context *ctx, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType outputType)
+{
+	if (buffer)
+	{
+		GPMF_scratch sc;
+		return ScaleSamples(ms, ctx, &sc, buffer, buffersize, NULL, 0, sample_offset, read_samples, outputType);
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+GPMF_ERR GPMF_ScaledDataEx(GPMF_stream *ms, GPMF_stream_context *ctx, GPMF_scratch *sc, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType outputType)
+{
+	if (buffer)
+		return ScaleSamples(ms, ctx, sc, buffer, buffersize, NULL, 0, sample_offset, read_samples, outputType);
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+GPMF_ERR GPMF_ScaledDataColumns(GPMF_stream *ms, GPMF_stream_context *ctx, GPMF_column *columns, uint32_t column_count, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType outputType)
+{
+	if (ms && columns)
+	{
+		GPMF_scratch sc;
+		uint32_t i;
+
+		for (i = 0; i < column_count; i++)
+		{
+			if (columns[i].buffer == NULL)
+				return GPMF_ERROR_MEMORY;
+		}
+
+		if (ctx == NULL)
+		{
+			GPMF_stream_context local;
+
+			GPMF_InitContext(&local);
+			GPMF_UpdateContext(ms, &local);
+
+			return ScaleSamples(ms, &local, &sc, NULL, 0, columns, column_count, sample_offset, read_samples, outputType);
+		}
+
+		return ScaleSamples(ms, ctx, &sc, NULL, 0, columns, column_count, sample_offset, read_samples, outputType);
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+// Append one instance of a requested stream, the walk positioned on it and ctx holding its sticky metadata
+static void BatchInstance(GPMF_stream *walk, GPMF_stream_context *ctx, GPMF_batch_request *rq)
+{
+	uint32_t typesize = GPMF_SizeofType(rq->type);
+	uint32_t samples = GPMF_Repeat(walk);
+	uint32_t used = typesize * rq->elements * rq->samples;
+	uint32_t size = typesize * rq->elements * samples;
+
+	if (GPMF_ElementsInStruct(walk) != rq->elements || used > rq->buffersize || size > rq->buffersize - used)
+	{
+		rq->error = GPMF_ERROR_MEMORY;
+		return;
+	}
+
+	rq->error = GPMF_ScaledDataWithContext(walk, ctx, (uint8_t *)rq->buffer + used, rq->buffersize - used, 0, samples, rq->type);
+	if (rq->error == GPMF_OK)
+		rq->samples += samples;
+}
+
+
+GPMF_ERR GPMF_ScaledDataBatch(GPMF_stream *ms, GPMF_batch_request *requests, uint32_t request_count)
+{
+	if (ms && requests && ms->buffer)
+	{
+		GPMF_ERR ret = GPMF_OK;
+		GPMF_directory *dir = ms->directory; // built by the caller for this payload, if any
+		GPMF_stream_context ctx;
+		GPMF_stream walk;
+		uint32_t i, unfound = 0;
+
+		GPMF_CopyState(ms, &walk);
+
+		// Streams in the directory are seeked to directly.
+		for (i = 0; i < request_count; i++)
+		{
+			GPMF_batch_request *rq = &requests[i];
+			GPMF_stream_entry *entry = dir ? GPMF_DirectoryFind(dir, rq->fourcc, rq->device_id) : NULL;
+
+			rq->elements = 0;
+			rq->samples = 0;
+			rq->strm_pos = 0;
+			rq->error = GPMF_ERROR_FIND;
+
+			if (entry && GPMF_OK == GPMF_SeekToEntry(&walk, entry))
+			{
+				uint32_t sticky[GPMF_CONTEXT_STICKY] = { entry->scal_pos, entry->type_pos, entry->mtrx_pos, entry->orin_pos, entry->orio_pos };
+
+				rq->elements = GPMF_ElementsInStruct(&walk);
+				rq->strm_pos = entry->strm_pos;
+
+				GPMF_InitContext(&ctx);
+				RefreshContext(&walk, &ctx, sticky); // the directory already holds the sticky positions
+				do // streams may store each sample as a separate instance of the same key
+				{
+					BatchInstance(&walk, &ctx, rq);
+				} while (rq->error == GPMF_OK && GPMF_OK == GPMF_FindNext(&walk, rq->fourcc, GPMF_CURRENT_LEVEL | GPMF_TOLERANT) &&
+					GPMF_OK == GPMF_UpdateContext(&walk, &ctx));
+			}
+			else if (dir == NULL || dir->entry_count >= GPMF_DIRECTORY_LIMIT) // not indexed or beyond a full directory
+				unfound++;
+		}
+
+		// The rest are found in one walk of the payload. The first instance of each key (on the requested device) selects
+		// its STRM, later instances within the same nest are appended, as a GPMF_FindNext() loop would. The first sticky 
+		// KLVs of each nest are noted on the way, where GPMF_UpdateContext() would find them.
+		if (unfound)
+		{
+			uint32_t sticky[GPMF_NEST_LIMIT][GPMF_CONTEXT_STICKY];
+			uint32_t parent[GPMF_NEST_LIMIT];
+
+			GPMF_InitContext(&ctx);
+			GPMF_ResetState(&walk);
+			for (i = 0; i < GPMF_NEST_LIMIT; i++)
+				parent[i] = 0xffffffff;
+
+			do
+			{
+				uint32_t level = walk.nest_level;
+				uint32_t key = walk.buffer[walk.pos];
+				uint32_t nest, j;
+
+				if (level == 0 || level >= GPMF_NEST_LIMIT || walk.pos + 1 >= walk.buffer_size_longs)
+					continue;
+
+				nest = walk.last_level_pos[level - 1];
+				if (parent[level] != nest)
+				{
+					parent[level] = nest;
+					memset(sticky[level], 0, sizeof(sticky[level]));
+				}
+
+				for (i = 0; i < request_count; i++)
+				{
+					GPMF_batch_request *rq = &requests[i];
+
+					if (rq->fourcc != key || (dir && GPMF_DirectoryFind(dir, rq->fourcc, rq->device_id))) // those indexed are done
+						continue;
+
+					if (rq->error == GPMF_ERROR_FIND && (rq->device_id == 0 || walk.device_id == rq->device_id))
+					{
+						rq->elements = GPMF_ElementsInStruct(&walk);
+						rq->strm_pos = nest;
+					}
+					else if (rq->error != GPMF_OK || rq->strm_pos != nest)
+						continue;
+
+					{
+						uint32_t found[GPMF_CONTEXT_STICKY];
+						memcpy(found, sticky[level], sizeof(found));
+						RefreshContext(&walk, &ctx, found);
+					}
+					BatchInstance(&walk, &ctx, rq);
+				}
+
+				for (j = 0; j < GPMF_CONTEXT_STICKY; j++)
+				{
+					if (key == StickyKeys[j] && sticky[level][j] == 0)
+						sticky[level][j] = walk.pos;
+				}
+			} while (GPMF_OK == GPMF_Next(&walk, GPMF_RECURSE_LEVELS | GPMF_TOLERANT));
+		}
+
+		for (i = 0; i < request_count; i++)
+		{
+			if (requests[i].error != GPMF_OK && ret == GPMF_OK)
+				ret = requests[i].error;
+		}
+
+		return ret;
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+
+GPMF_ERR GPMF_DecompressedSize(GPMF_stream *ms, uint32_t *neededsize)
+{
+	if (ms && neededsize)
+	{
+		*neededsize = GPMF_DATA_SIZE(ms->buffer[ms->pos + 2]); // The first 32-bit of data, is the uncomresseded type-size-repeat
+		return GPMF_OK;
+	}
+	
+	return GPMF_ERROR_MEMORY;
+}
+
+
+// Multi-symbol decode table, stored after the 65536 entry GPMF_codebook in the same allocation. Indexed by 
+// the next GPMF_MULTICODE_BITS of the bitstream, each entry holds the run of codebook lookups that are fully 
+// determined by those bits, expanded to the samples they store, so short zero runs and small deltas are 
+// resolved several per lookup.
+#define GPMF_MULTICODE_BITS		12
+#define GPMF_MULTICODE_OUTPUTS	8
+
+typedef struct GPMF_multicode
+{
+	int8_t cumulative[GPMF_MULTICODE_OUTPUTS];	// each stored sample's change from the starting value, before quantization
+	uint8_t outputs;							// samples stored, 0 to use the codebook instead
+	uint8_t check;								// samples before the last value, for the same bounds test as the codebook
+	uint8_t bits_used;
+} GPMF_multicode;
+
+static GPMF_codebook *SharedCodebook(void);
+
+#define MACRO_STORE_RUN(count)												\
+{																			\
+	uint32_t _n = (count);													\
+	if (sizeoftype == 2)													\
+	{																		\
+		uint16_t _v = (uint16_t)BYTESWAP16((uint32_t)last);					\
+		while (_n--) { *(uint16_t *)out = _v; out += stride; }				\
+	}																		\
+	else																	\
+	{																		\
+		uint8_t _v = (uint8_t)last;											\
+		while (_n--) { *out = _v; out += stride; }							\
+	}																		\
+}
+
+// Keeps at least 33 bits in bitbuf, enough for an ESC code and its delta. Past the end of the stream, zeros.
+#define MACRO_REFILL_BITS													\
+{																			\
+	if (bitcount <= 32)														\
+	{																		\
+		if (loadpos + 4 <= compressed_size)									\
+		{																	\
+			uint64_t _word = ((uint64_t)start[loadpos] << 24) | ((uint64_t)start[loadpos + 1] << 16) | ((uint64_t)start[loadpos + 2] << 8) | start[loadpos + 3];	\
+			bitbuf |= _word << (32 - bitcount);								\
+			bitcount += 32;													\
+			loadpos += 4;													\
+		}																	\
+		else																\
+		{																	\
+			while (bitcount <= 48)											\
+			{																\
+				uint64_t _word = 0;											\
+				if (loadpos < compressed_size)								\
+					_word = (uint64_t)((start[loadpos] << 8) | start[loadpos + 1]);	\
+				bitbuf |= _word << (48 - bitcount);							\
+				bitcount += 16;												\
+				loadpos += 2;												\
+			}																\
+		}																	\
+	}																		\
+}
+
+
+// Decode the next count samples of a channel, stored big endian every stride bytes from out, or only skipped 
+// when out is NULL. With to_end decoding continues to the channel's END code, where the next channel begins.
+static GPMF_ERR DecodeChannel(GPMF_decompressor *dc, GPMF_decompress_channel *ch, uint8_t *out, uint32_t stride, uint32_t count, int to_end)
+{
+	GPMF_codebook *cb = dc->codebook;
+	GPMF_multicode *mc = (GPMF_multicode *)&cb[65536];
+	uint8_t *start = dc->data;
+	uint32_t compressed_size = dc->data_size;
+	uint32_t sizeoftype = dc->sizeoftype;
+	int32_t quant = ch->quant;
+	int32_t last = ch->last;
+	uint32_t pos = ch->pos;
+	uint32_t consumed = ch->consumed;
+	uint32_t loadpos = ch->start + 2 * (consumed / 16);
+	uint64_t bitbuf = 0;	// next bits of the channel, MSB first
+	int bitcount = 0;		// valid bits in bitbuf
+
+	MACRO_REFILL_BITS;
+	bitbuf <<= consumed & 15;
+	bitcount -= consumed & 15;
+
+	for (;;)
+	{
+		GPMF_multicode *m;
+
+		if (ch->run) // samples decoded by an earlier code, not yet stored
+		{
+			uint32_t n = ch->run < count ? ch->run : count;
+
+			if (out)
+				MACRO_STORE_RUN(n);
+			ch->run -= n;
+			count -= n;
+		}
 
-				switch (scal_type)
-				{
-				case GPMF_TYPE_SIGNED_BYTE:
-				case GPMF_TYPE_UNSIGNED_BYTE:
-				case GPMF_TYPE_SIGNED_SHORT:
-				case GPMF_TYPE_UNSIGNED_SHORT:
-				case GPMF_TYPE_SIGNED_LONG:
-				case GPMF_TYPE_UNSIGNED_LONG:
-				case GPMF_TYPE_FLOAT:
-					scal_count = GPMF_SAMPLES(fs.buffer[fs.pos + 1]);
-					scal_typesize = GPMF_SizeofType((GPMF_SampleType)scal_type);
+		if (count == 0)
+		{
+			if (!to_end || ch->ended)
+				break;
+			ch->run = 0; // decoded past the samples wanted, END will report any overrun
+		}
+		else if (ch->ended)
+			return GPMF_ERROR_MEMORY;
 
-					if (scal_count > 1)
-					{
-						if (scal_count != elements)
-						{
-							ret = GPMF_ERROR_SCALE_COUNT;
-							goto cleanup;
-						}
-					}
+		MACRO_REFILL_BITS;
 
-					GPMF_FormattedData(&fs, scal_buffer, scal_buffersize, 0, scal_count);
+		m = &mc[bitbuf >> (64 - GPMF_MULTICODE_BITS)];
+		if (m->outputs && m->outputs <= count)
+		{
+			uint32_t k;
 
-					scal_data = (uint32_t *)scal_buffer;
-					break;
-				default:
-					return GPMF_ERROR_SCALE_NOT_SUPPORTED;
-					break;
-				}
-			}
-			else
-			{
-				scal_type = 'L';
-				scal_count = 1;
-				scal_buffer[0] = 1; // set the scale to 1 is no scale was provided
-				scal_data = (uint32_t *)scal_buffer;
-			}
+			if (pos + m->check > dc->maxpos)
+				return GPMF_ERROR_MEMORY;
 
-			GPMF_CopyState(ms, &fs);
-			if (GPMF_OK == GPMF_FindPrev(&fs, GPMF_KEY_MATRIX, GPMF_CURRENT_LEVEL|GPMF_TOLERANT))
+			if (out)
 			{
-				uint32_t mtrx_found_size = 0;
-				uint32_t matrix_size = elements * elements;
-				mtrx_data = (uint32_t *)GPMF_RawData(&fs);
-				mtrx_type = GPMF_SAMPLE_TYPE(fs.buffer[fs.pos + 1]);
-
-				switch (mtrx_type)
+				if (sizeoftype == 2)
 				{
-				case GPMF_TYPE_SIGNED_BYTE:
-				case GPMF_TYPE_UNSIGNED_BYTE:
-				case GPMF_TYPE_SIGNED_SHORT:
-				case GPMF_TYPE_UNSIGNED_SHORT:
-				case GPMF_TYPE_SIGNED_LONG:
-				case GPMF_TYPE_UNSIGNED_LONG:
-				case GPMF_TYPE_FLOAT:
-				case GPMF_TYPE_DOUBLE:
-					mtrx_count = GPMF_SAMPLES(fs.buffer[fs.pos + 1]);
-					mtrx_sample_size = GPMF_SAMPLE_SIZE(fs.buffer[fs.pos + 1]);
-					mtrx_typesize = GPMF_SizeofType((GPMF_SampleType)mtrx_type);
-					mtrx_found_size = mtrx_count * mtrx_sample_size / mtrx_typesize;
-					if (mtrx_found_size != matrix_size)  // e.g XYZ is a 3x3 matrix, RGBA is a 4x4 matrix
-					{
-						ret = GPMF_ERROR_SCALE_COUNT;
-						goto cleanup;
-					}
-					
-					GPMF_FormattedData(&fs, mtrx_buffer, mtrx_buffersize, 0, mtrx_count);
-					mtrx_data = (uint32_t *)mtrx_buffer;
-					break;
-				default:
-					return GPMF_ERROR_SCALE_NOT_SUPPORTED;
-					break;
+					for (k = 0; k < m->outputs; k++, out += stride)
+						*(uint16_t *)out = (uint16_t)BYTESWAP16((uint32_t)(last + m->cumulative[k] * quant));
 				}
-
-				switch (mtrx_type)
+				else
 				{
-				case GPMF_TYPE_SIGNED_BYTE:  MACRO_IS_MATRIX_CALIBRATION(int8_t) break;
-				case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_IS_MATRIX_CALIBRATION(uint8_t) break;
-				case GPMF_TYPE_SIGNED_SHORT:  MACRO_IS_MATRIX_CALIBRATION(int16_t) break;
-				case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_IS_MATRIX_CALIBRATION(uint16_t) break;
-				case GPMF_TYPE_SIGNED_LONG:  MACRO_IS_MATRIX_CALIBRATION(int32_t) break;
-				case GPMF_TYPE_UNSIGNED_LONG:  MACRO_IS_MATRIX_CALIBRATION(uint32_t) break;
-				case GPMF_TYPE_FLOAT: MACRO_IS_MATRIX_CALIBRATION(float); break;
-				case GPMF_TYPE_DOUBLE: MACRO_IS_MATRIX_CALIBRATION(double); break;
+					for (k = 0; k < m->outputs; k++, out += stride)
+						*out = (uint8_t)(last + m->cumulative[k] * quant);
 				}
 			}
 
-			if (!mtrx_calibration)
+			last += m->cumulative[m->outputs - 1] * quant;
+			pos += m->outputs;
+			count -= m->outputs;
+			bitbuf <<= m->bits_used;
+			bitcount -= m->bits_used;
+			consumed += m->bits_used;
+		}
+		else
+		{
+			GPMF_codebook *code = &cb[bitbuf >> 48];
+
+			switch (code->command)
 			{
-				GPMF_CopyState(ms, &fs);
-				if (GPMF_OK == GPMF_FindPrev(&fs, GPMF_KEY_ORIENTATION_IN, GPMF_CURRENT_LEVEL|GPMF_TOLERANT))
+			case 0:  // store zeros and/or a value
 				{
-					orin_data = (char *)GPMF_RawData(&fs);
-					orin_len = GPMF_DATA_PACKEDSIZE(fs.buffer[fs.pos + 1]);
+					uint32_t zeros = code->offset;
+
+					last += (int)code->value * quant * code->bytes_stored;
+
+					if (pos + zeros > dc->maxpos)
+						return GPMF_ERROR_MEMORY;
+
+					ch->run = zeros + (uint32_t)code->bytes_stored;
+					pos += ch->run;
+					bitbuf <<= code->bits_used;
+					bitcount -= code->bits_used;
+					consumed += code->bits_used;
 				}
-				GPMF_CopyState(ms, &fs);
-				if (GPMF_OK == GPMF_FindPrev(&fs, GPMF_KEY_ORIENTATION_OUT, GPMF_CURRENT_LEVEL|GPMF_TOLERANT))
+				break;
+
+			case 1: //channel END code detected, store the remaining zero deltas
 				{
-					orio_data = (char *)GPMF_RawData(&fs);
-					orio_len = GPMF_DATA_PACKEDSIZE(fs.buffer[fs.pos + 1]);
+					int zeros = (int)(dc->samples - pos);
+
+					if (zeros < 0 || pos + zeros > dc->maxpos)
+						return GPMF_ERROR_MEMORY;
+
+					ch->run = (uint32_t)zeros;
+					pos += ch->run;
+					ch->ended = 1;
 				}
-				if (orio_len == orin_len && orin_len > 1 && orio_len == elements)
+				break;
+
+			case 2: //ESC code, next byte or short contains the delta.
 				{
-					uint32_t x, y, pos = 0;
+					int delta;
 
-					mtrx_data = (uint32_t*)mtrx_buffer;
-					mtrx_type = outputType;
+					bitbuf <<= 16;
+					bitcount -= 16;
+					consumed += 16;
 
-					for (y = 0; y < elements; y++)
-					{
-						for (x = 0; x < elements; x++)
-						{
-							switch (mtrx_type)
-							{
-							case GPMF_TYPE_FLOAT:			MACRO_SET_MATRIX(float,       orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_DOUBLE:			MACRO_SET_MATRIX(double,      orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_SIGNED_BYTE:		MACRO_SET_MATRIX(int8_t,      orio_data[y], orin_data[x], pos);   break;
-							case GPMF_TYPE_UNSIGNED_BYTE:	MACRO_SET_MATRIX(uint8_t,     orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_SIGNED_SHORT:	MACRO_SET_MATRIX(int16_t,     orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_SET_MATRIX(uint16_t,    orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_SIGNED_LONG:		MACRO_SET_MATRIX(int32_t,     orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_UNSIGNED_LONG:	MACRO_SET_MATRIX(uint32_t,    orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_SIGNED_64BIT_INT:  MACRO_SET_MATRIX(int64_t,   orio_data[y], orin_data[x], pos);  break;
-							case GPMF_TYPE_UNSIGNED_64BIT_INT: MACRO_SET_MATRIX(uint64_t, orio_data[y], orin_data[x], pos);  break;
-							default:
-								ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
-								goto cleanup;
-								break;
-							}
+					if (pos >= dc->escpos)
+						return GPMF_ERROR_MEMORY;
 
-							pos++;
-						}
-					}
+					if (sizeoftype == 2)
+						delta = (int16_t)(bitbuf >> 48);
+					else
+						delta = (int8_t)(bitbuf >> 56);
 
-					mtrx_calibration = 1;
+					last += delta * quant;
+					ch->run = 1;
+					pos++;
+
+					bitbuf <<= 8 * sizeoftype;
+					bitcount -= 8 * sizeoftype;
+					consumed += 8 * sizeoftype;
 				}
+				break;
+
+			default: //Invalid codeword read
+				return GPMF_ERROR_MEMORY;
 			}
 		}
 
+		if (consumed >= ch->error_bits && !ch->ended)
+			return GPMF_ERROR_MEMORY;
+	}
+
+	ch->last = last;
+	ch->pos = pos;
+	ch->consumed = consumed;
 
-		while (read_samples--)
+	return GPMF_OK;
+}
+
+
+// The uncompressed layout of the current '#' KLV, shared by GPMF_Decompress() and GPMF_DecompressInit().
+static GPMF_ERR DecompressSetup(GPMF_stream *ms, GPMF_decompressor *dc)
+{
+	uint32_t uncompressed = ms->buffer[ms->pos + 2]; // The first 32-bit of data, is the uncomresseded type-size-repeat
+	GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(uncompressed);
+
+	dc->data = (uint8_t *)&ms->buffer[ms->pos + 3];
+	dc->data_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
+	dc->codebook = ms->cbhandle ? (GPMF_codebook *)ms->cbhandle : SharedCodebook();
+	dc->sample_size = GPMF_SAMPLE_SIZE(uncompressed);
+	dc->samples = GPMF_SAMPLES(uncompressed);
+	dc->sample_pos = 0;
+	dc->sizeoftype = GPMF_SizeofType(type);
+	dc->signed_type = (type == GPMF_TYPE_SIGNED_SHORT || type == GPMF_TYPE_SIGNED_BYTE || type == GPMF_TYPE_SIGNED_LONG);
+
+	if (dc->sizeoftype == 0 || dc->sizeoftype > 4 || dc->sizeoftype == 3 || dc->sample_size % dc->sizeoftype)
+		return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+
+	dc->channels = dc->sample_size / dc->sizeoftype;
+	if (dc->sizeoftype == 4) // LONGs are handled at two channels of SHORTs
+	{
+		dc->sizeoftype = 2;
+		dc->channels *= 2;
+	}
+
+	if (dc->sample_size > dc->data_size)
+		return GPMF_ERROR_MEMORY;
+
+	dc->maxpos = dc->escpos = dc->samples;
+
+	return GPMF_OK;
+}
+
+// Prepare a channel whose quantizer is at offset, leaving offset at its codes.
+static GPMF_ERR StartChannel(GPMF_decompressor *dc, GPMF_decompress_channel *ch, uint32_t chn, uint32_t *offset, uint32_t limit)
+{
+	uint8_t *first = &dc->data[chn * dc->sizeoftype];
+	uint32_t sOffset = *offset;
+
+	if (sOffset >= limit)
+		return GPMF_ERROR_MEMORY;
+
+	if (dc->sizeoftype == 2)
+	{
+		ch->quant = (uint16_t)((dc->data[sOffset] << 8) | dc->data[sOffset + 1]);
+		ch->first = dc->signed_type ? (int16_t)((first[0] << 8) | first[1]) : (uint16_t)((first[0] << 8) | first[1]);
+		sOffset += 2;
+	}
+	else
+	{
+		ch->quant = dc->data[sOffset];
+		ch->first = dc->signed_type ? (int8_t)first[0] : first[0];
+		sOffset++;
+	}
+
+	sOffset = ((sOffset + 1) & (uint32_t)~1); //16-bit aligned compressed data
+
+	if (sOffset >= dc->data_size)
+		return GPMF_ERROR_MEMORY;
+
+	ch->start = *offset = sOffset;
+
+	// A sequential reader keeps the 16-bit word after the current one loaded, so the codes must end 
+	// at least a word before the compressed size.
+	ch->error_bits = (dc->data_size - sOffset + 1) / 2;
+	ch->error_bits = ch->error_bits > 2 ? 16 * (ch->error_bits - 1) : 16;
+
+	ch->consumed = 0;
+	ch->pos = 1;
+	ch->run = 0;
+	ch->ended = 0;
+	ch->last = ch->first;
+
+	return GPMF_OK;
+}
+
+// Decode the next count samples to out, or skip them if out is NULL.
+static GPMF_ERR DecompressSamples(GPMF_decompressor *dc, uint8_t *out, uint32_t count)
+{
+	uint32_t chn;
+
+	if (count > dc->samples - dc->sample_pos)
+		return GPMF_ERROR_MEMORY;
+
+	if (count && dc->sample_pos == 0) // the first sample is stored uncompressed
+	{
+		if (out)
 		{
-			uint32_t i;
-			uint8_t *scal_data8 = (uint8_t *)scal_data;
+			memcpy(out, dc->data, dc->sample_size);
+			out += dc->sample_size;
+		}
+		dc->sample_pos++;
+		count--;
+	}
 
-			for (i = 0; i < elements; i++)
+	if (count)
+	{
+		for (chn = 0; chn < dc->channels; chn++)
+			if (GPMF_OK != DecodeChannel(dc, &dc->channel[chn], out ? out + chn * dc->sizeoftype : NULL, dc->sample_size, count, 0))
+				return GPMF_ERROR_MEMORY;
+
+		dc->sample_pos += count;
+	}
+
+	return GPMF_OK;
+}
+
+
+GPMF_ERR GPMF_DecompressInit(GPMF_stream *ms, GPMF_decompressor *dc)
+{
+	if (ms && dc && ms->pos + 2 < ms->buffer_size_longs && GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 1]) == GPMF_TYPE_COMPRESSED)
+	{
+		uint32_t chn, sOffset;
+		GPMF_ERR ret;
+
+		if (GPMF_OK != IsValidSize(ms, GPMF_DATA_SIZE(ms->buffer[ms->pos + 1]) >> 2))
+			return GPMF_ERROR_BAD_STRUCTURE;
+
+		ret = DecompressSetup(ms, dc);
+		if (ret != GPMF_OK)
+			return ret;
+
+		if (dc->channels > GPMF_DECOMPRESS_CHANNEL_LIMIT)
+			return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+
+		// Each channel's codes follow the previous channel's END code, so all but the last are scanned once to find them.
+		sOffset = dc->sample_size;
+		for (chn = 0; chn < dc->channels; chn++)
+		{
+			GPMF_decompress_channel *ch = &dc->channel[chn];
+
+			if (GPMF_OK != StartChannel(dc, ch, chn, &sOffset, GPMF_DATA_SIZE(ms->buffer[ms->pos + 2])))
+				return GPMF_ERROR_MEMORY;
+
+			if (chn + 1 < dc->channels)
 			{
-				if (inputtypeelements == 0)
-				{
-					ret = GPMF_ERROR_MEMORY;
-					goto cleanup;
-				}
+				if (dc->samples > 1 && GPMF_OK != DecodeChannel(dc, ch, NULL, 0, dc->samples - 1, 1))
+					return GPMF_ERROR_MEMORY;
 
-				if (noswap)
-				{
-					switch (complextype[i % inputtypeelements])
-					{
-					case GPMF_TYPE_FLOAT:  MACRO_NOSWAP_CAST_SCALE(float) break;
-					case GPMF_TYPE_SIGNED_BYTE:  MACRO_NOSWAP_CAST_SCALE(int8_t) break;
-					case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint8_t) break;
-					case GPMF_TYPE_SIGNED_SHORT:  MACRO_NOSWAP_CAST_SCALE(int16_t) break;
-					case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint16_t) break;
-					case GPMF_TYPE_SIGNED_LONG:  MACRO_NOSWAP_CAST_SCALE(int32_t) break;
-					case GPMF_TYPE_UNSIGNED_LONG:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint32_t) break;
-					case GPMF_TYPE_SIGNED_64BIT_INT:  MACRO_NOSWAP_CAST_SCALE(int64_t) break;
-					case GPMF_TYPE_UNSIGNED_64BIT_INT:  MACRO_NOSWAP_CAST_UNSIGNED_SCALE(uint64_t) break;
-					default:
-						ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
-						goto cleanup;
-						break;
-					}
-				}
-				else
+				sOffset = ch->start + 2 * ((ch->consumed + 31) / 16); // the word after the END code
+
+				ch->consumed = 0;
+				ch->pos = 1;
+				ch->run = 0;
+				ch->ended = 0;
+				ch->last = ch->first;
+			}
+		}
+
+		return GPMF_OK;
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+GPMF_ERR GPMF_DecompressSeek(GPMF_decompressor *dc, uint32_t sample)
+{
+	if (dc && sample <= dc->samples)
+	{
+		if (sample < dc->sample_pos) // restart the channels
+		{
+			uint32_t chn;
+
+			for (chn = 0; chn < dc->channels; chn++)
+			{
+				GPMF_decompress_channel *ch = &dc->channel[chn];
+
+				ch->consumed = 0;
+				ch->pos = 1;
+				ch->run = 0;
+				ch->ended = 0;
+				ch->last = ch->first;
+			}
+			dc->sample_pos = 0;
+		}
+
+		return DecompressSamples(dc, NULL, sample - dc->sample_pos);
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+GPMF_ERR GPMF_DecompressNext(GPMF_decompressor *dc, void *buffer, uint32_t buffersize, uint32_t read_samples)
+{
+	if (dc && buffer && read_samples * dc->sample_size <= buffersize)
+		return DecompressSamples(dc, (uint8_t *)buffer, read_samples);
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_size)
+{
+	if (ms && localbuf && localbuf_size)
+	{
+		GPMF_decompressor dc;
+		uint32_t chn, stride, sOffset, count;
+		uint8_t *buf_u8 = (uint8_t *)localbuf;
+
+		if (GPMF_OK != DecompressSetup(ms, &dc) || localbuf_size < dc.sample_size)
+			return GPMF_ERROR_MEMORY;
+
+		memset(localbuf, 0, localbuf_size); 
+		memcpy(buf_u8, dc.data, dc.sample_size);
+
+		// bounds as the samples that fit in localbuf, only samples within it are stored
+		stride = dc.channels * dc.sizeoftype;
+		dc.maxpos = localbuf_size / stride;
+		dc.escpos = (localbuf_size + stride - 1) / stride;
+		count = (dc.samples < dc.maxpos ? dc.samples : dc.maxpos);
+		count = count ? count - 1 : 0;
+
+		sOffset = dc.sample_size;
+		for (chn = 0; chn < dc.channels; chn++)
+		{
+			GPMF_decompress_channel ch;
+
+			if (GPMF_OK != StartChannel(&dc, &ch, chn, &sOffset, localbuf_size))
+				return GPMF_ERROR_MEMORY;
+
+			if (GPMF_OK != DecodeChannel(&dc, &ch, &buf_u8[(dc.channels + chn) * dc.sizeoftype], stride, count, 1))
+				return GPMF_ERROR_MEMORY;
+			
+			sOffset = ch.start + 2 * ((ch.consumed + 31) / 16); // the word after the END code
+		}
+
+		return GPMF_OK;
+	}
+
+	return GPMF_ERROR_MEMORY;
+}
+
+
+// A codebook entry can be used from a partial window if every window sharing its first bits_used bits decodes the same way.
+static void BuildMulticodeTable(GPMF_codebook *cb, GPMF_multicode *mc)
+{
+	uint8_t *determined = (uint8_t *)calloc(65536, 1);
+	uint32_t used, block, i, p;
+
+	if (determined)
+	{
+		for (used = 1; used <= 16; used++)
+		{
+			uint32_t blocksize = 1 << (16 - used);
+			for (block = 0; block < 65536; block += blocksize)
+			{
+				uint32_t uniform = 1;
+				for (i = block + 1; i < block + blocksize && uniform; i++)
+					if (memcmp(&cb[i], &cb[block], sizeof(GPMF_codebook)))
+						uniform = 0;
+
+				for (i = block; i < block + blocksize; i++)
+					if (cb[i].bits_used == used)
+						determined[i] = (uint8_t)uniform;
+			}
+		}
+	}
+
+	for (p = 0; p < (1 << GPMF_MULTICODE_BITS); p++)
+	{
+		uint32_t bits = 0;
+		int32_t value = 0;
+		GPMF_multicode *m = &mc[p];
+
+		memset(m, 0, sizeof(GPMF_multicode));
+
+		while (determined)
+		{
+			uint16_t window = (uint16_t)((p << (16 - GPMF_MULTICODE_BITS + bits)) & 0xffff); // unknown bits are zero
+			GPMF_codebook *code = &cb[window];
+			uint32_t n = (uint32_t)code->offset + (uint32_t)code->bytes_stored, k;
+
+			if (code->command != 0 || code->bits_used > GPMF_MULTICODE_BITS - bits || !determined[window] || m->outputs + n > GPMF_MULTICODE_OUTPUTS)
+				break;
+
+			value += code->value * code->bytes_stored;
+			m->check = (uint8_t)(m->outputs + code->offset);
+			for (k = 0; k < n; k++)
+				m->cumulative[m->outputs++] = (int8_t)value;
+			bits += code->bits_used;
+		}
+		m->bits_used = (uint8_t)bits;
+	}
+
+	if (determined)
+		free(determined);
+}
+
+
+static void BuildCodebook(GPMF_codebook *codebook)
+{
+	int i,v,z;
+	GPMF_codebook *cb = codebook;
+
+	for (i = 0; i <= 0xffff; i++)
+	{
+		uint16_t code = (uint16_t)i;
+		uint16_t mask = 0x8000;
+		int zeros = 0, used = 0;
+
+		cb->command = 0;
+		cb->value = 0;
+		
+		// all commands are 16-bits long
+		if (code == enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].bits)
+		{
+			cb->command = 2;
+			cb->bytes_stored = 1;
+			cb->bits_used = 16;
+			cb->offset = 0;
+			cb++;
+			continue;
+		}
+		if (code == enccontrolcodestable.entries[HUFF_END_CODE_ENTRY].bits)
+		{
+			cb->command = 1;
+			cb->bytes_stored = 0;
+			cb->bits_used = 16;
+			cb->offset = 0;
+			cb++;
+			continue;
+		}
+		
+		for (z = enczerorunstable.length-1; z >= 0; z--)
+		{
+			if (16 - used >= enczerorunstable.entries[z].size)
+			{
+				if ((code >> (16 - enczerorunstable.entries[z].size)) == enczerorunstable.entries[z].bits)
 				{
-					switch (complextype[i % inputtypeelements])
-					{
-					case GPMF_TYPE_FLOAT:  MACRO_BSWAP_CAST_SCALE(BYTESWAP32, float, uint32_t) break;
-					case GPMF_TYPE_SIGNED_BYTE:  MACRO_BSWAP_CAST_SCALE(NOSWAP8, int8_t, uint8_t) break;
-					case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(NOSWAP8, uint8_t, uint8_t) break;
-					case GPMF_TYPE_SIGNED_SHORT:  MACRO_BSWAP_CAST_SCALE(BYTESWAP16, int16_t, uint16_t) break;
-					case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(BYTESWAP16, uint16_t, uint16_t) break;
-					case GPMF_TYPE_SIGNED_LONG:  MACRO_BSWAP_CAST_SCALE(BYTESWAP32, int32_t, uint32_t) break;
-					case GPMF_TYPE_UNSIGNED_LONG:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(BYTESWAP32, uint32_t, uint32_t) break;
-					case GPMF_TYPE_SIGNED_64BIT_INT:  MACRO_BSWAP_CAST_SCALE(BYTESWAP64, int64_t, uint64_t) break;
-					case GPMF_TYPE_UNSIGNED_64BIT_INT:  MACRO_BSWAP_CAST_UNSIGNED_SCALE(BYTESWAP64, uint64_t, uint64_t) break;
-					case GPMF_TYPE_FOURCC: // Don't scale, just store, if it will fit.
-						{					
-						uint32_t* out = (uint32_t*)output;
-						switch (outputType) {
-							case GPMF_TYPE_FLOAT:	
-							case GPMF_TYPE_SIGNED_LONG:	
-							case GPMF_TYPE_UNSIGNED_LONG:	
-								*out++ = *(uint32_t*)data;
-								data += 4;
-								output += 4;
-								break;
-							case GPMF_TYPE_DOUBLE:			
-								*out++ = *(uint32_t*)data;
-								*out++ = 0;
-								data += 4;
-								output += 8;
-								break;
-							default: //bytes and shorts
-								ret = GPMF_ERROR_SCALE_NOT_SUPPORTED; // FourCC can't fit in these target buffers
-								goto cleanup;
-								break;
-							}			
-						} break;
-					default:
-						ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
-						goto cleanup;
-						break;
-					}
+					zeros += enczerorunstable.entries[z].count;
+					used  += enczerorunstable.entries[z].size;
+					mask >>= enczerorunstable.entries[z].size;
+					break;
 				}
-				if (scal_count > 1)
-					scal_data8 += scal_typesize;
 			}
+			else break;
+		}
+
+		// count single zeros.
+		while (!(code & mask) && mask)
+		{
+			zeros++;
+			used++;
+			mask >>= 1;
+		}
 
+		//move the code word up to see if is a complete code for a value following the zeros.  
+		code <<= used;
 
-			if (inputtypeelements == 1)
+		cb->bytes_stored = 0;
+		for (v=enchuftable.length-1; v>0; v--)
+		{
+			if (16-used >= enchuftable.entries[v].size+1) // codeword + sign bit
 			{
-				if (mtrx_calibration)
+				if ((code >> (16 - enchuftable.entries[v].size)) == enchuftable.entries[v].bits)
 				{
-					switch (mtrx_type)
-					{
-					case GPMF_TYPE_SIGNED_BYTE:  MACRO_APPLY_MATRIX_CALIBRATION(int8_t) break;
-					case GPMF_TYPE_UNSIGNED_BYTE:  MACRO_APPLY_MATRIX_CALIBRATION(uint8_t) break;
-					case GPMF_TYPE_SIGNED_SHORT:  MACRO_APPLY_MATRIX_CALIBRATION(int16_t) break;
-					case GPMF_TYPE_UNSIGNED_SHORT:  MACRO_APPLY_MATRIX_CALIBRATION(uint16_t) break;
-					case GPMF_TYPE_SIGNED_LONG:  MACRO_APPLY_MATRIX_CALIBRATION(int32_t) break;
-					case GPMF_TYPE_UNSIGNED_LONG:  MACRO_APPLY_MATRIX_CALIBRATION(uint32_t) break;
-					case GPMF_TYPE_FLOAT: MACRO_APPLY_MATRIX_CALIBRATION(float); break;
-					case GPMF_TYPE_DOUBLE: MACRO_APPLY_MATRIX_CALIBRATION(double); break;
-					default: break;
-					}
+					int sign = 1-(((code >> (16 - (enchuftable.entries[v].size + 1))) & 1)<<1); // last bit is the sign.
+					cb->value = enchuftable.entries[v].value * (int16_t)sign;
+					used += enchuftable.entries[v].size+1;
+					cb->bytes_stored = 1;
+					break;
 				}
 			}
 		}
-		break;
-
-		default:
-			ret = GPMF_ERROR_SCALE_NOT_SUPPORTED;
-			goto cleanup;
-			break;
+		
+		if (used == 0)
+		{
+			used = 16;
+			cb->command = -1; // ERROR invalid code
 		}
-
-cleanup:
-		if(uncompressedSamples)
-			free(uncompressedSamples);
-
-		return ret;
+		cb->bits_used = (uint8_t)used;
+		cb->offset = (uint8_t)zeros;
+		cb++;
 	}
 
-	return GPMF_ERROR_MEMORY;
+	BuildMulticodeTable(codebook, (GPMF_multicode *)cb);
 }
 
+// One codebook, with its multi-symbol table, shared read-only by every stream without its own cbhandle.
+static struct
+{
+	GPMF_codebook cb[65536];
+	GPMF_multicode mc[1 << GPMF_MULTICODE_BITS];
+} shared_codebook;
+
+static GPMF_once shared_codebook_once = GPMF_ONCE_INIT;
 
+static void BuildSharedCodebook(void)
+{
+	BuildCodebook(shared_codebook.cb);
+}
 
-GPMF_ERR GPMF_DecompressedSize(GPMF_stream *ms, uint32_t *neededsize)
+static GPMF_codebook *SharedCodebook(void)
 {
-	if (ms && neededsize)
-	{
-		*neededsize = GPMF_DATA_SIZE(ms->buffer[ms->pos + 2]); // The first 32-bit of data, is the uncomresseded type-size-repeat
-		return GPMF_OK;
-	}
-	
-	return GPMF_ERROR_MEMORY;
+	GPMF_Once(&shared_codebook_once, BuildSharedCodebook);
+	return shared_codebook.cb;
 }
 
 
-GPMF_ERR GPMF_Decompress(GPMF_stream *ms, uint32_t *localbuf, uint32_t localbuf_size)
+GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle)
 {
-	if (ms && localbuf && localbuf_size)
+	*cbhandle = (size_t)malloc(65536 * sizeof(GPMF_codebook) + (1 << GPMF_MULTICODE_BITS) * sizeof(GPMF_multicode));
+	if (*cbhandle)
 	{
-		if (ms->cbhandle == 0)
-			if (GPMF_OK != GPMF_AllocCodebook(&ms->cbhandle))
-				return GPMF_ERROR_MEMORY;
+		BuildCodebook((GPMF_codebook *)*cbhandle);
 
-		memset(localbuf, 0, localbuf_size); 
+		return GPMF_OK;
+	}
 
-		// unpack here
-		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(ms->buffer[ms->pos + 2]);// The first 32-bit of data, is the uncomresseded type-size-repeat
-		uint8_t *start = (uint8_t *)&ms->buffer[ms->pos + 3];
-		uint16_t quant;
-		size_t sOffset = 0;
-		uint16_t *compressed_data;
-		uint32_t sample_size = GPMF_SAMPLE_SIZE(ms->buffer[ms->pos + 2]);
-		uint32_t sizeoftype = GPMF_SizeofType(type);
-		if(sizeoftype == 0) 
-			return GPMF_ERROR_MEMORY;
-		uint32_t chn = 0, channels = sample_size / sizeoftype;
-		uint32_t compressed_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 1]);
-		uint32_t uncompressed_size = GPMF_DATA_PACKEDSIZE(ms->buffer[ms->pos + 2]);
+	return GPMF_ERROR_MEMORY;
+}
 
-		if (sizeoftype == 0 && localbuf_size < uncompressed_size)
-			return GPMF_ERROR_MEMORY;
+GPMF_ERR GPMF_FreeCodebook(size_t cbhandle)
+{
+	GPMF_codebook *cb = (GPMF_codebook *)cbhandle;
 
-		int signed_type = 1;
+	if (cb)
+	{
+		free(cb);
 
-		GPMF_codebook *cb = (GPMF_codebook *)ms->cbhandle;
+		return GPMF_OK;
+	}
+	return GPMF_ERROR_MEMORY;
+}
 
-		if (sizeoftype == 4) // LONGs are handled at two channels of SHORTs
+GPMF_ERR GPMF_Free(GPMF_stream* ms)
+{
+	if (ms)
+	{
+		if (ms->cbhandle != 0)
 		{
-			sizeoftype = 2;
-			channels *= 2;
-
-			if (type == 'l')
-				type = GPMF_TYPE_SIGNED_SHORT;
-			else
-				type = GPMF_TYPE_UNSIGNED_SHORT; 
+			GPMF_FreeCodebook(ms->cbhandle);
+			ms->cbhandle = 0;
 		}
+		return GPMF_OK;
+	}
+	return GPMF_ERROR_MEMORY;
+}
 
 
-		if (type == GPMF_TYPE_SIGNED_SHORT || type == GPMF_TYPE_SIGNED_BYTE)
-			signed_type = -1; //signed
-
-
-		uint16_t *buf_u16 = (uint16_t *)localbuf;
-		int16_t *buf_s16 = (int16_t *)localbuf;
-		uint8_t *buf_u8 = (uint8_t *)localbuf;
-		int8_t *buf_s8 = (int8_t *)localbuf;
-		int32_t last;
-		uint32_t pos, end = 0;
-
-		if(sample_size > compressed_size)
-			return GPMF_ERROR_MEMORY;
-			
-		memcpy(&buf_u8[0], start, sample_size);
+// Bit writer for the compressor, MSB first into big endian 16-bit words as GPMF_Decompress reads them.
+static void PutBits(BITSTREAM *bs, uint32_t bits, int32_t size)
+{
+	while (size > 0 && !bs->error)
+	{
+		int32_t n = size < bs->bitsFree ? size : bs->bitsFree;
 
-		sOffset += sample_size;
+		bs->wBuffer |= (uint16_t)(((bits >> (size - n)) & BITMASK(n)) << (bs->bitsFree - n));
+		bs->bitsFree -= n;
+		size -= n;
 
-		for (chn = 0; chn<channels; chn++)
+		if (bs->bitsFree == 0)
 		{
-			pos = 1;
-
-			if (sOffset >= localbuf_size)
-				return GPMF_ERROR_MEMORY;
-
-			switch ((int)sizeoftype * signed_type)
+			if (bs->wordsUsed >= bs->dwBlockLength)
 			{
-			default:
-			case -2: last = BYTESWAP16(buf_s16[chn]); quant = *((uint16_t *)&start[sOffset]); quant = BYTESWAP16(quant); sOffset += 2; break;
-			case -1: last = (int8_t)buf_s8[chn]; quant = *((uint8_t *)&start[sOffset]); sOffset++; break;
-			case 1: last = buf_u8[chn]; quant = *((uint8_t *)&start[sOffset]); sOffset++; break;
-			case 2: last = BYTESWAP16(buf_u16[chn]); quant = *((uint16_t *)&start[sOffset]); quant = BYTESWAP16(quant); sOffset += 2;  break;
+				bs->error = BITSTREAM_ERROR_OVERFLOW;
+				return;
 			}
-						
-			sOffset = ((sOffset + 1) & (uint32_t)~1); //16-bit aligned compressed data
 
-			if (sOffset >= compressed_size)
-				return GPMF_ERROR_MEMORY;
+			bs->lpCurrentWord[0] = (uint8_t)(bs->wBuffer >> 8);
+			bs->lpCurrentWord[1] = (uint8_t)bs->wBuffer;
+			bs->lpCurrentWord += 2;
+			bs->wordsUsed++;
+			bs->wBuffer = 0;
+			bs->bitsFree = BITSTREAM_WORD_SIZE;
+		}
+	}
+}
 
-			compressed_data = (uint16_t *)&start[sOffset];
+// Zero deltas as zero run codes, largest first, then single zero codes.
+static void PutZeros(BITSTREAM *bs, uint32_t zeros)
+{
+	int z;
 
-			uint16_t currWord = BYTESWAP16(*compressed_data); compressed_data++;
-			uint16_t nextWord = BYTESWAP16(*compressed_data); compressed_data++;
-			int currBits = 16;
-			int nextBits = 16;
+	for (z = enczerorunstable.length - 1; z >= 0; z--)
+	{
+		while (zeros >= enczerorunstable.entries[z].count)
+		{
+			PutBits(bs, enczerorunstable.entries[z].bits, enczerorunstable.entries[z].size);
+			zeros -= enczerorunstable.entries[z].count;
+		}
+	}
 
-			do
-			{
-				switch (cb[currWord].command)
-				{
-				case 0:  // store zeros and/or a value
-					{
-						int usedbits = cb[currWord].bits_used;
-						uint32_t zeros = cb[currWord].offset;
-						int delta = (int)cb[currWord].value * quant;
+	while (zeros--)
+		PutBits(bs, enchuftable.entries[0].bits, enchuftable.entries[0].size);
+}
 
-						last += delta * cb[currWord].bytes_stored;
 
-						if (channels * (pos + zeros) * sizeoftype > localbuf_size) 
-							return GPMF_ERROR_MEMORY;
+// GPMF_Decompress decodes each 16-bit window as an optional zero run code, single zeros, then a value, and 
+// stores all the zeros with the new value. So zeros then a value within one window encode that value 
+// followed by the zeros. Zeros alone decode as repeats of the previous value, but only if the next code 
+// can't join their window, i.e. ESC, END or a zero run code.
+static GPMF_ERR CompressChannel(BITSTREAM *bs, int32_t *delta, uint32_t count, uint32_t sizeoftype)
+{
+	uint32_t i = 0, zeros, covered, safe_start = 0;
 
-						switch ((int)sizeoftype * signed_type)
-						{
-						default:
-						case -2:
-							while (zeros) { buf_s16[channels*pos++ + chn] = (int16_t) BYTESWAP16(last); zeros--; }
-							buf_s16[channels*pos + chn] = (int16_t) BYTESWAP16(last);
-							break;
-						case -1:
-							while (zeros) { buf_s8[channels*pos++ + chn] = (int8_t)last; zeros--; }
-							buf_s8[channels*pos + chn] = (int8_t)last;
-							break;
-						case 1:
-							while (zeros) { buf_u8[channels*pos++ + chn] = (uint8_t)last; zeros--; }
-							buf_u8[channels*pos + chn] = (uint8_t)last;
-							break;
-						case 2:
-							while (zeros) { buf_u16[channels*pos++ + chn] = BYTESWAP16(last); zeros--; }
-							buf_u16[channels*pos + chn] = BYTESWAP16(last);
-							break;
-						}
-										
-						pos += (uint32_t) cb[currWord].bytes_stored;
-						currWord <<= usedbits;
-						currBits -= usedbits;
-					}
-					break;
+	while (i < count && delta[i] == 0)
+		i++;
 
-				case 1: //channel END code detected, store the remaining zero deltas
-					{
-						int zeros = (int)(uncompressed_size/(channels*sizeoftype) - pos);
+	if (i > 0 && i < count) // leading zeros, trailing zeros are filled by the END code
+	{
+		PutZeros(bs, i);
+		safe_start = 1;
+	}
 
-						if (channels * (pos + zeros) * sizeoftype > localbuf_size)
-							return GPMF_ERROR_MEMORY;
+	while (i < count)
+	{
+		int32_t value = delta[i++];
+		uint32_t mag = (uint32_t)(value < 0 ? -value : value);
+		int escape = 1;
 
-						switch ((int)sizeoftype*signed_type)
-						{
-						default:
-						case -2:
-							while (zeros) { buf_s16[channels*pos++ + chn] = (int16_t) BYTESWAP16(last); zeros--; }
-							break;
-						case -1:
-							while (zeros) { buf_s8[channels*pos++ + chn] = (int8_t)last; zeros--; }
-							break;
-						case 1:
-							while (zeros) { buf_u8[channels*pos++ + chn] = (uint8_t)last; zeros--; }
-							break;
-						case 2:
-							while (zeros) { buf_u16[channels*pos++ + chn] = (uint16_t) BYTESWAP16(last); zeros--; }
-							break;
-						}
-					}
-					end = 1;
-					break;
+		zeros = 0;
+		while (i + zeros < count && delta[i + zeros] == 0)
+			zeros++;
 
-				case 2: //ESC code, next byte or short contains the delta.
-					{
-						int usedbits = cb[currWord].bits_used;
-						int delta;
-						currWord <<= usedbits;
-						currBits -= usedbits;
+		covered = 0;
+		if (mag < (uint32_t)enchuftable.length)
+		{
+			const RLV *code = &enchuftable.entries[mag];
+			uint32_t room = BITSTREAM_WORD_SIZE - (code->size + 1); // window bits left before the code and its sign
+			int z, best = -2;
 
-						//Get more bits
-						while (currBits < 16)
-						{
-							int needed = 16 - currBits;
-							currWord |= nextWord >> currBits;
-							if (nextBits >= needed) currBits = 16; else currBits += nextBits;	
-							nextWord <<= needed;
-							nextBits -= needed;
-							if (nextBits <= 0)
-							{
-								if(((size_t)compressed_data - (size_t)start) >= compressed_size)
-									return GPMF_ERROR_MEMORY;
-								nextWord = BYTESWAP16(*compressed_data);
-								compressed_data++;
-								nextBits = 16;
-							}
-						}
+			for (z = -1; z < enczerorunstable.length; z++) // -1 for single zeros only
+			{
+				uint32_t run = 0, bits = 0, cover;
 
-						if((channels * pos * sizeoftype) >= localbuf_size)
-							return GPMF_ERROR_MEMORY;
-						
-						switch ((int)sizeoftype*signed_type)
-						{
-						default:
-						case -2:
-							delta = (int16_t)(currWord);
-							delta *= quant;
-							last += delta;
-							buf_s16[channels*pos++ + chn] = (int16_t) BYTESWAP16(last);
-							break;
-						case -1:
-							delta = (int8_t)(currWord >> 8);
-							delta *= quant;
-							last += delta;
-							buf_s8[channels*pos++ + chn] = (int8_t)last;
-							break;
-						case 1: 
-							delta = (int8_t)(currWord >> 8);
-							delta *= quant;
-							last += delta;
-							buf_u8[channels*pos++ + chn] = (uint8_t)last;
-							break;
-						case 2:
-							delta = (int16_t)(currWord);
-							delta *= quant;
-							last += delta;
-							buf_u16[channels*pos++ + chn] = BYTESWAP16(last);
-							break;
-						}
-						currWord <<= 8 * sizeoftype;
-						currBits -= 8 * sizeoftype;
-					}
-					break;
+				if (z >= 0)
+				{
+					run = enczerorunstable.entries[z].count;
+					bits = enczerorunstable.entries[z].size;
+					if (run > zeros || bits > room)
+						continue;
+				}
+				else if (safe_start)
+					continue;
 
-				default: //Invalid codeword read
-					end = 1; 
-					return GPMF_ERROR_MEMORY;
-					break;
+				cover = run + ((zeros - run) < (room - bits) ? (zeros - run) : (room - bits));
+				if (best == -2 || cover > covered)
+				{
+					best = z;
+					covered = cover;
 				}
+			}
+
+			if (best != -2)
+			{
+				uint32_t singles = covered;
 
-				//Get more bits
-				while (currBits < 16)
+				if (best >= 0)
 				{
-					int needed = 16 - currBits;
-					currWord |= nextWord >> currBits;
-					if (nextBits >= needed) currBits = 16; else currBits += nextBits;
-					nextWord <<= needed;
-					nextBits -= needed;
-					if (nextBits <= 0)
-					{
-						if (((size_t)compressed_data - (size_t)start) >= compressed_size)
-							return GPMF_ERROR_MEMORY;
-						nextWord = BYTESWAP16(*compressed_data);
-						compressed_data++;
-						nextBits = 16;
-					}
+					PutBits(bs, enczerorunstable.entries[best].bits, enczerorunstable.entries[best].size);
+					singles -= enczerorunstable.entries[best].count;
 				}
-			} while (!end);
-			
-			if (nextBits == 16) compressed_data--;
-			sOffset = (size_t)compressed_data - (size_t)start;
-			end = 0;
+				while (singles--)
+					PutBits(bs, enchuftable.entries[0].bits, enchuftable.entries[0].size);
+
+				PutBits(bs, code->bits, code->size);
+				PutBits(bs, value < 0 ? 1 : 0, 1);
+				escape = 0;
+			}
 		}
 
-		return GPMF_OK;
+		if (escape)
+		{
+			PutBits(bs, enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].bits, enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].size);
+			PutBits(bs, (uint32_t)value & BITMASK(8 * sizeoftype), 8 * sizeoftype);
+		}
+
+		i += covered;
+		zeros -= covered;
+		safe_start = 0;
+
+		if (zeros)
+		{
+			if (i + zeros < count)
+			{
+				PutZeros(bs, zeros);
+				safe_start = 1;
+			}
+			i += zeros;
+		}
 	}
 
-	return GPMF_ERROR_MEMORY;
+	PutBits(bs, enccontrolcodestable.entries[HUFF_END_CODE_ENTRY].bits, enccontrolcodestable.entries[HUFF_END_CODE_ENTRY].size);
+	if (bs->bitsFree < BITSTREAM_WORD_SIZE)
+		PutBits(bs, 0, bs->bitsFree);
+
+	return bs->error ? GPMF_ERROR_MEMORY : GPMF_OK;
 }
 
 
-GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle)
+GPMF_ERR GPMF_Compress(GPMF_stream *ms, uint32_t quantize, uint32_t *compressed, uint32_t compressed_size, uint32_t *used_size)
 {
-	*cbhandle = (size_t)malloc(65536 * sizeof(GPMF_codebook));
-	if (*cbhandle)
+	if (ms && compressed && used_size && ms->buffer && ms->pos + 1 < ms->buffer_size_longs)
 	{
-		int i,v,z;
-		GPMF_codebook *cb = (GPMF_codebook *)*cbhandle;
+		GPMF_ERR ret = GPMF_OK;
+		uint32_t key = ms->buffer[ms->pos];
+		uint32_t tsr = ms->buffer[ms->pos + 1];
+		GPMF_SampleType type = (GPMF_SampleType)GPMF_SAMPLE_TYPE(tsr);
+		uint32_t sample_size = GPMF_SAMPLE_SIZE(tsr);
+		uint32_t samples = GPMF_SAMPLES(tsr);
+		uint32_t sizeoftype = GPMF_SizeofType(type);
+		uint8_t *src = (uint8_t *)&ms->buffer[ms->pos + 2];
+		uint8_t *dst = (uint8_t *)&compressed[3];
+		uint32_t dst_size, offset, packed, struct_size, repeat, chn, n;
+		uint32_t channels;
+		int32_t minval, maxval;
+		int32_t *delta = NULL;
+
+		switch (type)
+		{
+		case GPMF_TYPE_SIGNED_BYTE:		minval = -128; maxval = 127; break;
+		case GPMF_TYPE_UNSIGNED_BYTE:	minval = 0; maxval = 255; break;
+		case GPMF_TYPE_SIGNED_SHORT:
+		case GPMF_TYPE_SIGNED_LONG:		minval = -32768; maxval = 32767; break;
+		case GPMF_TYPE_UNSIGNED_SHORT:
+		case GPMF_TYPE_UNSIGNED_LONG:	minval = 0; maxval = 65535; break;
+		default:
+			return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		}
 
-		for (i = 0; i <= 0xffff; i++)
+		if (sizeoftype == 4) // LONGs are handled at two channels of SHORTs, as GPMF_Decompress() does
 		{
-			uint16_t code = (uint16_t)i;
-			uint16_t mask = 0x8000;
-			int zeros = 0, used = 0;
+			if (quantize > 1)
+				return GPMF_ERROR_SCALE_NOT_SUPPORTED; // quantizing the low halves would wrap
+			sizeoftype = 2;
+			quantize = 1;
+		}
 
-			cb->command = 0;
-			
-			// all commands are 16-bits long
-			if (code == enccontrolcodestable.entries[HUFF_ESC_CODE_ENTRY].bits)
-			{
-				cb->command = 2;
-				cb->bytes_stored = 1;
-				cb->bits_used = 16;
-				cb->offset = 0;
-				cb++;
-				continue;
-			}
-			if (code == enccontrolcodestable.entries[HUFF_END_CODE_ENTRY].bits)
-			{
-				cb->command = 1;
-				cb->bytes_stored = 0;
-				cb->bits_used = 16;
-				cb->offset = 0;
-				cb++;
-				continue;
-			}
-			
-			for (z = enczerorunstable.length-1; z >= 0; z--)
+		if (sample_size == 0 || samples == 0 || sample_size % sizeoftype)
+			return GPMF_ERROR_TYPE_NOT_SUPPORTED;
+		if (ms->pos + 2 + ((sample_size * samples + 3) >> 2) > ms->buffer_size_longs)
+			return GPMF_ERROR_BAD_STRUCTURE;
+
+		if (quantize == 0) // use the stream's QUAN, if any
+		{
+			GPMF_stream fs;
+			GPMF_CopyState(ms, &fs);
+			if (GPMF_OK == GPMF_FindPrev(&fs, GPMF_KEY_QUANTIZE, GPMF_CURRENT_LEVEL|GPMF_TOLERANT))
 			{
-				if (16 - used >= enczerorunstable.entries[z].size)
+				uint8_t *q = (uint8_t *)&fs.buffer[fs.pos + 2];
+
+				switch (GPMF_SizeofType((GPMF_SampleType)GPMF_SAMPLE_TYPE(fs.buffer[fs.pos + 1])))
 				{
-					if ((code >> (16 - enczerorunstable.entries[z].size)) == enczerorunstable.entries[z].bits)
-					{
-						zeros += enczerorunstable.entries[z].count;
-						used  += enczerorunstable.entries[z].size;
-						mask >>= enczerorunstable.entries[z].size;
-						break;
-					}
+				case 1: quantize = q[0]; break;
+				case 2: quantize = (q[0] << 8) | q[1]; break;
+				case 4: quantize = ((uint32_t)q[0] << 24) | (q[1] << 16) | (q[2] << 8) | q[3]; break;
 				}
-				else break;
 			}
+		}
+		if (quantize == 0)
+			quantize = 1;
+		if (quantize > (uint32_t)(sizeoftype == 2 ? 0xffff : 0xff))
+			return GPMF_ERROR_SCALE_NOT_SUPPORTED;
+
+		if (compressed_size < 12 + sample_size)
+			return GPMF_ERROR_MEMORY;
+
+		delta = (int32_t *)malloc(samples * sizeof(int32_t));
+		if (delta == NULL)
+			return GPMF_ERROR_MEMORY;
+
+		channels = sample_size / sizeoftype;
+		dst_size = compressed_size - 12;
+		memcpy(dst, src, sample_size); // the first sample is stored uncompressed
+		offset = sample_size;
+
+		for (chn = 0; chn < channels; chn++)
+		{
+			BITSTREAM bs;
+			int32_t last = 0, x = 0;
 
-			// count single zeros.
-			while (!(code & mask) && mask)
+			if (offset + sizeoftype + 1 > dst_size || offset >= GPMF_DATA_SIZE(tsr)) // GPMF_Decompress() needs each channel to start within the uncompressed size
 			{
-				zeros++;
-				used++;
-				mask >>= 1;
+				ret = GPMF_ERROR_MEMORY;
+				goto cleanup;
 			}
 
-			//move the code word up to see if is a complete code for a value following the zeros.  
-			code <<= used;
+			if (sizeoftype == 2)
+				dst[offset++] = (uint8_t)(quantize >> 8);
+			dst[offset++] = (uint8_t)quantize;
+			if (offset & 1)
+				dst[offset++] = 0; //16-bit aligned compressed data
 
-			cb->bytes_stored = 0;
-			for (v=enchuftable.length-1; v>0; v--)
+			for (n = 0; n < samples; n++)
 			{
-				if (16-used >= enchuftable.entries[v].size+1) // codeword + sign bit
+				uint8_t *s = &src[n * sample_size + chn * sizeoftype];
+
+				if (sizeoftype == 2)
+					x = minval < 0 ? (int16_t)((s[0] << 8) | s[1]) : (uint16_t)((s[0] << 8) | s[1]);
+				else
+					x = minval < 0 ? (int8_t)s[0] : s[0];
+
+				if (n == 0)
 				{
-					if ((code >> (16 - enchuftable.entries[v].size)) == enchuftable.entries[v].bits)
-					{
-						int sign = 1-(((code >> (16 - (enchuftable.entries[v].size + 1))) & 1)<<1); // last bit is the sign.
-						cb->value = enchuftable.entries[v].value * (int16_t)sign;
-						used += enchuftable.entries[v].size+1;
-						cb->bytes_stored = 1;
-						break;
-					}
+					last = x;
+					continue;
 				}
-			}
-			
-			if (used == 0)
-			{
-				used = 16;
-				cb->command = -1; // ERROR invalid code
-			}
-			cb->bits_used = (uint8_t)used;
-			cb->offset = (uint8_t)zeros;
-			cb++;
-		}
 
-		return GPMF_OK;
-	}
+				if (quantize == 1) // deltas wrap, as stores truncate to the type
+				{
+					delta[n - 1] = sizeoftype == 2 ? (int16_t)(x - last) : (int8_t)(x - last);
+					last = x;
+				}
+				else // round to the nearest step the decoder can reach without leaving the type's range
+				{
+					int32_t diff = x - last, q = (int32_t)quantize;
+					int32_t d = diff >= 0 ? (diff + q / 2) / q : -((q / 2 - diff) / q);
 
-	return GPMF_ERROR_MEMORY;
-}
+					while (last + d * q > maxval) d--;
+					while (last + d * q < minval) d++;
 
-GPMF_ERR GPMF_FreeCodebook(size_t cbhandle)
-{
-	GPMF_codebook *cb = (GPMF_codebook *)cbhandle;
+					delta[n - 1] = d;
+					last += d * q;
+				}
+			}
 
-	if (cb)
-	{
-		free(cb);
+			bs.error = 0;
+			bs.bitsFree = BITSTREAM_WORD_SIZE;
+			bs.lpCurrentWord = &dst[offset];
+			bs.wordsUsed = 0;
+			bs.dwBlockLength = (int32_t)((dst_size - offset) / 2);
+			bs.wBuffer = 0;
+			bs.bits_per_src_word = (uint16_t)(8 * sizeoftype);
 
-		return GPMF_OK;
-	}
-	return GPMF_ERROR_MEMORY;
-}
+			ret = CompressChannel(&bs, delta, samples - 1, sizeoftype);
+			if (ret != GPMF_OK)
+				goto cleanup;
 
-GPMF_ERR GPMF_Free(GPMF_stream* ms)
-{
-	if (ms)
-	{
-		if (ms->cbhandle != 0)
+			offset += 2 * (uint32_t)bs.wordsUsed;
+		}
+
+		packed = 4 + offset; // the uncompressed type-size-repeat, then the compressed data
+		struct_size = 1 + (packed - 1) / 0xffff;
+		repeat = (packed + struct_size - 1) / struct_size;
+		if (struct_size > 0xff || 8 + ((struct_size * repeat + 3) & ~3) > compressed_size)
 		{
-			GPMF_FreeCodebook(ms->cbhandle);
-			ms->cbhandle = 0;
+			ret = GPMF_ERROR_MEMORY;
+			goto cleanup;
 		}
-		return GPMF_OK;
+		if (((struct_size * repeat + 3) & ~3) >= GPMF_DATA_SIZE(tsr)) // no smaller than the original KLV
+		{
+			ret = GPMF_ERROR_MEMORY;
+			goto cleanup;
+		}
+
+		memset(&dst[offset], 0, ((struct_size * repeat + 3) & ~3) - packed);
+		compressed[0] = key;
+		compressed[1] = GPMF_MAKE_TYPE_SIZE_COUNT(GPMF_TYPE_COMPRESSED, struct_size, repeat);
+		compressed[2] = tsr;
+		*used_size = 8 + ((struct_size * repeat + 3) & ~3);
+
+	cleanup:
+		free(delta);
+		return ret;
 	}
+
 	return GPMF_ERROR_MEMORY;
-}
\ No newline at end of file
+}
@@ -45,10 +45,46 @@ typedef struct GPMF_stream
 	uint32_t device_id;
 	char device_name[32];
 	size_t cbhandle; // compression handler
+	struct GPMF_directory *directory; // optional index of this payload, see GPMF_AttachDirectory()
 } GPMF_stream;
 
 
 
+#define GPMF_DIRECTORY_LIMIT 64
+#define GPMF_DIRECTORY_INSTANCE_LIMIT 256
+
+typedef struct GPMF_stream_entry
+{
+	uint32_t device_id;							// DVID of the device containing the stream
+	char device_name[32];						// DVNM of the device containing the stream
+	uint32_t fourcc;							// key of the samples KLV, e.g. ACCL
+	uint32_t type;								// GPMF_SampleType of the samples (the uncompressed type for compressed KLVs)
+	uint32_t struct_size;
+	uint32_t repeat;
+	uint32_t strm_pos;							// positions in longs within the payload, 0 if not present in the stream
+	uint32_t sample_pos;
+	uint32_t scal_pos;
+	uint32_t siun_pos;
+	uint32_t type_pos;
+	uint32_t mtrx_pos;
+	uint32_t orin_pos;
+	uint32_t orio_pos;
+	uint32_t instances;							// KLVs of this key within the STRM from sample_pos on, e.g. one per FACE, 0 if too many to index
+	uint32_t instance_index;					// where their positions start within the directory's instance_pos[], when instances > 1
+	uint32_t nest_level;						// parser state at sample_pos, restored by GPMF_SeekToEntry()
+	uint32_t last_level_pos[GPMF_NEST_LIMIT];
+	uint32_t nest_size[GPMF_NEST_LIMIT];
+} GPMF_stream_entry;
+
+typedef struct GPMF_directory
+{
+	uint32_t entry_count;
+	GPMF_stream_entry entry[GPMF_DIRECTORY_LIMIT];
+	uint32_t instance_count;
+	uint32_t instance_pos[GPMF_DIRECTORY_INSTANCE_LIMIT];	// positions of each multi-instance stream's KLVs, in payload order
+} GPMF_directory;
+
+
 typedef enum GPMF_LEVELS
 {
 	GPMF_CURRENT_LEVEL = 0,  // search or validate within the current GPMF next level
@@ -70,6 +106,13 @@ GPMF_ERR GPMF_FindPrev(GPMF_stream *gs, uint32_t fourCC, GPMF_LEVELS recurse);
 GPMF_ERR GPMF_FindNext(GPMF_stream *gs, uint32_t fourCC, GPMF_LEVELS recurse);					//find a particular FourCC upcoming -- at the current level only if recurse is false
 GPMF_ERR GPMF_SeekToSamples(GPMF_stream *gs);													//find the last FourCC in the current level, this is raw data for any STRM
 
+// Directory of all the streams within a payload
+GPMF_ERR GPMF_BuildDirectory(GPMF_stream *gs, GPMF_directory *dir);								//scan the payload once, recording each STRM's samples and sticky metadata positions
+GPMF_stream_entry *GPMF_DirectoryFind(GPMF_directory *dir, uint32_t fourCC, uint32_t device_id);	//find the stream for a FourCC, device_id 0 matches any device
+GPMF_ERR GPMF_SeekToEntry(GPMF_stream *gs, GPMF_stream_entry *entry);							//position the stream on the entry's samples, as GPMF_FindNext() then GPMF_SeekToSamples() would
+GPMF_ERR GPMF_ValidateAndIndex(GPMF_stream *gs, GPMF_directory *dir);							//GPMF_Validate() with GPMF_RECURSE_LEVELS, building the directory in the same walk
+GPMF_ERR GPMF_AttachDirectory(GPMF_stream *gs, GPMF_directory *dir);							//use a directory built for this payload to answer GPMF_PayloadSampleCount() without searching, NULL to detach. Cleared by GPMF_Init().
+
 // Get information about the current GPMF KLV
 uint32_t GPMF_Key(GPMF_stream *gs);																//return the current Key (FourCC)
 GPMF_SampleType GPMF_Type(GPMF_stream *gs);														//return the current Type (GPMF_Type)
@@ -101,6 +144,58 @@ uint32_t GPMF_ScaledDataSize(GPMF_stream *gs, GPMF_SampleType type);
 GPMF_ERR GPMF_FormattedData(GPMF_stream *gs, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples);  // extract 'n' samples into local endian memory format.
 GPMF_ERR GPMF_ScaledData(GPMF_stream *gs, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type); // extract 'n' samples into local endian memory format										// return a point the KLV data.
 
+#define GPMF_CONTEXT_STICKY		5	// SCAL, TYPE, MTRX, ORIN and ORIO
+#define GPMF_CONTEXT_KLV_LIMIT	66	// longs captured of each, including the KLV header
+
+typedef struct GPMF_stream_context
+{
+	uint32_t sticky_size[GPMF_CONTEXT_STICKY];	// longs in each sticky KLV, 0 if the stream has none
+	uint32_t sticky[GPMF_CONTEXT_STICKY][GPMF_CONTEXT_KLV_LIMIT];	// captured KLVs, compared by GPMF_UpdateContext()
+	uint32_t refreshed;				// sticky KLVs that differed at the last GPMF_UpdateContext()
+
+	char complextype[64];			// derived from the sticky KLVs
+	uint32_t complextype_len;
+	GPMF_ERR type_error;
+	uint8_t scal_type;
+	uint8_t scal_count;
+	uint32_t scal_typesize;
+	uint32_t scal_buffer[64];
+	GPMF_ERR scal_error;
+	uint8_t mtrx_type;
+	uint8_t mtrx_count;
+	uint32_t mtrx_size;
+	uint32_t mtrx_buffer[64];
+	GPMF_ERR mtrx_error;
+} GPMF_stream_context;
+
+GPMF_ERR GPMF_InitContext(GPMF_stream_context *ctx);											// empty context, the next GPMF_UpdateContext() captures everything
+GPMF_ERR GPMF_UpdateContext(GPMF_stream *gs, GPMF_stream_context *ctx);							// capture the sticky metadata for the current samples in one walk, re-deriving only what changed
+GPMF_ERR GPMF_ScaledDataWithContext(GPMF_stream *gs, GPMF_stream_context *ctx, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type); // GPMF_ScaledData() without searching for sticky metadata
+GPMF_ERR GPMF_FormattedDataWithContext(GPMF_stream *gs, GPMF_stream_context *ctx, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples); // GPMF_FormattedData() without searching for a complex TYPE
+
+typedef struct GPMF_column
+{
+	void *buffer;					// where the element's first sample is stored, sized for read_samples by the caller
+	uint32_t stride;				// bytes between samples, 0 for sizeof the output type
+} GPMF_column;
+
+GPMF_ERR GPMF_ScaledDataColumns(GPMF_stream *gs, GPMF_stream_context *ctx, GPMF_column *columns, uint32_t column_count, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type); // as GPMF_ScaledData(), with one column per element (column_count == elements) instead of interleaved samples. ctx may be NULL
+
+typedef struct GPMF_batch_request
+{
+	uint32_t fourcc;				// stream to extract, e.g. ACCL
+	uint32_t device_id;				// device to extract from, 0 for any device
+	GPMF_SampleType type;			// output type, as for GPMF_ScaledData()
+	void *buffer;
+	uint32_t buffersize;
+	uint32_t elements;				// returned, values per sample
+	uint32_t samples;				// returned, samples written to buffer
+	GPMF_ERR error;					// returned, GPMF_ERROR_FIND if the payload has no such stream
+	uint32_t strm_pos;				// returned, position in longs of the STRM the samples came from
+} GPMF_batch_request;
+
+GPMF_ERR GPMF_ScaledDataBatch(GPMF_stream *gs, GPMF_batch_request *requests, uint32_t request_count); // scale every sample of several streams from one walk of the payload (or through the attached directory), returning the first request's error
+
 //Tools for Compressed datatypes
 
 typedef struct GPMF_codebook
@@ -113,13 +208,65 @@ typedef struct GPMF_codebook
 } GPMF_codebook;
 
 
-GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle);
+#define GPMF_DECOMPRESS_CHANNEL_LIMIT	32
+
+typedef struct GPMF_decompress_channel
+{
+	uint32_t start;			// offset of the channel's codes in the compressed data
+	uint32_t error_bits;	// codes may not reach this many bits
+	uint32_t consumed;		// bits of codes decoded
+	uint32_t pos;			// samples decoded, including run
+	uint32_t run;			// decoded samples not yet stored, all equal to last
+	int32_t first;			// the uncompressed first sample
+	int32_t last;
+	uint16_t quant;
+	uint8_t ended;			// END code decoded
+} GPMF_decompress_channel;
+
+typedef struct GPMF_decompressor
+{
+	uint8_t *data;			// compressed data, after the uncompressed type-size-repeat
+	uint32_t data_size;
+	GPMF_codebook *codebook;
+	uint32_t sample_size;	// uncompressed
+	uint32_t samples;
+	uint32_t sample_pos;	// next sample GPMF_DecompressNext() returns
+	uint32_t sizeoftype;	// 1 or 2, LONGs decode as two channels of SHORTs
+	uint32_t signed_type;
+	uint32_t channels;
+	uint32_t maxpos;		// bounds for corrupt codes, in samples
+	uint32_t escpos;
+	GPMF_decompress_channel channel[GPMF_DECOMPRESS_CHANNEL_LIMIT];
+} GPMF_decompressor;
+
+
+GPMF_ERR GPMF_AllocCodebook(size_t *cbhandle);													// optional private codebook for gs->cbhandle, otherwise a shared codebook is built once per process
 GPMF_ERR GPMF_FreeCodebook(size_t cbhandle);
 GPMF_ERR GPMF_DecompressedSize(GPMF_stream *gs, uint32_t *neededsize);
 GPMF_ERR GPMF_Decompress(GPMF_stream *gs, uint32_t *localbuf, uint32_t localbuf_size);
+GPMF_ERR GPMF_DecompressInit(GPMF_stream *gs, GPMF_decompressor *dc);							// prepare to decode the current '#' KLV in windows, without a buffer for all of it
+GPMF_ERR GPMF_DecompressSeek(GPMF_decompressor *dc, uint32_t sample);							// position on a sample, decoding forward (from the start if sample is behind) without storing
+GPMF_ERR GPMF_DecompressNext(GPMF_decompressor *dc, void *buffer, uint32_t buffersize, uint32_t read_samples); // decode the next samples, big endian like the uncompressed KLV
+GPMF_ERR GPMF_Compress(GPMF_stream *gs, uint32_t quantize, uint32_t *compressed, uint32_t compressed_size, uint32_t *used_size); // write the current integer KLV as a '#' KLV, quantize 0 to use the stream's QUAN. Fails if it would not be smaller than the original.
 GPMF_ERR GPMF_Free(GPMF_stream* gs); 
 
 
+#define GPMF_SCRATCH_LONGS		128		// compressed sample data decoded at a time
+#define GPMF_SCRATCH_TILE		64		// 64-bit values of column output scaled at a time, limiting GPMF_ScaledDataColumns() to this many elements per sample
+#define GPMF_SCRATCH_PATTERN	64
+
+typedef struct GPMF_scratch		// working memory for scaling, so no call needs it on the stack
+{
+	GPMF_decompressor decompressor;
+	uint32_t samples[GPMF_SCRATCH_LONGS];
+	uint64_t tile[GPMF_SCRATCH_TILE];
+	double pattern[GPMF_SCRATCH_PATTERN];
+	uint32_t mtrx[64];
+} GPMF_scratch;
+
+GPMF_ERR GPMF_ScaledDataEx(GPMF_stream *gs, GPMF_stream_context *ctx, GPMF_scratch *scratch, void *buffer, uint32_t buffersize, uint32_t sample_offset, uint32_t read_samples, GPMF_SampleType type); // GPMF_ScaledDataWithContext() in caller-supplied working memory
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,142 @@
+/*! @file GPMF_threads.h
+*
+*  @brief GPMF Parser threading wrappers, internal
+*
+*  Minimal thread, mutex, condition variable and one-time initialization wrappers
+*  used internally by the GPMF parser and utilities, mapping to Win32 when _WINDOWS
+*  is defined and pthreads otherwise.
+*
+*  @version 2.0.0
+*
+*  (C) Copyright 2026 GoPro Inc (http://gopro.com/).
+*
+*  Licensed under either:
+*  - Apache License, Version 2.0, http://www.apache.org/licenses/LICENSE-2.0
+*  - MIT license, http://opensource.org/licenses/MIT
+*  at your option.
+*
+*  Unless required by applicable law or agreed to in writing, software
+*  distributed under the License is distributed on an "AS IS" BASIS,
+*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+*  See the License for the specific language governing permissions and
+*  limitations under the License.
+*
+*/
+
+#ifndef _GPMF_THREADS_H
+#define _GPMF_THREADS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#ifdef _WINDOWS
+#include <windows.h>
+
+typedef HANDLE GPMF_thread;
+typedef CRITICAL_SECTION GPMF_mutex;
+typedef CONDITION_VARIABLE GPMF_cond;
+typedef INIT_ONCE GPMF_once;
+
+#define GPMF_ONCE_INIT					INIT_ONCE_STATIC_INIT
+
+#define GPMF_THREAD_FUNC(name, arg)		static DWORD WINAPI name(LPVOID arg)
+#define GPMF_THREAD_RETURN				return 0
+
+static inline int GPMF_ThreadCreate(GPMF_thread *thread, LPTHREAD_START_ROUTINE func, void *arg)
+{
+	*thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+	return *thread != NULL ? 0 : -1;
+}
+
+static inline void GPMF_ThreadJoin(GPMF_thread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static inline void GPMF_MutexInit(GPMF_mutex *m)	{ InitializeCriticalSection(m); }
+static inline void GPMF_MutexFree(GPMF_mutex *m)	{ DeleteCriticalSection(m); }
+static inline void GPMF_MutexLock(GPMF_mutex *m)	{ EnterCriticalSection(m); }
+static inline void GPMF_MutexUnlock(GPMF_mutex *m)	{ LeaveCriticalSection(m); }
+
+static inline void GPMF_CondInit(GPMF_cond *c)		{ InitializeConditionVariable(c); }
+static inline void GPMF_CondFree(GPMF_cond *c)		{ (void)c; }
+static inline void GPMF_CondWait(GPMF_cond *c, GPMF_mutex *m) { SleepConditionVariableCS(c, m, INFINITE); }
+static inline void GPMF_CondSignal(GPMF_cond *c)	{ WakeConditionVariable(c); }
+static inline void GPMF_CondBroadcast(GPMF_cond *c)	{ WakeAllConditionVariable(c); }
+
+static inline BOOL CALLBACK GPMF_OnceCallback(PINIT_ONCE once, PVOID func, PVOID *context)
+{
+	(void)once; (void)context;
+	((void (*)(void))func)();
+	return TRUE;
+}
+
+static inline void GPMF_Once(GPMF_once *once, void (*func)(void))
+{
+	InitOnceExecuteOnce(once, GPMF_OnceCallback, (PVOID)func, NULL);
+}
+
+static inline uint32_t GPMF_CPUCount(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? (uint32_t)info.dwNumberOfProcessors : 1;
+}
+
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t GPMF_thread;
+typedef pthread_mutex_t GPMF_mutex;
+typedef pthread_cond_t GPMF_cond;
+typedef pthread_once_t GPMF_once;
+
+#define GPMF_ONCE_INIT					PTHREAD_ONCE_INIT
+
+#define GPMF_THREAD_FUNC(name, arg)		static void *name(void *arg)
+#define GPMF_THREAD_RETURN				return NULL
+
+static inline int GPMF_ThreadCreate(GPMF_thread *thread, void *(*func)(void *), void *arg)
+{
+	return pthread_create(thread, NULL, func, arg);
+}
+
+static inline void GPMF_ThreadJoin(GPMF_thread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static inline void GPMF_MutexInit(GPMF_mutex *m)	{ pthread_mutex_init(m, NULL); }
+static inline void GPMF_MutexFree(GPMF_mutex *m)	{ pthread_mutex_destroy(m); }
+static inline void GPMF_MutexLock(GPMF_mutex *m)	{ pthread_mutex_lock(m); }
+static inline void GPMF_MutexUnlock(GPMF_mutex *m)	{ pthread_mutex_unlock(m); }
+
+static inline void GPMF_CondInit(GPMF_cond *c)		{ pthread_cond_init(c, NULL); }
+static inline void GPMF_CondFree(GPMF_cond *c)		{ pthread_cond_destroy(c); }
+static inline void GPMF_CondWait(GPMF_cond *c, GPMF_mutex *m) { pthread_cond_wait(c, m); }
+static inline void GPMF_CondSignal(GPMF_cond *c)	{ pthread_cond_signal(c); }
+static inline void GPMF_CondBroadcast(GPMF_cond *c)	{ pthread_cond_broadcast(c); }
+
+static inline void GPMF_Once(GPMF_once *once, void (*func)(void))
+{
+	pthread_once(once, func);
+}
+
+static inline uint32_t GPMF_CPUCount(void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (uint32_t)count : 1;
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,9 +23,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 
 #include "GPMF_parser.h"
 #include "GPMF_utils.h"
+#include "GPMF_threads.h"
 
 
 double GetGPMFSampleRate(mp4callbacks cb, uint32_t fourcc, uint32_t timeBaseFourCC, uint32_t flags, double *firstsampletime, double *lastsampletime)
@@ -354,3 +356,1797 @@ cleanup:
 	return rate;
 }
 
+
+// The whole-file passes below read each payload once, and reach its streams through a directory rather than walking
+// the payload again per stream. A payload with more than GPMF_DIRECTORY_LIMIT streams still indexes the first of them:
+// SeekToStream() finds the rest with a walk, NextStream() only visits the indexed ones.
+
+static uint32_t *ReadPayload(mp4callbacks *cb, size_t *payloadres, uint32_t index, uint32_t *payloadsize)
+{
+	*payloadsize = cb->cbGetPayloadSize(cb->mp4handle, index);
+	*payloadres = cb->cbGetPayloadResource(cb->mp4handle, *payloadres, *payloadsize);
+	return *payloadres ? cb->cbGetPayload(cb->mp4handle, *payloadres, index) : NULL;
+}
+
+
+// Initialize ms on a payload with its directory attached, a damaged payload contributes nothing to a pass
+static GPMF_ERR OpenPayload(GPMF_stream *ms, GPMF_directory *dir, uint32_t *payload, uint32_t payloadsize)
+{
+	size_t cbhandle = ms->cbhandle;
+	GPMF_ERR ret;
+
+	if (payload == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	ret = GPMF_Init(ms, payload, payloadsize);
+	ms->cbhandle = cbhandle; // GPMF_Init() clears the stream, keep any codebook for the next payload
+	if (ret != GPMF_OK)
+		return ret;
+
+	GPMF_BuildDirectory(ms, dir);
+	return GPMF_AttachDirectory(ms, dir);
+}
+
+
+// Position ms on the first instance of a stream
+static GPMF_ERR SeekToStream(GPMF_stream *ms, GPMF_directory *dir, uint32_t fourcc, uint32_t device_id)
+{
+	GPMF_stream_entry *entry = GPMF_DirectoryFind(dir, fourcc, device_id);
+	GPMF_ERR found = GPMF_ERROR_FIND;
+
+	if (entry)
+		return GPMF_SeekToEntry(ms, entry);
+
+	if (dir->entry_count >= GPMF_DIRECTORY_LIMIT)
+	{
+		GPMF_ResetState(ms);
+		do
+		{
+			found = GPMF_FindNext(ms, fourcc, GPMF_RECURSE_LEVELS | GPMF_TOLERANT);
+		} while (found == GPMF_OK && device_id && ms->device_id != device_id);
+	}
+
+	return found;
+}
+
+
+// Position walk on the first instance of the next stream, from directory entry *next on. As GPMF_FindNext(), only the
+// first instance of a key is used.
+static GPMF_stream_entry *NextStream(GPMF_stream *ms, GPMF_directory *dir, uint32_t *next, GPMF_stream *walk)
+{
+	while (*next < dir->entry_count)
+	{
+		GPMF_stream_entry *entry = &dir->entry[(*next)++];
+
+		if (GPMF_DirectoryFind(dir, entry->fourcc, 0) != entry)
+			continue;
+
+		GPMF_CopyState(ms, walk);
+		if (GPMF_OK == GPMF_SeekToEntry(walk, entry))
+			return entry;
+	}
+
+	return NULL;
+}
+
+
+
+#define RATE_PAYLOAD_ABSENT		0xffffffff
+
+// Everything GetGPMFSampleRate() reads from the payloads for one stream, gathered for every stream in one pass
+typedef struct rate_stats
+{
+	uint32_t fourcc;
+	uint32_t payload_count;			// payloads containing the stream
+	uint32_t first_payload;			// the teststart and testend of GetGPMFSampleRate()
+	uint32_t last_payload;
+	uint32_t first_samples;
+	uint32_t first_tsmp;
+	uint32_t has_first_tsmp;
+	uint64_t first_stmp;
+	uint64_t base_stmp;
+	uint32_t last_samples;
+	uint32_t last_tsmp;
+	uint32_t has_last_tsmp;
+	uint64_t last_stmp;
+	float last_timo;
+	uint32_t counted_samples;		// used when there is no TSMP
+	uint32_t *instances;			// per payload, counted as the precise rate does, RATE_PAYLOAD_ABSENT without the stream
+} rate_stats;
+
+typedef struct rate_cache
+{
+	uint32_t timeBaseFourCC;		// the request these rates answer
+	uint32_t flags;
+	uint32_t rate_count;
+	GPMF_stream_rate *rates;
+} rate_cache;
+
+
+static void FreeRateCache(void *cache)
+{
+	rate_cache *rc = (rate_cache *)cache;
+
+	if (rc)
+	{
+		if (rc->rates) free(rc->rates);
+		free(rc);
+	}
+}
+
+
+static rate_stats *FindRateStats(rate_stats **stats, uint32_t *count, uint32_t *capacity, uint32_t fourcc, uint32_t indexcount)
+{
+	rate_stats *st;
+	uint32_t i;
+
+	for (i = 0; i < *count; i++)
+	{
+		if ((*stats)[i].fourcc == fourcc)
+			return &(*stats)[i];
+	}
+
+	if (*count == *capacity)
+	{
+		uint32_t newcapacity = *capacity ? *capacity * 2 : 16;
+		rate_stats *grown = (rate_stats *)realloc(*stats, newcapacity * sizeof(rate_stats));
+		if (grown == NULL)
+			return NULL;
+
+		*stats = grown;
+		*capacity = newcapacity;
+	}
+
+	st = &(*stats)[*count];
+	memset(st, 0, sizeof(rate_stats));
+	st->fourcc = fourcc;
+	st->instances = (uint32_t *)malloc((size_t)indexcount * sizeof(uint32_t) + 4);
+	if (st->instances == NULL)
+		return NULL;
+	for (i = 0; i < indexcount; i++)
+		st->instances[i] = RATE_PAYLOAD_ABSENT;
+
+	(*count)++;
+	return st;
+}
+
+
+// The timestamp GetGPMFSampleRate() subtracts, from the time base stream or the earliest STMP within the payload
+static uint64_t PayloadBaseTimestamp(uint32_t *payload, uint32_t payloadsize, uint32_t timeBaseFourCC, uint64_t starttimestamp)
+{
+	GPMF_stream any_stream;
+	uint64_t basetimestamp = starttimestamp;
+
+	if (GPMF_OK == GPMF_Init(&any_stream, payload, payloadsize))
+	{
+		if (timeBaseFourCC)
+		{
+			if (GPMF_OK == GPMF_FindNext(&any_stream, timeBaseFourCC, GPMF_RECURSE_LEVELS | GPMF_TOLERANT))
+			{
+				if (GPMF_OK == GPMF_FindPrev(&any_stream, GPMF_KEY_TIME_STAMP, GPMF_CURRENT_LEVEL))
+				{
+					basetimestamp = BYTESWAP64(*(uint64_t*)GPMF_RawData(&any_stream));
+				}
+			}
+		}
+		else
+		{
+			while (GPMF_OK == GPMF_FindNext(&any_stream, GPMF_KEY_TIME_STAMP, GPMF_RECURSE_LEVELS | GPMF_TOLERANT))
+			{
+				uint64_t timestamp = BYTESWAP64(*(uint64_t*)GPMF_RawData(&any_stream));
+				if (timestamp < basetimestamp)
+					basetimestamp = timestamp;
+			}
+		}
+	}
+
+	return basetimestamp;
+}
+
+
+// The TSMP, STMP and TIMO of the stream ms is positioned within, each 0 when missing
+static void ReadStreamTiming(GPMF_stream *ms, uint32_t *tsmp, uint32_t *has_tsmp, uint64_t *stmp, float *timo)
+{
+	GPMF_stream find_stream;
+
+	*tsmp = 0;
+	*has_tsmp = 0;
+	*stmp = 0;
+	*timo = 0.0;
+
+	GPMF_CopyState(ms, &find_stream);
+	if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_TOTAL_SAMPLES, GPMF_CURRENT_LEVEL))
+	{
+		*tsmp = BYTESWAP32(*(uint32_t *)GPMF_RawData(&find_stream));
+		*has_tsmp = 1;
+	}
+
+	GPMF_CopyState(ms, &find_stream);
+	if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_TIME_STAMP, GPMF_CURRENT_LEVEL))
+		*stmp = BYTESWAP64(*(uint64_t *)GPMF_RawData(&find_stream));
+
+	GPMF_CopyState(ms, &find_stream);
+	if (GPMF_OK == GPMF_FindPrev(&find_stream, GPMF_KEY_TIME_OFFSET, GPMF_CURRENT_LEVEL))
+		GPMF_FormattedData(&find_stream, timo, 4, 0, 1);
+}
+
+
+// ms is positioned on the first instance of the stream's key within the payload, as GPMF_FindNext() from the start would leave it
+static void GatherRateStats(GPMF_stream *ms, rate_stats *st, uint32_t index, uint32_t *payload, uint32_t payloadsize, uint32_t timeBaseFourCC)
+{
+	GPMF_stream find_stream;
+	uint32_t samples = GPMF_PayloadSampleCount(ms);
+	uint32_t instances = samples;
+	uint32_t tsmp, has_tsmp;
+	uint64_t stmp;
+	float timo;
+
+	GPMF_CopyState(ms, &find_stream);
+	if (GPMF_OK == GPMF_FindNext(&find_stream, st->fourcc, GPMF_CURRENT_LEVEL)) // Count the instances, not the repeats
+	{
+		instances = 2;
+		while (GPMF_OK == GPMF_FindNext(&find_stream, st->fourcc, GPMF_CURRENT_LEVEL))
+			instances++;
+	}
+
+	ReadStreamTiming(ms, &tsmp, &has_tsmp, &stmp, &timo);
+
+	if (st->payload_count == 0)
+	{
+		st->first_payload = index;
+		st->first_samples = samples;
+		st->first_tsmp = tsmp;
+		st->has_first_tsmp = has_tsmp;
+		st->first_stmp = stmp;
+		if (stmp)
+			st->base_stmp = PayloadBaseTimestamp(payload, payloadsize, timeBaseFourCC, stmp);
+	}
+
+	st->payload_count++;
+	st->last_payload = index;
+	st->last_samples = samples;
+	st->last_tsmp = tsmp;
+	st->has_last_tsmp = has_tsmp;
+	st->last_stmp = stmp;
+	st->last_timo = timo;
+	st->counted_samples += samples;
+	st->instances[index] = instances;
+}
+
+
+// The rate and sample times GetGPMFSampleRate() computes, from the gathered values rather than reloading payloads
+static void RateFromStats(mp4callbacks *cb, rate_stats *st, double *payload_in, double *payload_out, uint8_t *time_valid, uint32_t flags, GPMF_stream_rate *result)
+{
+	uint32_t teststart = st->first_payload;
+	uint32_t testend = st->last_payload;
+	uint64_t basetimestamp = st->base_stmp;
+	uint64_t starttimestamp = st->first_stmp;
+	uint64_t endtimestamp = 0;
+	uint32_t samples = st->first_samples;
+	uint32_t startsamples = st->has_first_tsmp ? st->first_tsmp - samples : 0;
+	uint32_t endsamples = st->has_last_tsmp ? st->last_tsmp : st->counted_samples;
+	double startin = payload_in[teststart];
+	double endout = payload_out[testend];
+	double rate = 0.0, intercept = 0.0;
+	int usedTimeStamps = 0;
+
+	result->fourcc = st->fourcc;
+	result->rate = 0.0;
+	result->first_time = 0.0;
+	result->last_time = 0.0;
+
+	if (starttimestamp != 0)
+	{
+		uint32_t last_samples = st->last_samples;
+		uint32_t totaltimestamped_samples = endsamples - last_samples - startsamples;
+		double time_stamp_scale = 1000000000.0; // scan for nanoseconds, microseconds to seconds, all base 10.
+
+		endtimestamp = st->last_stmp;
+
+		if (endtimestamp)
+		{
+			double approxrate = 0.0;
+			if (endsamples > startsamples)
+				approxrate = (double)(endsamples - startsamples) / (endout - startin);
+
+			if (approxrate == 0.0)
+				approxrate = (double)(samples) / (endout - startin);
+
+
+			while (time_stamp_scale >= 1)
+			{
+				rate = (double)(totaltimestamped_samples) / ((double)(endtimestamp - starttimestamp) / time_stamp_scale);
+				if (rate*0.9 < approxrate && approxrate < rate*1.1)
+					break;
+
+				time_stamp_scale *= 0.1;
+			}
+			if (time_stamp_scale < 1.0) rate = 0.0;
+			intercept = (((double)basetimestamp - (double)starttimestamp) / time_stamp_scale) * rate;
+			usedTimeStamps = 1;
+		}
+	}
+
+	if (rate == 0.0) //Timestamps didn't help, or weren't available
+	{
+		if (!(flags & GPMF_SAMPLE_RATE_PRECISE))
+		{
+			if (endsamples > startsamples)
+				rate = (double)(endsamples - startsamples) / (endout - startin);
+
+			if (rate == 0.0)
+				rate = (double)(samples) / (endout - startin);
+
+			intercept = (double)-startin * rate;
+		}
+		else // line of best fit through the running sample count at each payload's end time
+		{
+			uint32_t payloadpos, payloadcount = 0;
+			double slope, top = 0.0, bot = 0.0, meanX = 0, meanY = 0;
+
+			samples = 0;
+			for (payloadpos = teststart; payloadpos <= testend; payloadpos++)
+			{
+				if (st->instances[payloadpos] != RATE_PAYLOAD_ABSENT)
+				{
+					payloadcount++;
+					samples += st->instances[payloadpos];
+					meanY += (double)samples;
+					if (time_valid[payloadpos])
+						meanX += payload_out[payloadpos];
+				}
+			}
+
+			meanY /= (double)payloadcount;
+			meanX /= (double)payloadcount;
+
+			samples = 0;
+			for (payloadpos = teststart; payloadpos <= testend; payloadpos++)
+			{
+				if (st->instances[payloadpos] != RATE_PAYLOAD_ABSENT)
+				{
+					samples += st->instances[payloadpos];
+					if (samples && time_valid[payloadpos])
+					{
+						top += ((double)payload_out[payloadpos] - meanX)*((double)samples - meanY);
+						bot += ((double)payload_out[payloadpos] - meanX)*((double)payload_out[payloadpos] - meanX);
+					}
+				}
+			}
+
+			slope = top / bot;
+			rate = slope;
+			intercept = meanY - slope * meanX;
+		}
+	}
+
+	result->rate = rate;
+
+	if (testend > 0)
+	{
+		uint32_t totalsamples = endsamples - startsamples;
+		double first, last;
+
+		first = -intercept / rate - st->last_timo;
+		last = first + (double)totalsamples / rate;
+
+		//Apply any Edit List corrections.
+		if (usedTimeStamps)  // clips with STMP have the Edit List already applied via GetPayloadTime()
+		{
+			if (cb->cbGetEditListOffsetRationalTime)
+			{
+				int32_t num = 0;
+				uint32_t dem = 1;
+				cb->cbGetEditListOffsetRationalTime(cb->mp4handle, &num, &dem);
+				first += (double)num / (double)dem;
+				last += (double)num / (double)dem;
+			}
+		}
+
+		result->first_time = first;
+		result->last_time = last;
+	}
+}
+
+
+static rate_cache *ComputeSampleRates(mp4callbacks *cb, uint32_t timeBaseFourCC, uint32_t flags)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	GPMF_directory *dir = NULL;
+	rate_cache *rc = NULL;
+	rate_stats *stats = NULL;
+	uint32_t stats_count = 0, stats_capacity = 0;
+	double *payload_in = NULL, *payload_out = NULL;
+	uint8_t *time_valid = NULL;
+	size_t payloadres = 0;
+	uint32_t indexcount = cb->cbGetNumberPayloads(cb->mp4handle);
+	uint32_t index, i;
+	GPMF_ERR ret = GPMF_OK;
+
+	rc = (rate_cache *)calloc(1, sizeof(rate_cache));
+	dir = (GPMF_directory *)malloc(sizeof(GPMF_directory));
+	payload_in = (double *)malloc((size_t)indexcount * sizeof(double) + 8);
+	payload_out = (double *)malloc((size_t)indexcount * sizeof(double) + 8);
+	time_valid = (uint8_t *)malloc((size_t)indexcount + 1);
+	if (rc == NULL || dir == NULL || payload_in == NULL || payload_out == NULL || time_valid == NULL)
+	{
+		ret = GPMF_ERROR_MEMORY;
+		goto cleanup;
+	}
+
+	rc->timeBaseFourCC = timeBaseFourCC;
+	rc->flags = flags;
+	memset(ms, 0, sizeof(GPMF_stream));
+
+	for (index = 0; index < indexcount; index++)
+	{
+		GPMF_stream_entry *entry;
+		GPMF_stream walk;
+		uint32_t *payload;
+		uint32_t payloadsize, next = 0;
+		double in = 0.0, out = 0.0;
+
+		time_valid[index] = (GPMF_OK == cb->cbGetPayloadTime(cb->mp4handle, index, &in, &out));
+		payload_in[index] = in;
+		payload_out[index] = out;
+
+		payload = ReadPayload(cb, &payloadres, index, &payloadsize);
+		if (GPMF_OK != OpenPayload(ms, dir, payload, payloadsize))
+			continue;
+
+		while ((entry = NextStream(ms, dir, &next, &walk)))
+		{
+			rate_stats *st = FindRateStats(&stats, &stats_count, &stats_capacity, entry->fourcc, indexcount);
+			if (st == NULL)
+			{
+				ret = GPMF_ERROR_MEMORY;
+				goto cleanup;
+			}
+
+			GatherRateStats(&walk, st, index, payload, payloadsize, timeBaseFourCC);
+		}
+	}
+
+	if (stats_count)
+	{
+		rc->rates = (GPMF_stream_rate *)malloc(stats_count * sizeof(GPMF_stream_rate));
+		if (rc->rates == NULL)
+		{
+			ret = GPMF_ERROR_MEMORY;
+			goto cleanup;
+		}
+
+		for (i = 0; i < stats_count; i++)
+			RateFromStats(cb, &stats[i], payload_in, payload_out, time_valid, flags, &rc->rates[i]);
+		rc->rate_count = stats_count;
+	}
+
+cleanup:
+	if (payloadres) cb->cbFreePayloadResource(cb->mp4handle, payloadres);
+	if (stats)
+	{
+		for (i = 0; i < stats_count; i++)
+			if (stats[i].instances) free(stats[i].instances);
+		free(stats);
+	}
+	if (dir) free(dir);
+	if (payload_in) free(payload_in);
+	if (payload_out) free(payload_out);
+	if (time_valid) free(time_valid);
+
+	if (ret != GPMF_OK)
+	{
+		FreeRateCache(rc);
+		rc = NULL;
+	}
+
+	return rc;
+}
+
+
+// The caller's optional hooks, those its version of mp4callbacks_ex doesn't have are left NULL
+static void OptionalCallbacks(mp4callbacks_ex *cbex, mp4callbacks_ex *hooks)
+{
+	memset(hooks, 0, sizeof(mp4callbacks_ex));
+	hooks->version = MP4CALLBACKS_EX_VERSION;
+
+	if (cbex && cbex->version >= 1)
+	{
+		hooks->cbGetHandleCache = cbex->cbGetHandleCache;
+		hooks->cbSetHandleCache = cbex->cbSetHandleCache;
+		hooks->cbLockHandleCache = cbex->cbLockHandleCache;
+		hooks->cbGetPayloadRange = cbex->cbGetPayloadRange;
+		hooks->threadsafe = cbex->threadsafe;
+	}
+}
+
+
+GPMF_ERR GetGPMFSampleRates(mp4callbacks cb, mp4callbacks_ex *cbex, uint32_t timeBaseFourCC, uint32_t flags, GPMF_stream_rate *rates, uint32_t *rate_count)
+{
+	mp4callbacks_ex hooks;
+	rate_cache *rc = NULL;
+	uint32_t count;
+	int cached;
+
+	if (cb.mp4handle == 0 || rate_count == NULL || (rates == NULL && *rate_count))
+		return GPMF_ERROR_MEMORY;
+
+	OptionalCallbacks(cbex, &hooks);
+	cached = (hooks.cbGetHandleCache && hooks.cbSetHandleCache && hooks.cbLockHandleCache);
+
+	// the lock is held until the rates are copied out, another thread could replace and release the cache
+	if (cached)
+	{
+		hooks.cbLockHandleCache(cb.mp4handle, 1);
+		rc = (rate_cache *)hooks.cbGetHandleCache(cb.mp4handle);
+		if (rc && (rc->timeBaseFourCC != timeBaseFourCC || rc->flags != flags))
+			rc = NULL;
+	}
+
+	if (rc == NULL)
+	{
+		rc = ComputeSampleRates(&cb, timeBaseFourCC, flags);
+		if (rc == NULL)
+		{
+			if (cached)
+				hooks.cbLockHandleCache(cb.mp4handle, 0);
+			return GPMF_ERROR_MEMORY;
+		}
+
+		if (cached)
+			hooks.cbSetHandleCache(cb.mp4handle, rc, FreeRateCache); // replaces rates for another time base or flags
+	}
+
+	count = rc->rate_count < *rate_count ? rc->rate_count : *rate_count;
+	if (count)
+		memcpy(rates, rc->rates, count * sizeof(GPMF_stream_rate));
+	*rate_count = rc->rate_count;
+
+	if (cached)
+		hooks.cbLockHandleCache(cb.mp4handle, 0);
+	else
+		FreeRateCache(rc);
+
+	return count < *rate_count ? GPMF_ERROR_MEMORY : GPMF_OK;
+}
+
+
+
+typedef struct extract_output
+{
+	double *data;
+	uint32_t samples;
+	uint32_t capacity;		// in samples
+	uint32_t elements;
+} extract_output;
+
+#define EXTRACT_BATCH			64		// payloads fetched together when the reader can coalesce reads
+
+typedef struct extract_worker
+{
+	mp4callbacks *cb;
+	mp4callbacks_ex *hooks;
+	GPMF_extracted_stream *streams;
+	uint32_t stream_count;
+	uint32_t first_payload;
+	uint32_t end_payload;
+	GPMF_mutex *io_lock;	// the mp4 callbacks are not required to be thread safe, NULL when they are
+	extract_output *output;	// one per stream, only covering this worker's payloads
+	GPMF_ERR ret;
+	GPMF_thread thread;
+} extract_worker;
+
+
+static GPMF_ERR ExtractInstance(GPMF_stream *ms, extract_output *out, uint32_t *payload_samples)
+{
+	uint32_t samples = GPMF_Repeat(ms);
+	uint32_t elements = GPMF_ElementsInStruct(ms);
+
+	if (samples == 0 || elements == 0)
+		return GPMF_OK;
+
+	if (out->elements == 0)
+		out->elements = elements;
+	else if (out->elements != elements) // a stream changing shape mid-file can't be stored contiguously
+		return GPMF_OK;
+
+	if (out->samples + samples > out->capacity)
+	{
+		uint32_t capacity = out->capacity * 2;
+		double *data;
+
+		if (capacity < out->samples + samples)
+			capacity = out->samples + samples;
+
+		data = (double *)realloc(out->data, (size_t)capacity * elements * sizeof(double));
+		if (data == NULL)
+			return GPMF_ERROR_MEMORY;
+
+		out->data = data;
+		out->capacity = capacity;
+	}
+
+	if (GPMF_OK == GPMF_ScaledData(ms, &out->data[(size_t)out->samples * elements], samples * elements * sizeof(double), 0, samples, GPMF_TYPE_DOUBLE))
+	{
+		out->samples += samples;
+		*payload_samples += samples;
+	}
+
+	return GPMF_OK;
+}
+
+
+static GPMF_ERR ExtractPayload(GPMF_extracted_stream *streams, uint32_t stream_count, extract_output *output, GPMF_stream *ms, GPMF_directory *dir, uint32_t *payload, uint32_t payloadsize, uint32_t index)
+{
+	GPMF_ERR ret = GPMF_OK;
+	uint32_t i;
+
+	if (GPMF_OK != OpenPayload(ms, dir, payload, payloadsize))
+		return GPMF_OK;
+
+	for (i = 0; i < stream_count && ret == GPMF_OK; i++)
+	{
+		uint32_t uncounted = 0;
+		uint32_t *payload_samples = streams[i].payload_samples ? &streams[i].payload_samples[index] : &uncounted;
+
+		if (GPMF_OK != SeekToStream(ms, dir, streams[i].fourcc, streams[i].device_id))
+			continue;
+
+		do // streams may store each sample as a separate instance of the same key
+		{
+			ret = ExtractInstance(ms, &output[i], payload_samples);
+		} while (ret == GPMF_OK && GPMF_OK == GPMF_FindNext(ms, streams[i].fourcc, GPMF_CURRENT_LEVEL | GPMF_TOLERANT));
+	}
+
+	return ret;
+}
+
+
+static GPMF_ERR ExtractPayloadRange(extract_worker *w)
+{
+	mp4callbacks *cb = w->cb;
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	GPMF_directory *dir = (GPMF_directory *)malloc(sizeof(GPMF_directory));
+	uint32_t *batch[EXTRACT_BATCH];
+	size_t payloadres = 0;
+	uint32_t index, count, i;
+	GPMF_ERR ret = GPMF_OK;
+
+	if (dir == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	memset(ms, 0, sizeof(GPMF_stream));
+
+	for (index = w->first_payload; index < w->end_payload && ret == GPMF_OK; index += count)
+	{
+		count = 1;
+
+		if (w->hooks->cbGetPayloadRange) // a batch of payloads in a few large reads
+		{
+			count = w->end_payload - index;
+			if (count > EXTRACT_BATCH)
+				count = EXTRACT_BATCH;
+
+			if (w->io_lock) GPMF_MutexLock(w->io_lock);
+			if (payloadres == 0)
+				payloadres = cb->cbGetPayloadResource(cb->mp4handle, 0, 0);
+			if (0 == w->hooks->cbGetPayloadRange(cb->mp4handle, payloadres, index, count, batch))
+				memset(batch, 0, sizeof(batch));
+			if (w->io_lock) GPMF_MutexUnlock(w->io_lock);
+
+			for (i = 0; i < count && ret == GPMF_OK; i++)
+				ret = ExtractPayload(w->streams, w->stream_count, w->output, ms, dir, batch[i], cb->cbGetPayloadSize(cb->mp4handle, index + i), index + i);
+		}
+		else
+		{
+			uint32_t *payload;
+			uint32_t payloadsize;
+
+			if (w->io_lock) GPMF_MutexLock(w->io_lock);
+			payload = ReadPayload(cb, &payloadres, index, &payloadsize);
+			if (w->io_lock) GPMF_MutexUnlock(w->io_lock);
+
+			ret = ExtractPayload(w->streams, w->stream_count, w->output, ms, dir, payload, payloadsize, index);
+		}
+	}
+
+	if (payloadres)
+	{
+		if (w->io_lock) GPMF_MutexLock(w->io_lock);
+		cb->cbFreePayloadResource(cb->mp4handle, payloadres);
+		if (w->io_lock) GPMF_MutexUnlock(w->io_lock);
+	}
+	GPMF_Free(ms);
+	free(dir);
+
+	return ret;
+}
+
+
+GPMF_THREAD_FUNC(ExtractWorkerThread, arg)
+{
+	extract_worker *w = (extract_worker *)arg;
+	w->ret = ExtractPayloadRange(w);
+	GPMF_THREAD_RETURN;
+}
+
+
+void GPMF_FreeExtractedStreams(GPMF_extracted_stream *streams, uint32_t stream_count)
+{
+	uint32_t i;
+
+	if (streams == NULL)
+		return;
+
+	for (i = 0; i < stream_count; i++)
+	{
+		if (streams[i].data) free(streams[i].data);
+		if (streams[i].payload_samples) free(streams[i].payload_samples);
+		streams[i].data = NULL;
+		streams[i].payload_samples = NULL;
+		streams[i].elements = 0;
+		streams[i].samples = 0;
+	}
+}
+
+
+GPMF_ERR GPMF_ExtractStreams(mp4callbacks cb, mp4callbacks_ex *cbex, GPMF_extracted_stream *streams, uint32_t stream_count, uint32_t threads)
+{
+	mp4callbacks_ex hooks;
+	extract_worker *workers = NULL;
+	uint32_t *started = NULL;
+	GPMF_mutex io_lock;
+	uint32_t indexcount, w, i;
+	GPMF_ERR ret = GPMF_OK;
+
+	if (cb.mp4handle == 0 || streams == NULL || stream_count == 0)
+		return GPMF_ERROR_MEMORY;
+
+	for (i = 0; i < stream_count; i++)
+	{
+		streams[i].elements = 0;
+		streams[i].samples = 0;
+		streams[i].data = NULL;
+		streams[i].payload_samples = NULL;
+	}
+
+	indexcount = cb.cbGetNumberPayloads(cb.mp4handle);
+	if (indexcount == 0)
+		return GPMF_OK;
+
+	OptionalCallbacks(cbex, &hooks);
+
+	if (threads == 0)
+		threads = GPMF_CPUCount();
+	if (threads > indexcount)
+		threads = indexcount;
+
+	for (i = 0; i < stream_count; i++)
+	{
+		streams[i].payload_samples = (uint32_t *)calloc(indexcount, sizeof(uint32_t));
+		if (streams[i].payload_samples == NULL)
+		{
+			ret = GPMF_ERROR_MEMORY;
+			goto cleanup;
+		}
+	}
+
+	workers = (extract_worker *)calloc(threads, sizeof(extract_worker));
+	started = (uint32_t *)calloc(threads, sizeof(uint32_t));
+	if (workers == NULL || started == NULL)
+	{
+		ret = GPMF_ERROR_MEMORY;
+		goto cleanup;
+	}
+
+	GPMF_MutexInit(&io_lock);
+
+	// Each worker takes a contiguous range of payloads so the results can be stitched in worker order.
+	for (w = 0; w < threads; w++)
+	{
+		workers[w].cb = &cb;
+		workers[w].hooks = &hooks;
+		workers[w].streams = streams;
+		workers[w].stream_count = stream_count;
+		workers[w].first_payload = (uint32_t)((uint64_t)indexcount * w / threads);
+		workers[w].end_payload = (uint32_t)((uint64_t)indexcount * (w + 1) / threads);
+		workers[w].io_lock = hooks.threadsafe ? NULL : &io_lock;
+		workers[w].output = (extract_output *)calloc(stream_count, sizeof(extract_output));
+		workers[w].ret = workers[w].output ? GPMF_OK : GPMF_ERROR_MEMORY;
+	}
+
+	for (w = 1; w < threads; w++)
+	{
+		if (workers[w].ret == GPMF_OK && 0 == GPMF_ThreadCreate(&workers[w].thread, ExtractWorkerThread, &workers[w]))
+			started[w] = 1;
+	}
+
+	// The calling thread takes the first range, and any range a thread couldn't be started for.
+	for (w = 0; w < threads; w++)
+	{
+		if (!started[w] && workers[w].ret == GPMF_OK)
+			workers[w].ret = ExtractPayloadRange(&workers[w]);
+	}
+
+	for (w = 1; w < threads; w++)
+	{
+		if (started[w])
+			GPMF_ThreadJoin(workers[w].thread);
+	}
+
+	GPMF_MutexFree(&io_lock);
+
+	for (w = 0; w < threads; w++)
+	{
+		if (workers[w].ret != GPMF_OK)
+		{
+			ret = workers[w].ret;
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; i < stream_count; i++)
+	{
+		uint32_t elements = 0;
+		uint32_t samples = 0;
+
+		for (w = 0; w < threads; w++)
+		{
+			extract_output *out = &workers[w].output[i];
+
+			if (elements == 0)
+				elements = out->elements;
+
+			if (out->elements != elements) // shape changed between ranges, drop the later range
+			{
+				uint32_t index;
+				for (index = workers[w].first_payload; index < workers[w].end_payload; index++)
+					streams[i].payload_samples[index] = 0;
+				out->samples = 0;
+			}
+			samples += out->samples;
+		}
+
+		streams[i].elements = elements;
+
+		if (samples)
+		{
+			double *dst = (double *)malloc((size_t)samples * elements * sizeof(double));
+			if (dst == NULL)
+			{
+				ret = GPMF_ERROR_MEMORY;
+				goto cleanup;
+			}
+
+			streams[i].data = dst;
+			streams[i].samples = samples;
+
+			for (w = 0; w < threads; w++)
+			{
+				extract_output *out = &workers[w].output[i];
+				if (out->samples)
+				{
+					memcpy(dst, out->data, (size_t)out->samples * elements * sizeof(double));
+					dst += (size_t)out->samples * elements;
+				}
+			}
+		}
+	}
+
+cleanup:
+	if (workers)
+	{
+		for (w = 0; w < threads; w++)
+		{
+			if (workers[w].output)
+			{
+				for (i = 0; i < stream_count; i++)
+					if (workers[w].output[i].data) free(workers[w].output[i].data);
+				free(workers[w].output);
+			}
+		}
+		free(workers);
+	}
+	if (started) free(started);
+
+	if (ret != GPMF_OK)
+		GPMF_FreeExtractedStreams(streams, stream_count);
+
+	return ret;
+}
+
+
+
+// The pipeline runs its stages on two threads: a reader keeping up to depth payloads ahead, and a decoder scaling the
+// requested streams of each payload read. Payload n always uses slot n % depth, so the stages only ever wait on the
+// state of one slot, and a slot's buffers are kept from payload to payload.
+
+enum pipeline_slot_state
+{
+	SLOT_FREE = 0,
+	SLOT_READ,
+	SLOT_DECODED,
+	SLOT_DELIVERED				// held by the caller until GPMF_ReleaseBlock()
+};
+
+typedef struct pipeline_slot
+{
+	uint32_t state;
+	size_t payloadres;
+	uint32_t *payload;
+	uint32_t payloadsize;
+	extract_output *output;		// one per stream, the data only grows
+	GPMF_sample_block block;
+} pipeline_slot;
+
+typedef struct pipeline
+{
+	mp4callbacks cb;
+	GPMF_extracted_stream *streams;	// the requested fourcc and device_id of each stream, no payload_samples
+	uint32_t stream_count;
+	uint32_t payload_count;
+	uint32_t depth;
+	pipeline_slot *slots;
+	uint32_t next_read, next_decode, next_deliver;
+	GPMF_stream ms;				// decoder state, keeps any codebook from payload to payload
+	GPMF_directory *dir;
+	GPMF_mutex lock;
+	GPMF_cond changed;
+	GPMF_thread reader, decoder;
+	uint32_t reader_started, decoder_started;
+	uint32_t quit;
+} pipeline;
+
+
+static void ReadStage(pipeline *p, pipeline_slot *s, uint32_t index)
+{
+	mp4callbacks *cb = &p->cb;
+
+	s->payload = ReadPayload(cb, &s->payloadres, index, &s->payloadsize);
+
+	s->block.payload_index = index;
+	s->block.in = s->block.out = 0.0;
+	if (cb->cbGetPayloadTime)
+		cb->cbGetPayloadTime(cb->mp4handle, index, &s->block.in, &s->block.out);
+}
+
+
+static void DecodeStage(pipeline *p, pipeline_slot *s)
+{
+	uint32_t i;
+
+	for (i = 0; i < p->stream_count; i++)
+	{
+		s->output[i].samples = 0;
+		s->output[i].elements = 0;
+	}
+
+	s->block.ret = ExtractPayload(p->streams, p->stream_count, s->output, &p->ms, p->dir, s->payload, s->payloadsize, s->block.payload_index);
+
+	for (i = 0; i < p->stream_count; i++)
+	{
+		s->block.streams[i].elements = s->output[i].elements;
+		s->block.streams[i].samples = s->output[i].samples;
+		s->block.streams[i].data = s->output[i].data;
+	}
+}
+
+
+GPMF_THREAD_FUNC(PipelineReadThread, arg)
+{
+	pipeline *p = (pipeline *)arg;
+
+	GPMF_MutexLock(&p->lock);
+	while (!p->quit && p->next_read < p->payload_count)
+	{
+		uint32_t index = p->next_read;
+		pipeline_slot *s = &p->slots[index % p->depth];
+
+		if (s->state != SLOT_FREE)
+		{
+			GPMF_CondWait(&p->changed, &p->lock);
+			continue;
+		}
+
+		GPMF_MutexUnlock(&p->lock);
+		ReadStage(p, s, index);
+		GPMF_MutexLock(&p->lock);
+
+		s->state = SLOT_READ;
+		p->next_read++;
+		GPMF_CondBroadcast(&p->changed);
+	}
+	GPMF_MutexUnlock(&p->lock);
+
+	GPMF_THREAD_RETURN;
+}
+
+
+GPMF_THREAD_FUNC(PipelineDecodeThread, arg)
+{
+	pipeline *p = (pipeline *)arg;
+
+	GPMF_MutexLock(&p->lock);
+	while (!p->quit && p->next_decode < p->payload_count)
+	{
+		pipeline_slot *s = &p->slots[p->next_decode % p->depth];
+
+		if (s->state != SLOT_READ)
+		{
+			GPMF_CondWait(&p->changed, &p->lock);
+			continue;
+		}
+
+		GPMF_MutexUnlock(&p->lock);
+		DecodeStage(p, s);
+		GPMF_MutexLock(&p->lock);
+
+		s->state = SLOT_DECODED;
+		p->next_decode++;
+		GPMF_CondBroadcast(&p->changed);
+	}
+	GPMF_MutexUnlock(&p->lock);
+
+	GPMF_THREAD_RETURN;
+}
+
+
+void GPMF_ClosePipeline(size_t pipelineHandle)
+{
+	pipeline *p = (pipeline *)pipelineHandle;
+	uint32_t n, i;
+
+	if (p == NULL)
+		return;
+
+	GPMF_MutexLock(&p->lock);
+	p->quit = 1;
+	GPMF_CondBroadcast(&p->changed);
+	GPMF_MutexUnlock(&p->lock);
+
+	if (p->reader_started) GPMF_ThreadJoin(p->reader);
+	if (p->decoder_started) GPMF_ThreadJoin(p->decoder);
+
+	if (p->slots)
+	{
+		for (n = 0; n < p->depth; n++)
+		{
+			pipeline_slot *s = &p->slots[n];
+
+			if (s->payloadres)
+				p->cb.cbFreePayloadResource(p->cb.mp4handle, s->payloadres);
+			if (s->output)
+			{
+				for (i = 0; i < p->stream_count; i++)
+					if (s->output[i].data) free(s->output[i].data);
+				free(s->output);
+			}
+			if (s->block.streams) free(s->block.streams);
+		}
+		free(p->slots);
+	}
+
+	GPMF_CondFree(&p->changed);
+	GPMF_MutexFree(&p->lock);
+	GPMF_Free(&p->ms);
+	if (p->dir) free(p->dir);
+	if (p->streams) free(p->streams);
+	free(p);
+}
+
+
+GPMF_ERR GPMF_OpenPipeline(mp4callbacks cb, GPMF_extracted_stream *streams, uint32_t stream_count, uint32_t depth, size_t *pipelineHandle)
+{
+	pipeline *p;
+	uint32_t n, i;
+
+	if (pipelineHandle == NULL)
+		return GPMF_ERROR_MEMORY;
+	*pipelineHandle = 0;
+
+	if (cb.mp4handle == 0 || streams == NULL || stream_count == 0)
+		return GPMF_ERROR_MEMORY;
+
+	if (depth < 2)
+		depth = 2; // one being delivered while the next is prepared
+
+	p = (pipeline *)calloc(1, sizeof(pipeline));
+	if (p == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	GPMF_MutexInit(&p->lock);
+	GPMF_CondInit(&p->changed);
+
+	p->cb = cb;
+	p->stream_count = stream_count;
+	p->depth = depth;
+	p->payload_count = cb.cbGetNumberPayloads(cb.mp4handle);
+	p->streams = (GPMF_extracted_stream *)calloc(stream_count, sizeof(GPMF_extracted_stream));
+	p->dir = (GPMF_directory *)malloc(sizeof(GPMF_directory));
+	p->slots = (pipeline_slot *)calloc(depth, sizeof(pipeline_slot));
+	if (p->streams == NULL || p->dir == NULL || p->slots == NULL)
+		goto cleanup;
+
+	for (i = 0; i < stream_count; i++)
+	{
+		p->streams[i].fourcc = streams[i].fourcc;
+		p->streams[i].device_id = streams[i].device_id;
+	}
+
+	for (n = 0; n < depth; n++)
+	{
+		pipeline_slot *s = &p->slots[n];
+
+		s->output = (extract_output *)calloc(stream_count, sizeof(extract_output));
+		s->block.streams = (GPMF_extracted_stream *)calloc(stream_count, sizeof(GPMF_extracted_stream));
+		if (s->output == NULL || s->block.streams == NULL)
+			goto cleanup;
+
+		s->block.stream_count = stream_count;
+		for (i = 0; i < stream_count; i++)
+		{
+			s->block.streams[i].fourcc = streams[i].fourcc;
+			s->block.streams[i].device_id = streams[i].device_id;
+		}
+	}
+
+	// Without threads GPMF_NextBlock() reads and decodes each payload itself.
+	p->reader_started = (0 == GPMF_ThreadCreate(&p->reader, PipelineReadThread, p));
+	if (p->reader_started)
+		p->decoder_started = (0 == GPMF_ThreadCreate(&p->decoder, PipelineDecodeThread, p));
+
+	*pipelineHandle = (size_t)p;
+	return GPMF_OK;
+
+cleanup:
+	GPMF_ClosePipeline((size_t)p);
+	return GPMF_ERROR_MEMORY;
+}
+
+
+GPMF_ERR GPMF_NextBlock(size_t pipelineHandle, GPMF_sample_block **block)
+{
+	pipeline *p = (pipeline *)pipelineHandle;
+	pipeline_slot *s;
+	uint32_t index;
+
+	if (p == NULL || block == NULL)
+		return GPMF_ERROR_MEMORY;
+	*block = NULL;
+
+	GPMF_MutexLock(&p->lock);
+	index = p->next_deliver;
+	if (index >= p->payload_count)
+	{
+		GPMF_MutexUnlock(&p->lock);
+		return GPMF_ERROR_LAST;
+	}
+
+	s = &p->slots[index % p->depth];
+	if (s->state == SLOT_DELIVERED)
+	{
+		GPMF_MutexUnlock(&p->lock);
+		return GPMF_ERROR_MEMORY; // every slot is held by the caller, release one first
+	}
+
+	// any stage without a thread of its own is run here, in order
+	if (!p->reader_started && s->state == SLOT_FREE)
+	{
+		ReadStage(p, s, index);
+		s->state = SLOT_READ;
+		p->next_read++;
+	}
+	if (!p->decoder_started)
+	{
+		while (s->state != SLOT_READ)
+			GPMF_CondWait(&p->changed, &p->lock);
+
+		GPMF_MutexUnlock(&p->lock);
+		DecodeStage(p, s);
+		GPMF_MutexLock(&p->lock);
+
+		s->state = SLOT_DECODED;
+		p->next_decode++;
+	}
+
+	while (s->state != SLOT_DECODED)
+		GPMF_CondWait(&p->changed, &p->lock);
+
+	s->state = SLOT_DELIVERED;
+	p->next_deliver++;
+	GPMF_MutexUnlock(&p->lock);
+
+	*block = &s->block;
+	return s->block.ret;
+}
+
+
+void GPMF_ReleaseBlock(size_t pipelineHandle, GPMF_sample_block *block)
+{
+	pipeline *p = (pipeline *)pipelineHandle;
+
+	if (p == NULL || block == NULL)
+		return;
+
+	GPMF_MutexLock(&p->lock);
+	p->slots[block->payload_index % p->depth].state = SLOT_FREE;
+	GPMF_CondBroadcast(&p->changed);
+	GPMF_MutexUnlock(&p->lock);
+}
+
+
+
+static int InstanceScales(GPMF_stream *ms, uint32_t elements)
+{
+	double local[16], *probe = elements <= 16 ? local : (double *)malloc(elements * sizeof(double));
+	GPMF_ERR ret = GPMF_ERROR_MEMORY;
+
+	if (probe)
+		ret = GPMF_ScaledData(ms, probe, elements * sizeof(double), 0, 1, GPMF_TYPE_DOUBLE);
+	if (probe && probe != local)
+		free(probe);
+
+	return ret == GPMF_OK;
+}
+
+
+// The samples of the table's stream within a payload, counted as GPMF_ExtractStreams() does: the repeats of every 
+// instance of the key. When a buffer is given, the payload's samples from offset to offset + count are scaled into it.
+static uint32_t PayloadSamples(GPMF_stream *ms, GPMF_directory *dir, GPMF_sample_table *table, uint32_t *payload, uint32_t payloadsize, uint32_t offset, uint32_t count, double *buffer)
+{
+	uint32_t samples = 0;
+
+	if (GPMF_OK != OpenPayload(ms, dir, payload, payloadsize) || GPMF_OK != SeekToStream(ms, dir, table->fourcc, table->device_id))
+		return 0;
+
+	do
+	{
+		uint32_t repeat = GPMF_Repeat(ms);
+		uint32_t elements = GPMF_ElementsInStruct(ms);
+
+		if (repeat == 0 || elements == 0)
+			continue;
+
+		if (table->elements == 0)
+			table->elements = elements;
+		else if (table->elements != elements) // a stream changing shape mid-file can't be stored contiguously
+			continue;
+
+		if (!InstanceScales(ms, elements)) // GPMF_ExtractStreams() stores no samples for it, e.g. a string
+			continue;
+
+		if (buffer && samples + repeat > offset && samples < offset + count)
+		{
+			uint32_t first = offset > samples ? offset - samples : 0;
+			uint32_t last = offset + count - samples < repeat ? offset + count - samples : repeat;
+			double *dst = &buffer[(size_t)(samples + first - offset) * elements];
+			uint32_t size = (last - first) * elements * sizeof(double);
+
+			if (GPMF_OK != GPMF_ScaledData(ms, dst, size, first, last - first, GPMF_TYPE_DOUBLE))
+				memset(dst, 0, size);
+		}
+		samples += repeat;
+	} while (GPMF_OK == GPMF_FindNext(ms, table->fourcc, GPMF_CURRENT_LEVEL | GPMF_TOLERANT));
+
+	return samples;
+}
+
+
+void GPMF_FreeSampleTable(GPMF_sample_table *table)
+{
+	if (table == NULL)
+		return;
+
+	if (table->first_sample) free(table->first_sample);
+	if (table->payload_in) free(table->payload_in);
+	if (table->payload_out) free(table->payload_out);
+	table->first_sample = NULL;
+	table->payload_in = NULL;
+	table->payload_out = NULL;
+	table->payload_count = 0;
+	table->elements = 0;
+}
+
+
+GPMF_ERR GPMF_BuildSampleTable(mp4callbacks cb, GPMF_sample_table *table)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	GPMF_directory *dir = NULL;
+	size_t payloadres = 0;
+	uint32_t indexcount, index, total = 0;
+	GPMF_ERR ret = GPMF_OK;
+
+	if (cb.mp4handle == 0 || table == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	indexcount = cb.cbGetNumberPayloads(cb.mp4handle);
+
+	table->elements = 0;
+	table->payload_count = indexcount;
+	table->first_sample = (uint32_t *)malloc(((size_t)indexcount + 1) * sizeof(uint32_t));
+	table->payload_in = (double *)malloc(((size_t)indexcount + 1) * sizeof(double));
+	table->payload_out = (double *)malloc(((size_t)indexcount + 1) * sizeof(double));
+	dir = (GPMF_directory *)malloc(sizeof(GPMF_directory));
+	if (table->first_sample == NULL || table->payload_in == NULL || table->payload_out == NULL || dir == NULL)
+	{
+		ret = GPMF_ERROR_MEMORY;
+		goto cleanup;
+	}
+
+	memset(ms, 0, sizeof(GPMF_stream));
+
+	for (index = 0; index < indexcount; index++)
+	{
+		uint32_t *payload;
+		uint32_t payloadsize;
+		double in = 0.0, out = 0.0;
+
+		table->first_sample[index] = total;
+
+		cb.cbGetPayloadTime(cb.mp4handle, index, &in, &out);
+		table->payload_in[index] = in;
+		table->payload_out[index] = out;
+
+		payload = ReadPayload(&cb, &payloadres, index, &payloadsize);
+		total += PayloadSamples(ms, dir, table, payload, payloadsize, 0, 0, NULL);
+	}
+	table->first_sample[indexcount] = total;
+
+cleanup:
+	if (payloadres) cb.cbFreePayloadResource(cb.mp4handle, payloadres);
+	if (dir) free(dir);
+
+	if (ret != GPMF_OK)
+		GPMF_FreeSampleTable(table);
+
+	return ret;
+}
+
+
+// The payload holding a sample, the last payload starting at or before it, so empty payloads are skipped
+static uint32_t PayloadOfSample(GPMF_sample_table *table, uint32_t sample)
+{
+	uint32_t lo = 0, hi = table->payload_count;
+
+	while (hi - lo > 1)
+	{
+		uint32_t mid = (lo + hi) >> 1;
+		if (table->first_sample[mid] <= sample)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+uint32_t GPMF_SampleAtTime(GPMF_sample_table *table, double time, uint32_t *payload_index)
+{
+	uint32_t lo = 0, hi, total, sample, samples;
+	double in, out;
+
+	if (table == NULL || table->first_sample == NULL || table->payload_count == 0)
+		return 0;
+
+	total = table->first_sample[table->payload_count];
+	if (total == 0)
+		return 0;
+
+	// the last payload starting at or before the time
+	hi = table->payload_count;
+	while (hi - lo > 1)
+	{
+		uint32_t mid = (lo + hi) >> 1;
+		if (table->payload_in[mid] <= time)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	in = table->payload_in[lo];
+	out = table->payload_out[lo];
+	samples = table->first_sample[lo + 1] - table->first_sample[lo];
+	sample = table->first_sample[lo];
+
+	if (samples && time > in && out > in)
+	{
+		double offset = (time - in) * (double)samples / (out - in);
+		sample += offset < (double)samples ? (uint32_t)offset : samples - 1;
+	}
+
+	if (sample >= total) // after the last sample, or within trailing payloads without any
+		sample = total - 1;
+
+	// The division above can land a sample either side of the one GPMF_SampleTime() places at the time, settle on the 
+	// last sample at or before it so that times from GPMF_SampleTime() map back to their samples.
+	while (sample + 1 < total && GPMF_SampleTime(table, sample + 1) <= time)
+		sample++;
+	while (sample > 0 && GPMF_SampleTime(table, sample) > time)
+		sample--;
+
+	if (payload_index)
+		*payload_index = PayloadOfSample(table, sample);
+
+	return sample;
+}
+
+
+GPMF_ERR GPMF_SampleRangeAtTime(GPMF_sample_table *table, double start, double end, uint32_t *first_sample, uint32_t *sample_count)
+{
+	uint32_t first, last, total;
+
+	if (table == NULL || table->first_sample == NULL || first_sample == NULL || sample_count == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	*first_sample = 0;
+	*sample_count = 0;
+
+	if (table->payload_count == 0 || table->first_sample[table->payload_count] == 0 || end < start)
+		return GPMF_ERROR_FIND;
+
+	// the samples span from the first's time to the out time of the last's payload
+	total = table->first_sample[table->payload_count];
+	if (end < GPMF_SampleTime(table, 0) || start >= table->payload_out[PayloadOfSample(table, total - 1)])
+		return GPMF_ERROR_FIND;
+
+	first = GPMF_SampleAtTime(table, start, NULL);
+	last = GPMF_SampleAtTime(table, end, NULL);
+
+	*first_sample = first;
+	*sample_count = last - first + 1;
+
+	return GPMF_OK;
+}
+
+
+double GPMF_SampleTime(GPMF_sample_table *table, uint32_t sample)
+{
+	uint32_t index, samples;
+
+	if (table == NULL || table->first_sample == NULL || table->payload_count == 0)
+		return 0.0;
+
+	index = PayloadOfSample(table, sample);
+	samples = table->first_sample[index + 1] - table->first_sample[index];
+	if (samples == 0)
+		return table->payload_in[index];
+
+	return table->payload_in[index] + (table->payload_out[index] - table->payload_in[index]) * (double)(sample - table->first_sample[index]) / (double)samples;
+}
+
+
+GPMF_ERR GPMF_ReadSamples(mp4callbacks cb, GPMF_sample_table *table, uint32_t first_sample, uint32_t sample_count, double *buffer, uint32_t buffersize)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	GPMF_directory *dir;
+	size_t payloadres = 0;
+	uint32_t index, sample = first_sample, end_sample;
+	GPMF_ERR ret = GPMF_OK;
+
+	if (cb.mp4handle == 0 || table == NULL || table->first_sample == NULL || buffer == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	if (sample_count == 0)
+		return GPMF_OK;
+
+	end_sample = first_sample + sample_count;
+	if (end_sample < first_sample || end_sample > table->first_sample[table->payload_count])
+		return GPMF_ERROR_BUFFER_END;
+
+	if ((uint64_t)sample_count * table->elements * sizeof(double) > buffersize)
+		return GPMF_ERROR_MEMORY;
+
+	dir = (GPMF_directory *)malloc(sizeof(GPMF_directory));
+	if (dir == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	memset(ms, 0, sizeof(GPMF_stream));
+
+	// Only the payloads holding the requested samples are loaded
+	for (index = PayloadOfSample(table, first_sample); index < table->payload_count && sample < end_sample; index++)
+	{
+		uint32_t *payload;
+		uint32_t payloadsize;
+		uint32_t offset = sample - table->first_sample[index];
+		uint32_t count = table->first_sample[index + 1] - sample;
+
+		if (table->first_sample[index + 1] <= sample)
+			continue;
+		if (count > end_sample - sample)
+			count = end_sample - sample;
+
+		payload = ReadPayload(&cb, &payloadres, index, &payloadsize);
+		if (PayloadSamples(ms, dir, table, payload, payloadsize, offset, count, &buffer[(size_t)(sample - first_sample) * table->elements]) < offset + count)
+		{
+			ret = GPMF_ERROR_BAD_STRUCTURE; // the payload no longer matches the table
+			break;
+		}
+
+		sample += count;
+	}
+
+	if (payloadres) cb.cbFreePayloadResource(cb.mp4handle, payloadres);
+	free(dir);
+
+	return ret;
+}
+
+
+
+// Incremental least squares of y = slope * x + intercept, the sums are relative to the first observation 
+// so that large timestamps keep their precision.
+typedef struct clock_fit
+{
+	double x0, y0;
+	double n, sx, sy, sxx, sxy, syy;
+} clock_fit;
+
+static void FitAdd(clock_fit *f, double x, double y)
+{
+	if (f->n == 0.0)
+	{
+		f->x0 = x;
+		f->y0 = y;
+	}
+
+	x -= f->x0;
+	y -= f->y0;
+
+	f->n += 1.0;
+	f->sx += x;
+	f->sy += y;
+	f->sxx += x * x;
+	f->sxy += x * y;
+	f->syy += y * y;
+}
+
+// sums about the means
+static double FitSxx(clock_fit *f) { return f->n > 0.0 ? f->sxx - f->sx * f->sx / f->n : 0.0; }
+static double FitSxy(clock_fit *f) { return f->n > 0.0 ? f->sxy - f->sx * f->sy / f->n : 0.0; }
+static double FitSyy(clock_fit *f) { return f->n > 0.0 ? f->syy - f->sy * f->sy / f->n : 0.0; }
+
+static int FitSolve(clock_fit *f, double *slope, double *intercept, double *rms)
+{
+	double sxx = FitSxx(f), sse;
+
+	if (f->n < 2.0 || sxx <= 0.0)
+		return 0;
+
+	*slope = FitSxy(f) / sxx;
+	*intercept = f->y0 + (f->sy - *slope * f->sx) / f->n - *slope * f->x0;
+
+	sse = FitSyy(f) - *slope * FitSxy(f);
+	*rms = sse > 0.0 ? sqrt(sse / f->n) : 0.0; // in units of y
+
+	return 1;
+}
+
+
+typedef struct clock_stats
+{
+	uint32_t fourcc;
+	uint32_t payload_count;
+	uint32_t samples;				// counted so far, the index of the next payload's first sample
+	uint32_t last_tsmp;				// TSMP of the previous payload
+	uint32_t has_last_tsmp;
+	uint32_t tsmp_matches;			// payload steps where the TSMP advanced by the samples counted
+	uint32_t tsmp_unreliable;		// a step disagreed with the count, TSMP is no longer used to find drops
+	uint32_t stmp_count;			// payloads with STMP
+	float last_timo;
+	double first_in, last_out;
+	uint32_t first_samples;
+	clock_fit media;				// sample index at each payload's start against its MP4 in time
+	clock_fit stamped;				// sample index at each payload's start against its STMP, in ticks from the time base
+	clock_fit ticks;				// MP4 in time against STMP, pooled over all streams for the STMP units
+} clock_stats;
+
+
+static clock_stats *FindClockStats(clock_stats **stats, uint32_t *count, uint32_t *capacity, uint32_t fourcc)
+{
+	clock_stats *st;
+	uint32_t i;
+
+	for (i = 0; i < *count; i++)
+	{
+		if ((*stats)[i].fourcc == fourcc)
+			return &(*stats)[i];
+	}
+
+	if (*count == *capacity)
+	{
+		uint32_t newcapacity = *capacity ? *capacity * 2 : 16;
+		clock_stats *grown = (clock_stats *)realloc(*stats, newcapacity * sizeof(clock_stats));
+		if (grown == NULL)
+			return NULL;
+
+		*stats = grown;
+		*capacity = newcapacity;
+	}
+
+	st = &(*stats)[*count];
+	memset(st, 0, sizeof(clock_stats));
+	st->fourcc = fourcc;
+
+	(*count)++;
+	return st;
+}
+
+
+static void GatherClockStats(GPMF_stream *ms, clock_stats *st, double in, double out, uint64_t basetimestamp)
+{
+	uint32_t samples = GPMF_PayloadSampleCount(ms);
+	uint32_t tsmp, has_tsmp, first;
+	uint64_t stmp;
+	float timo;
+
+	ReadStreamTiming(ms, &tsmp, &has_tsmp, &stmp, &timo);
+
+	if (st->payload_count == 0)
+	{
+		st->first_in = in;
+		st->first_samples = samples;
+	}
+
+	// Samples are counted. Some streams advance TSMP by other than their sample count, so it only steps the index 
+	// over dropped payloads once it has agreed with the count, and never after it has disagreed.
+	first = st->samples;
+	if (has_tsmp && st->has_last_tsmp && !st->tsmp_unreliable)
+	{
+		uint32_t step = tsmp - st->last_tsmp;
+
+		if (step == samples)
+			st->tsmp_matches++;
+		else if (step > samples && st->tsmp_matches)
+			first += step - samples; // samples of the dropped payloads
+		else
+			st->tsmp_unreliable = 1;
+	}
+	st->last_tsmp = tsmp;
+	st->has_last_tsmp = has_tsmp;
+
+	FitAdd(&st->media, in, (double)first); // a truncated last payload still has a nominal out time
+	if (stmp)
+	{
+		FitAdd(&st->stamped, (double)(int64_t)(stmp - basetimestamp), (double)first);
+		FitAdd(&st->ticks, (double)(int64_t)(stmp - basetimestamp), in);
+		st->stmp_count++;
+	}
+
+	st->payload_count++;
+	st->samples = first + samples;
+	st->last_out = out;
+	st->last_timo = timo;
+}
+
+
+GPMF_ERR GetGPMFStreamClocks(mp4callbacks cb, uint32_t timeBaseFourCC, GPMF_stream_clock *clocks, uint32_t *clock_count)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	GPMF_directory *dir = NULL;
+	clock_stats *stats = NULL;
+	uint32_t stats_count = 0, stats_capacity = 0;
+	uint64_t basetimestamp = 0;
+	double tick = 0.0, pooled_sxx = 0.0, pooled_sxy = 0.0, editlist = 0.0;
+	size_t payloadres = 0;
+	uint32_t indexcount, index, i;
+	GPMF_ERR ret = GPMF_OK;
+
+	if (cb.mp4handle == 0 || clock_count == NULL || (clocks == NULL && *clock_count))
+		return GPMF_ERROR_MEMORY;
+
+	dir = (GPMF_directory *)malloc(sizeof(GPMF_directory));
+	if (dir == NULL)
+		return GPMF_ERROR_MEMORY;
+
+	indexcount = cb.cbGetNumberPayloads(cb.mp4handle);
+
+	memset(ms, 0, sizeof(GPMF_stream));
+
+	// Every stream adds one observation per payload to its accumulators.
+	for (index = 0; index < indexcount; index++)
+	{
+		GPMF_stream_entry *entry;
+		GPMF_stream walk;
+		uint32_t *payload;
+		uint32_t payloadsize, next = 0;
+		double in = 0.0, out = 0.0;
+
+		if (GPMF_OK != cb.cbGetPayloadTime(cb.mp4handle, index, &in, &out))
+			continue;
+
+		payload = ReadPayload(&cb, &payloadres, index, &payloadsize);
+		if (GPMF_OK != OpenPayload(ms, dir, payload, payloadsize))
+			continue;
+
+		if (basetimestamp == 0) // STMP zero is the time base stream's first, or the earliest, as GetGPMFSampleRate() uses
+		{
+			GPMF_stream find_stream;
+			GPMF_CopyState(ms, &find_stream);
+			if (GPMF_OK == GPMF_FindNext(&find_stream, GPMF_KEY_TIME_STAMP, GPMF_RECURSE_LEVELS | GPMF_TOLERANT))
+				basetimestamp = PayloadBaseTimestamp(payload, payloadsize, timeBaseFourCC, BYTESWAP64(*(uint64_t *)GPMF_RawData(&find_stream)));
+		}
+
+		while ((entry = NextStream(ms, dir, &next, &walk)))
+		{
+			clock_stats *st = FindClockStats(&stats, &stats_count, &stats_capacity, entry->fourcc);
+			if (st == NULL)
+			{
+				ret = GPMF_ERROR_MEMORY;
+				goto cleanup;
+			}
+
+			GatherClockStats(&walk, st, in, out, basetimestamp);
+		}
+	}
+
+	// The STMP units, shared by all streams. Each stream's sums are about its own means, so the different delays between 
+	// sampling and payload time drop out. Payload times are too coarse to measure the camera clock against the MP4 clock, 
+	// so the fitted tick is only used to pick the power of ten, normally microseconds.
+	for (i = 0; i < stats_count; i++)
+	{
+		pooled_sxx += FitSxx(&stats[i].ticks);
+		pooled_sxy += FitSxy(&stats[i].ticks);
+	}
+	if (pooled_sxx > 0.0 && pooled_sxy > 0.0)
+		tick = pow(10.0, floor(log10(pooled_sxy / pooled_sxx) + 0.5));
+
+	if (cb.cbGetEditListOffsetRationalTime) // clips with STMP have the Edit List already applied via GetPayloadTime()
+	{
+		int32_t num = 0;
+		uint32_t dem = 1;
+		if (GPMF_OK == cb.cbGetEditListOffsetRationalTime(cb.mp4handle, &num, &dem) && dem)
+			editlist = (double)num / (double)dem;
+	}
+
+	for (i = 0; i < stats_count && i < *clock_count; i++)
+	{
+		clock_stats *st = &stats[i];
+		GPMF_stream_clock *clock = &clocks[i];
+		double slope, intercept, rms;
+
+		memset(clock, 0, sizeof(GPMF_stream_clock));
+		clock->fourcc = st->fourcc;
+		clock->samples = st->samples;
+		clock->observations = st->payload_count;
+
+		if (tick > 0.0 && st->stmp_count == st->payload_count && FitSolve(&st->stamped, &slope, &intercept, &rms) && slope > 0.0)
+		{
+			// samples per tick, the first sample at tick -intercept / slope from the time base
+			clock->rate = slope / tick;
+			clock->offset = -intercept / slope * tick - st->last_timo + editlist;
+			clock->error = rms / clock->rate;
+			clock->used_timestamps = 1;
+		}
+		else if (FitSolve(&st->media, &slope, &intercept, &rms) && slope > 0.0)
+		{
+			clock->rate = slope;
+			clock->offset = -intercept / slope - st->last_timo;
+			clock->error = rms / slope;
+		}
+		else if (st->last_out > st->first_in) // a single payload, spread evenly over its time
+		{
+			clock->rate = (double)st->samples / (st->last_out - st->first_in);
+			clock->offset = st->first_in - st->last_timo;
+		}
+	}
+
+	if (stats_count > *clock_count)
+		ret = GPMF_ERROR_MEMORY;
+	*clock_count = stats_count;
+
+cleanup:
+	if (payloadres) cb.cbFreePayloadResource(cb.mp4handle, payloadres);
+	if (stats) free(stats);
+	free(dir);
+
+	return ret;
+}
+
+
+double GPMF_StreamClockTime(GPMF_stream_clock *clock, uint32_t sample)
+{
+	if (clock == NULL || clock->rate <= 0.0)
+		return 0.0;
+
+	return clock->offset + (double)sample / clock->rate;
+}
@@ -2,7 +2,7 @@
 *
 *  @brief Utilities GPMF and MP4 handling
 *
-*  @version 1.2.0
+*  @version 1.3.0
 *
 *  (C) Copyright 2020 GoPro Inc (http://gopro.com/).
 *
@@ -23,6 +23,10 @@
 #ifndef _GPMF_UTILS_H
 #define _GPMF_UTILS_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include "GPMF_common.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -43,8 +47,96 @@ typedef struct mp4callbacks
 		int32_t	 *offset_numerator, uint32_t* denominator);
 } mp4callbacks;
 
+#define MP4CALLBACKS_EX_VERSION		1
+
+// Optional hooks for the whole-file utilities, passed by pointer (NULL for none) so mp4callbacks keeps its layout.
+// Zero the struct and set version, members added by later versions are only read from a struct that has them.
+typedef struct mp4callbacks_ex
+{
+	uint32_t version;																	// MP4CALLBACKS_EX_VERSION
+	void *	 (*cbGetHandleCache)(size_t mp4handle);												// lets GetGPMFSampleRates() keep its results with the handle
+	void	 (*cbSetHandleCache)(size_t mp4handle, void *cache, void (*freecache)(void *cache));	// freecache is called when the handle closes or the cache is replaced
+	void	 (*cbLockHandleCache)(size_t mp4handle, uint32_t lock);								// the cache is only used with this too, so threads sharing the handle can't release a cache in use
+	uint32_t (*cbGetPayloadRange)(size_t mp4handle, size_t res, uint32_t first, uint32_t count, uint32_t **payloads); // several payloads with coalesced reads, NULL pointers for any not read
+	uint32_t threadsafe;																// non-zero when the payload callbacks may run concurrently with separate resources, as the mp4reader's can
+} mp4callbacks_ex;
+
 double GetGPMFSampleRate(mp4callbacks cbobject, uint32_t fourcc, uint32_t timeBaseFourCC, uint32_t flags, double* in, double* out);
 
+
+typedef struct GPMF_stream_rate
+{
+	uint32_t fourcc;				// the samples key of the stream, e.g. ACCL
+	double rate;					// as GetGPMFSampleRate() returns for the fourcc, 0.0 if it couldn't be computed
+	double first_time;				// first and last sample times in seconds, as its in and out
+	double last_time;
+} GPMF_stream_rate;
+
+GPMF_ERR GetGPMFSampleRates(mp4callbacks cbobject, mp4callbacks_ex *cbex, uint32_t timeBaseFourCC, uint32_t flags, GPMF_stream_rate *rates, uint32_t *rate_count); // every stream in one pass over the payloads, rate_count is the capacity in and the number of streams out
+
+
+typedef struct GPMF_stream_clock
+{
+	uint32_t fourcc;				// the samples key of the stream, e.g. ACCL
+	uint32_t samples;				// samples counted across all payloads
+	double rate;					// samples per second of MP4 time, 0.0 if it couldn't be fitted
+	double offset;					// time of the first sample in seconds, sample n is at offset + n / rate
+	double error;					// RMS distance in seconds of the observations from the fitted line
+	uint32_t observations;			// payloads the fit used
+	uint32_t used_timestamps;		// fitted to STMP, otherwise to the payload times
+} GPMF_stream_clock;
+
+GPMF_ERR GetGPMFStreamClocks(mp4callbacks cbobject, uint32_t timeBaseFourCC, GPMF_stream_clock *clocks, uint32_t *clock_count); // least squares fit of every stream's rate and offset in one pass, clock_count is the capacity in and the number of streams out
+double GPMF_StreamClockTime(GPMF_stream_clock *clock, uint32_t sample);	// time in seconds of a sample
+
+
+typedef struct GPMF_extracted_stream
+{
+	uint32_t fourcc;				// stream to extract, set by the caller
+	uint32_t device_id;				// device to extract from, set by the caller, 0 for any device
+	uint32_t elements;				// values per sample, e.g. 3 for ACCL
+	uint32_t samples;				// samples in data, across all payloads
+	double *data;					// samples * elements scaled values, in payload order
+	uint32_t *payload_samples;		// samples contributed by each payload, one entry per payload
+} GPMF_extracted_stream;
+
+GPMF_ERR GPMF_ExtractStreams(mp4callbacks cbobject, mp4callbacks_ex *cbex, GPMF_extracted_stream *streams, uint32_t stream_count, uint32_t threads); // decode whole streams on a pool of workers, threads 0 for one per CPU
+void GPMF_FreeExtractedStreams(GPMF_extracted_stream *streams, uint32_t stream_count);
+
+
+typedef struct GPMF_sample_block
+{
+	uint32_t payload_index;
+	double in, out;					// MP4 time of the payload
+	GPMF_ERR ret;					// as GPMF_NextBlock() returned it
+	uint32_t stream_count;
+	GPMF_extracted_stream *streams;	// as requested, the samples of this payload only, no payload_samples
+} GPMF_sample_block;
+
+GPMF_ERR GPMF_OpenPipeline(mp4callbacks cbobject, GPMF_extracted_stream *streams, uint32_t stream_count, uint32_t depth, size_t *pipeline); // reads up to depth payloads ahead and decodes on separate threads, the callbacks are only used by the reading thread until it closes
+GPMF_ERR GPMF_NextBlock(size_t pipeline, GPMF_sample_block **block);	// the next payload's samples in order, GPMF_ERROR_LAST after the last
+void GPMF_ReleaseBlock(size_t pipeline, GPMF_sample_block *block);		// returns the block's buffers for reuse
+void GPMF_ClosePipeline(size_t pipeline);
+
+
+typedef struct GPMF_sample_table
+{
+	uint32_t fourcc;				// stream to index, set by the caller
+	uint32_t device_id;				// device to index, set by the caller, 0 for any device
+	uint32_t elements;				// values per sample, from the first payload with samples
+	uint32_t payload_count;
+	uint32_t *first_sample;			// stream sample index at the start of each payload, payload_count + 1 entries, the last is the total
+	double *payload_in;				// MP4 (stts) time range of each payload, the samples within are spread evenly over it
+	double *payload_out;
+} GPMF_sample_table;
+
+GPMF_ERR GPMF_BuildSampleTable(mp4callbacks cbobject, GPMF_sample_table *table);	// one pass counting the stream's samples in each payload
+uint32_t GPMF_SampleAtTime(GPMF_sample_table *table, double time, uint32_t *payload_index);		// binary search for the last sample at or before a time, the inverse of GPMF_SampleTime(), optionally returning its payload
+GPMF_ERR GPMF_SampleRangeAtTime(GPMF_sample_table *table, double start, double end, uint32_t *first_sample, uint32_t *sample_count); // samples covering [start, end] seconds, GPMF_ERROR_FIND if that misses every sample
+double   GPMF_SampleTime(GPMF_sample_table *table, uint32_t sample);							// the time the table assigns to a sample
+GPMF_ERR GPMF_ReadSamples(mp4callbacks cbobject, GPMF_sample_table *table, uint32_t first_sample, uint32_t sample_count, double *buffer, uint32_t buffersize); // scaled doubles, loading only the payloads holding them
+void GPMF_FreeSampleTable(GPMF_sample_table *table);
+
 #ifdef __cplusplus
 }
 #endif
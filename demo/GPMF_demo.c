@@ -36,6 +36,7 @@
 #define	SHOW_SCALED_DATA			1
 #define	SHOW_THIS_FOUR_CC			STR2FOURCC("ACCL")
 #define SHOW_COMPUTED_SAMPLERATES	1
+#define USE_MEMORY_MAPPING			0
 
 
 
@@ -51,6 +52,7 @@ void printHelp(char* name)
 	printf("       -c - %s computed sample rates\n", SHOW_COMPUTED_SAMPLERATES ? "disable" : "show");
 	printf("       -v - %s video framerate\n", SHOW_VIDEO_FRAMERATE ? "disable" : "show");
 	printf("       -t - %s time of the payload\n", SHOW_PAYLOAD_TIME ? "disable" : "show");
+	printf("       -m - %s memory mapped file access\n", USE_MEMORY_MAPPING ? "disable" : "use");
 	printf("       -fWXYZ - show only this fourCC , e.g. -f%c%c%c%c (default) just -f for all\n", PRINTF_4CC(SHOW_THIS_FOUR_CC));
 	printf("       -FX - fuzz loop for X times (defaults to GPMF fuzzing only)\n");
 	printf("       -MX - fuzz the mp4 index with X random changes\n");
@@ -69,6 +71,7 @@ uint32_t show_computed_samplerates = SHOW_COMPUTED_SAMPLERATES;
 uint32_t show_video_framerate = SHOW_VIDEO_FRAMERATE;
 uint32_t show_payload_time = SHOW_PAYLOAD_TIME;
 uint32_t show_this_four_cc = 0;
+uint32_t use_memory_mapping = USE_MEMORY_MAPPING;
 
 int mp4fuzzchanges = 0;
 int gpmffuzzchanges = 4;
@@ -103,6 +106,7 @@ int main(int argc, char* argv[])
 			case 'c': show_computed_samplerates ^= 1;		break;
 			case 'v': show_video_framerate ^= 1;			break;
 			case 't': show_payload_time ^= 1;				break;
+			case 'm': use_memory_mapping ^= 1;				break;
 			case 'f': show_this_four_cc = STR2FOURCC((&(argv[i][2])));  break;
 			case 'h': printHelp(argv[0]);  break;
 
@@ -207,8 +211,11 @@ GPMF_ERR readMP4File(char* filename)
 	uint32_t* payload = NULL;
 	uint32_t payloadsize = 0;
 	size_t payloadres = 0;
+	double* scaledbuffer = NULL; // grown as needed and reused across streams and payloads
+	uint32_t scaledbuffersize = 0;
+	GPMF_directory directory; // index of the current payload's streams
 #if 1 // Search for GPMF Track
-	size_t mp4handle = OpenMP4Source(filename, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	size_t mp4handle = OpenMP4Source(filename, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, use_memory_mapping ? MP4_FLAG_MEMORY_MAPPED : 0);
 #else // look for a global GPMF payload in the moov header, within 'udta'
 	size_t mp4handle = OpenMP4SourceUDTA(argv[1], 0);  //Search for GPMF payload with MP4's udta
 #endif
@@ -224,7 +231,7 @@ GPMF_ERR readMP4File(char* filename)
 		CloseSource(mp4handle);
 		filename = CorruptTheMP4(filename);
 
-		mp4handle = OpenMP4Source(filename, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+		mp4handle = OpenMP4Source(filename, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, use_memory_mapping ? MP4_FLAG_MEMORY_MAPPED : 0);
 		if (mp4handle == 0)	return  GPMF_OK; // when fuzzing, errors reported are showing the system is working.
 	}
 
@@ -326,6 +333,8 @@ GPMF_ERR readMP4File(char* filename)
 				if (show_all_payloads || index == 0)
 				{
 					if (fuzzloopcount == 0) printf("PAYLOAD INDEX:\n");
+					if (GPMF_OK == GPMF_BuildDirectory(ms, &directory)) // optional, GPMF_PayloadSampleCount() then counts repeated KLVs like FACE without searching
+						GPMF_AttachDirectory(ms, &directory);
 					ret = GPMF_FindNext(ms, GPMF_KEY_STREAM, GPMF_RECURSE_LEVELS|GPMF_TOLERANT);
 					while (GPMF_OK == ret)
 					{
@@ -422,7 +431,7 @@ GPMF_ERR readMP4File(char* filename)
 						{
 							uint32_t buffersize = samples * elements * sizeof(double);
 							GPMF_stream find_stream;
-							double* ptr, * tmpbuffer = (double*)malloc(buffersize);
+							double* ptr, * tmpbuffer;
 
 							#define MAX_UNITS	64
 							#define MAX_UNITLEN	8
@@ -432,6 +441,14 @@ GPMF_ERR readMP4File(char* filename)
 							char complextype[MAX_UNITS] = { "" };
 							uint32_t type_samples = 1;
 
+							if (buffersize > scaledbuffersize)
+							{
+								if (scaledbuffer) free(scaledbuffer);
+								scaledbuffer = (double*)malloc(buffersize);
+								scaledbuffersize = scaledbuffer ? buffersize : 0;
+							}
+							tmpbuffer = scaledbuffer;
+
 							if (tmpbuffer)
 							{
 								uint32_t i, j;
@@ -508,7 +525,6 @@ GPMF_ERR readMP4File(char* filename)
 										if (fuzzloopcount == 0) printf("\n");
 									}
 								}
-								free(tmpbuffer);
 							}
 						}
 					}
@@ -521,6 +537,8 @@ GPMF_ERR readMP4File(char* filename)
 		if (show_computed_samplerates)
 		{
 			mp4callbacks cbobject;
+			mp4callbacks_ex cbex;
+			memset(&cbobject, 0, sizeof(cbobject));
 			cbobject.mp4handle = mp4handle;
 			cbobject.cbGetNumberPayloads = GetNumberPayloads;
 			cbobject.cbGetPayload = GetPayload;
@@ -530,16 +548,42 @@ GPMF_ERR readMP4File(char* filename)
 			cbobject.cbFreePayloadResource = FreePayloadResource;
 			cbobject.cbGetEditListOffsetRationalTime = GetEditListOffsetRationalTime;
 
+			memset(&cbex, 0, sizeof(cbex));
+			cbex.version = MP4CALLBACKS_EX_VERSION;
+			cbex.cbGetHandleCache = GetHandleCache;
+			cbex.cbSetHandleCache = SetHandleCache;
+			cbex.cbLockHandleCache = LockHandleCache;
+			cbex.cbGetPayloadRange = GetPayloadRange;
+			cbex.threadsafe = 1;
+
+			// The rates of every stream from one pass over the payloads
+			GPMF_stream_rate rates[GPMF_DIRECTORY_LIMIT];
+			uint32_t rate_count = GPMF_DIRECTORY_LIMIT;
+			GetGPMFSampleRates(cbobject, &cbex, STR2FOURCC("SHUT"), GPMF_SAMPLE_RATE_PRECISE, rates, &rate_count);// GPMF_SAMPLE_RATE_FAST);
+			if (rate_count > GPMF_DIRECTORY_LIMIT)
+				rate_count = GPMF_DIRECTORY_LIMIT;
+
 			if (fuzzloopcount == 0) printf("COMPUTED SAMPLERATES:\n");
 			// Find all the available Streams and compute they sample rates
 			while (GPMF_OK == GPMF_FindNext(ms, GPMF_KEY_STREAM, GPMF_RECURSE_LEVELS | GPMF_TOLERANT))
 			{
 				if (GPMF_OK == GPMF_SeekToSamples(ms)) //find the last FOURCC within the stream
 				{
-					double start, end;
+					double start, end, rate;
 					uint32_t fourcc = GPMF_Key(ms);
+					uint32_t i = 0;
 
-					double rate = GetGPMFSampleRate(cbobject, fourcc, STR2FOURCC("SHUT"), GPMF_SAMPLE_RATE_PRECISE, &start, &end);// GPMF_SAMPLE_RATE_FAST);
+					while (i < rate_count && rates[i].fourcc != fourcc)
+						i++;
+
+					if (i < rate_count)
+					{
+						rate = rates[i].rate;
+						start = rates[i].first_time;
+						end = rates[i].last_time;
+					}
+					else // not among the streams found, e.g. beyond the rates array
+						rate = GetGPMFSampleRate(cbobject, fourcc, STR2FOURCC("SHUT"), GPMF_SAMPLE_RATE_PRECISE, &start, &end);
 					if (fuzzloopcount == 0) printf("  %c%c%c%c sampling rate = %fHz (time %f to %f)\",\n", PRINTF_4CC(fourcc), rate, start, end);
 				}
 			}
@@ -547,6 +591,7 @@ GPMF_ERR readMP4File(char* filename)
 
 	cleanup:
 		if (payloadres) FreePayloadResource(mp4handle, payloadres);
+		if (scaledbuffer) free(scaledbuffer);
 		if (ms) GPMF_Free(ms);
 		CloseSource(mp4handle);
 	}
@@ -27,8 +27,25 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef _WINDOWS
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define QUEUE_IO_URING
+#endif
+#endif
 
 #include "GPMF_mp4reader.h"
+#include "../GPMF_threads.h"
 
 #define PRINT_MP4_STRUCTURE		0
 
@@ -38,6 +55,18 @@
 #define LONGTELL	ftell
 #endif
 
+#define RANGE_MERGE_GAP		65536	// payloads closer than this are read together, the bytes between them discarded
+#define RANGE_MAX_EXTENTS	256		// payloads and gaps per read, well under any IOV_MAX
+#define QUEUE_MAX_THREADS	32		// readers for a payload queue without io_uring
+
+#ifdef _WINDOWS
+struct iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+#endif
+
 
 uint32_t GetNumberPayloads(size_t mp4handle)
 {
@@ -52,8 +81,30 @@ uint32_t GetNumberPayloads(size_t mp4handle)
 }
 
 
+// Grows the resource's buffer to hold size bytes, keeping any buffer it had when that fails. Returns 0 on failure.
+static uint32_t AllocPayloadBuffer(resObject *res, uint64_t size)
+{
+	uint64_t myBufferSize = size + 256; // Add a little more to limit reallocations
+	uint32_t *buffer;
+
+	if (myBufferSize > 0xffffffff)
+		return 0;
+	if (res->buffer && size <= res->bufferSize)
+		return 1;
+
+	buffer = (uint32_t *)realloc(res->buffer, (size_t)myBufferSize);
+	if (buffer == NULL)
+		return 0;
+
+	res->buffer = buffer;
+	res->bufferSize = (uint32_t)myBufferSize;
+	return 1;
+}
+
+
 size_t GetPayloadResource(size_t mp4handle, size_t resHandle, uint32_t payloadsize)
 {
+	mp4object *mp4 = (mp4object *)mp4handle;
 	resObject* res = (resObject*)resHandle;
 
 	if (res == NULL)
@@ -68,30 +119,15 @@ size_t GetPayloadResource(size_t mp4handle, size_t resHandle, uint32_t payloadsi
 
 	if(res)
 	{
-		uint32_t myBufferSize = payloadsize + 256;
-
-		if (res->buffer == NULL)
+		if (mp4 && mp4->mediamap)
 		{
-			res->buffer = malloc(myBufferSize);
-			if (res->buffer)
-			{
-				res->bufferSize = myBufferSize;
-			}
-			else
-			{
-				free(res);
-				resHandle = 0;
-			}
+			// payloads are used in place from the mapped file, no buffer needed
 		}
-		else if (payloadsize > res->bufferSize)
+		else if (!AllocPayloadBuffer(res, payloadsize))
 		{
-			res->buffer = realloc(res->buffer, myBufferSize);
-			res->bufferSize = myBufferSize;
-			if (res->buffer == NULL)
-			{
-				free(res);
-				resHandle = 0;
-			}
+			if (res->buffer) free(res->buffer);
+			free(res);
+			resHandle = 0;
 		}
 	}
 
@@ -112,15 +148,248 @@ void FreePayloadResource(size_t mp4handle, size_t resHandle)
 }
 
 
+// Reads at an absolute position without using or moving the FILE's position, so payloads can be read from several 
+// threads through one handle.
+static size_t ReadFileAt(FILE *fp, void *data, size_t bytes, uint64_t offset)
+{
+	size_t total = 0;
+
+#ifdef _WINDOWS
+	HANDLE file = (HANDLE)_get_osfhandle(_fileno(fp));
+
+	while (total < bytes)
+	{
+		OVERLAPPED ov;
+		DWORD got = 0;
+
+		memset(&ov, 0, sizeof(ov));
+		ov.Offset = (DWORD)(offset + total);
+		ov.OffsetHigh = (DWORD)((offset + total) >> 32);
+		if (!ReadFile(file, (uint8_t *)data + total, (DWORD)(bytes - total), &got, &ov) || got == 0)
+			break;
+		total += got;
+	}
+#else
+	int fd = fileno(fp);
+
+	while (total < bytes)
+	{
+		ssize_t got = pread(fd, (uint8_t *)data + total, bytes - total, (off_t)(offset + total));
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		total += (size_t)got;
+	}
+#endif
+
+	return total;
+}
+
+
+static size_t ReadAt(mp4object *mp4, void *data, size_t bytes, uint64_t offset)
+{
+	if (mp4->io.cbReadAt)
+		return mp4->io.cbReadAt(mp4->io.context, data, bytes, offset);
+
+	return ReadFileAt(mp4->mediafp, data, bytes, offset);
+}
+
+
+// Scatters one contiguous extent of the file across several buffers.
+static size_t ReadVAt(mp4object *mp4, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+	size_t total = 0;
+	int i;
+
+#ifndef _WINDOWS
+	if (mp4->io.cbReadAt == NULL)
+	{
+		int fd = fileno(mp4->mediafp);
+
+		while (iovcnt > 0)
+		{
+			ssize_t got = preadv(fd, iov, iovcnt, (off_t)(offset + total));
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				break;
+			total += (size_t)got;
+
+			// step over what was read, for a short read
+			while (iovcnt > 0 && (size_t)got >= iov->iov_len)
+			{
+				got -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			}
+			if (iovcnt > 0)
+			{
+				iov->iov_base = (uint8_t *)iov->iov_base + got;
+				iov->iov_len -= got;
+			}
+		}
+		return total;
+	}
+#endif
+
+	for (i = 0; i < iovcnt; i++)
+	{
+		size_t got = ReadAt(mp4, iov[i].iov_base, iov[i].iov_len, offset + total);
+		total += got;
+		if (got < iov[i].iov_len)
+			break;
+	}
+
+	return total;
+}
+
+
+// Issues one merged read, returning the payloads it completed. Payloads of a short read are withdrawn rather than
+// handed out partly filled.
+static uint32_t ReadGroup(mp4object *mp4, struct iovec *iov, int iovcnt, uint64_t start, uint64_t end, uint32_t **payloads, uint32_t count)
+{
+	uint32_t i, read = 0;
+
+	if (ReadVAt(mp4, iov, iovcnt, start) == end - start)
+	{
+		for (i = 0; i < count; i++)
+			if (payloads[i]) read++;
+	}
+	else
+	{
+		for (i = 0; i < count; i++)
+			payloads[i] = NULL;
+	}
+
+	return read;
+}
+
+
+uint32_t GetPayloadRange(size_t mp4handle, size_t resHandle, uint32_t first, uint32_t count, uint32_t **payloads)
+{
+	mp4object *mp4 = (mp4object *)mp4handle;
+	resObject *res = (resObject *)resHandle;
+	struct iovec iov[RANGE_MAX_EXTENTS];
+	uint8_t *gap = NULL;
+	uint64_t total = 0, start = 0, end = 0;
+	uint32_t i, used = 0, group = 0, read = 0;
+	int iovcnt = 0, merge;
+
+	if (mp4 == NULL || res == NULL || payloads == NULL || first >= mp4->indexcount) return 0;
+
+	if (count > mp4->indexcount - first)
+		count = mp4->indexcount - first;
+
+	// every payload gets a 32-bit aligned slot in the resource, except those used in place from a mapping
+	for (i = first; i < first + count; i++)
+	{
+		if (mp4->metasizes[i] == 0 || mp4->filesize < mp4->metaoffsets[i] + mp4->metasizes[i])
+			continue;
+		if (mp4->mediamap && (mp4->metaoffsets[i] & 3) == 0)
+			continue;
+		total += (mp4->metasizes[i] + 3) & ~3;
+	}
+	if (total && !AllocPayloadBuffer(res, total))
+		return 0;
+
+	for (i = 0; i < count; i++)
+	{
+		uint32_t index = first + i;
+		uint64_t offset = mp4->metaoffsets[index];
+		uint32_t size = mp4->metasizes[index];
+		uint8_t *slot = (uint8_t *)res->buffer + used;
+
+		payloads[i] = NULL;
+		if (size == 0 || mp4->filesize < offset + size)
+			continue;
+
+		if (mp4->mediamap)
+		{
+			if ((offset & 3) == 0)
+			{
+				payloads[i] = (uint32_t *)(mp4->mediamap + offset);
+			}
+			else
+			{
+				memcpy(slot, mp4->mediamap + offset, size);
+				payloads[i] = (uint32_t *)slot;
+				used += (size + 3) & ~3;
+			}
+			read++;
+			continue;
+		}
+
+		// extend the current read if this payload follows closely, otherwise issue it and start another
+		merge = iovcnt && offset >= end && offset - end <= RANGE_MERGE_GAP && iovcnt + 2 <= RANGE_MAX_EXTENTS;
+		if (merge && offset > end && gap == NULL)
+		{
+			gap = (uint8_t *)malloc(RANGE_MERGE_GAP);
+			merge = (gap != NULL);
+		}
+
+		if (iovcnt && !merge)
+		{
+			read += ReadGroup(mp4, iov, iovcnt, start, end, &payloads[group], i - group);
+			iovcnt = 0;
+		}
+
+		if (iovcnt == 0)
+		{
+			start = end = offset;
+			group = i;
+		}
+		else if (offset > end)
+		{
+			iov[iovcnt].iov_base = gap; // every gap is read into the same scratch buffer
+			iov[iovcnt].iov_len = (size_t)(offset - end);
+			iovcnt++;
+		}
+
+		iov[iovcnt].iov_base = slot;
+		iov[iovcnt].iov_len = size;
+		iovcnt++;
+		end = offset + size;
+		payloads[i] = (uint32_t *)slot;
+		used += (size + 3) & ~3;
+	}
+
+	if (iovcnt)
+		read += ReadGroup(mp4, iov, iovcnt, start, end, &payloads[group], count - group);
+
+	if (gap) free(gap);
+
+	return read;
+}
+
+
 uint32_t *GetPayload(size_t mp4handle, size_t resHandle, uint32_t index)
 {
 	mp4object *mp4 = (mp4object *)mp4handle;
 	resObject *res = (resObject *)resHandle;
 
 	if (mp4 == NULL) return NULL;
+
+	if (index < mp4->indexcount && mp4->mediamap)
+	{
+		if ((mp4->filesize >= mp4->metaoffsets[index] + mp4->metasizes[index]) && (mp4->metasizes[index] > 0))
+		{
+			if ((mp4->metaoffsets[index] & 3) == 0)
+				return (uint32_t *)(mp4->mediamap + mp4->metaoffsets[index]);
+
+			// rare unaligned payload, copy it out of the mapping
+			if (res && AllocPayloadBuffer(res, mp4->metasizes[index]))
+			{
+				memcpy(res->buffer, mp4->mediamap + mp4->metaoffsets[index], mp4->metasizes[index]);
+				return res->buffer;
+			}
+		}
+		return NULL;
+	}
+
 	if (res == NULL) return NULL;
 
-	if (index < mp4->indexcount && mp4->mediafp)
+	if (index < mp4->indexcount && (mp4->mediafp || mp4->io.cbReadAt))
 	{
 		if ((mp4->filesize >= mp4->metaoffsets[index]+mp4->metasizes[index]) && (mp4->metasizes[index] > 0))
 		{
@@ -129,13 +398,8 @@ uint32_t *GetPayload(size_t mp4handle, size_t resHandle, uint32_t index)
 			resHandle = GetPayloadResource(mp4handle, resHandle, buffsizeneeded);
 			if(resHandle)
 			{
-#ifdef _WINDOWS
-				_fseeki64(mp4->mediafp, (__int64) mp4->metaoffsets[index], SEEK_SET);
-#else
-				fseeko(mp4->mediafp, (off_t) mp4->metaoffsets[index], SEEK_SET);
-#endif
-				fread(res->buffer, 1, mp4->metasizes[index], mp4->mediafp);
-				mp4->filepos = mp4->metaoffsets[index] + mp4->metasizes[index];
+				// the handle is left unchanged, only the resource is written
+				ReadAt(mp4, res->buffer, mp4->metasizes[index], mp4->metaoffsets[index]);
 				return res->buffer;
 			}
 		}
@@ -145,6 +409,462 @@ uint32_t *GetPayload(size_t mp4handle, size_t resHandle, uint32_t index)
 }
 
 
+// Asynchronous payload reads. Each queue has a fixed number of slots, each holding one read from submission until the
+// caller reaps it. Linux reads through an io_uring, other systems (or kernels refusing io_uring) through a pool of
+// threads calling ReadAt(). A queue is driven from one thread, the handle may be shared with other queues and readers.
+
+typedef struct payloadSlot
+{
+	uint32_t index;
+	size_t resHandle;
+	void *user;
+	uint32_t *payload;
+	uint32_t payloadsize;
+} payloadSlot;
+
+typedef struct payloadQueue
+{
+	mp4object *mp4;
+	uint32_t depth;
+	uint32_t inflight;			// submitted and not yet reaped
+	payloadSlot *slots;
+	uint32_t *freeslots, freecount;
+	uint32_t *finished, finhead, fincount;	// slots read, waiting to be reaped
+	uint32_t *pending, pendhead, pendcount;	// slots waiting for a pool thread
+
+	GPMF_mutex lock;
+	GPMF_cond work, done;
+	GPMF_thread *threads;
+	uint32_t threadcount;
+	uint32_t quit;
+
+#ifdef QUEUE_IO_URING
+	int ringfd;					// -1 when reading with the thread pool
+	uint32_t unsubmitted;		// entries written past the tail the kernel has seen
+	uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+#endif
+} payloadQueue;
+
+
+// completes a read that stopped short, or that wasn't started, with blocking reads
+static void FinishSlotRead(payloadQueue *q, payloadSlot *s, size_t got)
+{
+	mp4object *mp4 = q->mp4;
+	resObject *res = (resObject *)s->resHandle;
+
+	if (got < s->payloadsize)
+		got += ReadAt(mp4, (uint8_t *)res->buffer + got, s->payloadsize - got, mp4->metaoffsets[s->index] + got);
+
+	s->payload = (got == s->payloadsize) ? res->buffer : NULL;
+}
+
+
+static void PushFinished(payloadQueue *q, uint32_t slot)
+{
+	q->finished[(q->finhead + q->fincount) % q->depth] = slot;
+	q->fincount++;
+}
+
+
+GPMF_THREAD_FUNC(PayloadQueueThread, arg)
+{
+	payloadQueue *q = (payloadQueue *)arg;
+
+	GPMF_MutexLock(&q->lock);
+	for (;;)
+	{
+		uint32_t slot;
+
+		while (q->pendcount == 0 && !q->quit)
+			GPMF_CondWait(&q->work, &q->lock);
+		if (q->pendcount == 0)
+			break; // quitting, and nothing left to read
+
+		slot = q->pending[q->pendhead];
+		q->pendhead = (q->pendhead + 1) % q->depth;
+		q->pendcount--;
+
+		GPMF_MutexUnlock(&q->lock);
+		FinishSlotRead(q, &q->slots[slot], 0);
+		GPMF_MutexLock(&q->lock);
+
+		PushFinished(q, slot);
+		GPMF_CondSignal(&q->done);
+	}
+	GPMF_MutexUnlock(&q->lock);
+
+	GPMF_THREAD_RETURN;
+}
+
+
+#ifdef QUEUE_IO_URING
+
+static int OpenRing(payloadQueue *q)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = (int)syscall(__NR_io_uring_setup, q->depth, &p);
+	if (fd < 0)
+		return 0; // not built into the kernel, or blocked by a sandbox
+
+	q->ringfd = fd;
+	q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	q->sqes = (struct io_uring_sqe *)mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED || (void *)q->sqes == MAP_FAILED)
+		return 0;
+
+	q->sq_head = (uint32_t *)((uint8_t *)q->sq_ring + p.sq_off.head);
+	q->sq_tail = (uint32_t *)((uint8_t *)q->sq_ring + p.sq_off.tail);
+	q->sq_mask = (uint32_t *)((uint8_t *)q->sq_ring + p.sq_off.ring_mask);
+	q->sq_array = (uint32_t *)((uint8_t *)q->sq_ring + p.sq_off.array);
+	q->cq_head = (uint32_t *)((uint8_t *)q->cq_ring + p.cq_off.head);
+	q->cq_tail = (uint32_t *)((uint8_t *)q->cq_ring + p.cq_off.tail);
+	q->cq_mask = (uint32_t *)((uint8_t *)q->cq_ring + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)((uint8_t *)q->cq_ring + p.cq_off.cqes);
+
+	return 1;
+}
+
+
+static void CloseRing(payloadQueue *q)
+{
+	if (q->sq_ring && q->sq_ring != MAP_FAILED) munmap(q->sq_ring, q->sq_ring_size);
+	if (q->cq_ring && q->cq_ring != MAP_FAILED) munmap(q->cq_ring, q->cq_ring_size);
+	if (q->sqes && (void *)q->sqes != MAP_FAILED) munmap(q->sqes, q->sqes_size);
+	close(q->ringfd);
+	q->ringfd = -1;
+}
+
+
+// writes a read into the next entry, the kernel only sees it once SubmitRingReads() moves the tail past it
+static void QueueRingRead(payloadQueue *q, uint32_t slot)
+{
+	payloadSlot *s = &q->slots[slot];
+	uint32_t entry = (*q->sq_tail + q->unsubmitted) & *q->sq_mask; // only this thread moves the tail
+	struct io_uring_sqe *sqe = &q->sqes[entry];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fileno(q->mp4->mediafp);
+	sqe->addr = (uint64_t)(uintptr_t)((resObject *)s->resHandle)->buffer;
+	sqe->len = s->payloadsize;
+	sqe->off = q->mp4->metaoffsets[s->index];
+	sqe->user_data = slot;
+	q->sq_array[entry] = entry;
+	q->unsubmitted++;
+}
+
+
+// submits every queued read with one io_uring_enter(), any the kernel doesn't take are read with ReadAt() instead
+static void SubmitRingReads(payloadQueue *q)
+{
+	uint32_t count = q->unsubmitted;
+	uint32_t tail = *q->sq_tail + count;
+	uint32_t head;
+	long ret;
+
+	if (count == 0)
+		return;
+
+	q->unsubmitted = 0;
+	__atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+
+	do
+	{
+		ret = syscall(__NR_io_uring_enter, q->ringfd, count, 0, 0, NULL, 0);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	// withdraw the entries the kernel never took, so the next submission doesn't carry them along
+	head = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return;
+
+	__atomic_store_n(q->sq_tail, head, __ATOMIC_RELEASE);
+	for (; head != tail; head++)
+	{
+		uint32_t slot = (uint32_t)q->sqes[head & *q->sq_mask].user_data;
+
+		FinishSlotRead(q, &q->slots[slot], 0);
+		GPMF_MutexLock(&q->lock);
+		PushFinished(q, slot);
+		GPMF_MutexUnlock(&q->lock);
+	}
+}
+
+
+// moves completed ring reads to the finished list, waiting for one if asked
+static void CollectRingReads(payloadQueue *q, uint32_t wait)
+{
+	for (;;)
+	{
+		uint32_t head = *q->cq_head;
+		uint32_t tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			if (!wait || q->fincount)
+				return;
+			if (syscall(__NR_io_uring_enter, q->ringfd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+				return;
+			continue;
+		}
+
+		while (head != tail)
+		{
+			struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+			uint32_t slot = (uint32_t)cqe->user_data;
+
+			// short reads and kernels without IORING_OP_READ finish with ReadAt()
+			FinishSlotRead(q, &q->slots[slot], cqe->res > 0 ? (size_t)cqe->res : 0);
+			PushFinished(q, slot);
+			head++;
+		}
+		__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+#endif
+
+
+size_t OpenPayloadQueue(size_t mp4handle, uint32_t depth)
+{
+	mp4object *mp4 = (mp4object *)mp4handle;
+	payloadQueue *q;
+	uint32_t i;
+
+	if (mp4 == NULL || depth == 0 || (mp4->mediafp == NULL && mp4->mediamap == NULL && mp4->io.cbReadAt == NULL)) return 0;
+
+	q = (payloadQueue *)malloc(sizeof(payloadQueue));
+	if (q == NULL) return 0;
+
+	memset(q, 0, sizeof(payloadQueue));
+	q->mp4 = mp4;
+	q->depth = depth;
+	q->slots = (payloadSlot *)calloc(depth, sizeof(payloadSlot));
+	q->freeslots = (uint32_t *)malloc(depth * sizeof(uint32_t));
+	q->finished = (uint32_t *)malloc(depth * sizeof(uint32_t));
+	q->pending = (uint32_t *)malloc(depth * sizeof(uint32_t));
+	if (q->slots == NULL || q->freeslots == NULL || q->finished == NULL || q->pending == NULL)
+	{
+		if (q->slots) free(q->slots);
+		if (q->freeslots) free(q->freeslots);
+		if (q->finished) free(q->finished);
+		if (q->pending) free(q->pending);
+		free(q);
+		return 0;
+	}
+
+	for (i = 0; i < depth; i++)
+		q->freeslots[i] = depth - 1 - i;
+	q->freecount = depth;
+#ifdef QUEUE_IO_URING
+	q->ringfd = -1;
+#endif
+
+	GPMF_MutexInit(&q->lock);
+	GPMF_CondInit(&q->work);
+	GPMF_CondInit(&q->done);
+
+	if (mp4->mediamap)
+		return (size_t)q; // mapped payloads need no reading, they complete as they are submitted
+
+#ifdef QUEUE_IO_URING
+	if (mp4->mediafp && OpenRing(q)) // sources read through callbacks have no descriptor for the ring
+		return (size_t)q;
+	if (q->ringfd >= 0)
+		CloseRing(q);
+#endif
+
+	q->threadcount = depth < QUEUE_MAX_THREADS ? depth : QUEUE_MAX_THREADS;
+	q->threads = (GPMF_thread *)malloc(q->threadcount * sizeof(GPMF_thread));
+	if (q->threads == NULL)
+		q->threadcount = 0;
+
+	for (i = 0; i < q->threadcount; i++)
+	{
+		if (0 != GPMF_ThreadCreate(&q->threads[i], PayloadQueueThread, q))
+		{
+			q->threadcount = i; // any threads at all will do, none and reads are made as they are submitted
+			break;
+		}
+	}
+
+	return (size_t)q;
+}
+
+
+uint32_t SubmitPayload(size_t queueHandle, size_t resHandle, uint32_t index, void *user)
+{
+	payloadQueue *q = (payloadQueue *)queueHandle;
+	mp4object *mp4;
+	payloadSlot *s;
+	uint32_t slot;
+
+	if (q == NULL || resHandle == 0) return 0;
+	mp4 = q->mp4;
+
+	if (index >= mp4->indexcount || mp4->metasizes[index] == 0 || mp4->filesize < mp4->metaoffsets[index] + mp4->metasizes[index])
+		return 0;
+
+	GPMF_MutexLock(&q->lock);
+	if (q->freecount == 0)
+	{
+		GPMF_MutexUnlock(&q->lock);
+		return 0; // reap some first
+	}
+	slot = q->freeslots[--q->freecount];
+	q->inflight++;
+	GPMF_MutexUnlock(&q->lock);
+
+	s = &q->slots[slot];
+	s->index = index;
+	s->resHandle = resHandle;
+	s->user = user;
+	s->payload = NULL;
+	s->payloadsize = mp4->metasizes[index];
+
+	if (mp4->mediamap)
+	{
+		s->payload = GetPayload((size_t)mp4, resHandle, index);
+	}
+	else if (AllocPayloadBuffer((resObject *)resHandle, s->payloadsize))
+	{
+#ifdef QUEUE_IO_URING
+		if (q->ringfd >= 0)
+		{
+			QueueRingRead(q, slot); // submitted with any others by the next ReapPayload()
+			return 1;
+		}
+#endif
+		if (q->threadcount)
+		{
+			GPMF_MutexLock(&q->lock);
+			q->pending[(q->pendhead + q->pendcount) % q->depth] = slot;
+			q->pendcount++;
+			GPMF_CondSignal(&q->work);
+			GPMF_MutexUnlock(&q->lock);
+			return 1;
+		}
+
+		FinishSlotRead(q, s, 0);
+	}
+
+	GPMF_MutexLock(&q->lock);
+	PushFinished(q, slot);
+	GPMF_MutexUnlock(&q->lock);
+
+	return 1;
+}
+
+
+uint32_t ReapPayload(size_t queueHandle, uint32_t wait, payloadCompletion *done)
+{
+	payloadQueue *q = (payloadQueue *)queueHandle;
+	payloadSlot *s;
+	uint32_t slot;
+
+	if (q == NULL || done == NULL) return 0;
+
+#ifdef QUEUE_IO_URING
+	if (q->ringfd >= 0)
+	{
+		SubmitRingReads(q);
+		CollectRingReads(q, wait && PayloadsInFlight(queueHandle) > 0);
+	}
+#endif
+
+	GPMF_MutexLock(&q->lock);
+	while (q->fincount == 0 && wait && q->inflight > 0 && q->threadcount)
+		GPMF_CondWait(&q->done, &q->lock);
+
+	if (q->fincount == 0)
+	{
+		GPMF_MutexUnlock(&q->lock);
+		return 0;
+	}
+
+	slot = q->finished[q->finhead];
+	q->finhead = (q->finhead + 1) % q->depth;
+	q->fincount--;
+	q->freeslots[q->freecount++] = slot;
+	q->inflight--;
+	GPMF_MutexUnlock(&q->lock);
+
+	s = &q->slots[slot];
+	done->index = s->index;
+	done->payload = s->payload;
+	done->payloadsize = s->payload ? s->payloadsize : 0;
+	done->resHandle = s->resHandle;
+	done->user = s->user;
+
+	return 1;
+}
+
+
+uint32_t PayloadsInFlight(size_t queueHandle)
+{
+	payloadQueue *q = (payloadQueue *)queueHandle;
+	uint32_t inflight;
+
+	if (q == NULL) return 0;
+
+	GPMF_MutexLock(&q->lock);
+	inflight = q->inflight;
+	GPMF_MutexUnlock(&q->lock);
+
+	return inflight;
+}
+
+
+void ClosePayloadQueue(size_t queueHandle)
+{
+	payloadQueue *q = (payloadQueue *)queueHandle;
+	payloadCompletion done;
+	uint32_t i;
+
+	if (q == NULL) return;
+
+	// outstanding reads still write into their resources, let them land
+	while (PayloadsInFlight(queueHandle) && ReapPayload(queueHandle, 1, &done))
+		;
+
+	GPMF_MutexLock(&q->lock);
+	q->quit = 1;
+	GPMF_CondBroadcast(&q->work);
+	GPMF_MutexUnlock(&q->lock);
+
+	for (i = 0; i < q->threadcount; i++)
+		GPMF_ThreadJoin(q->threads[i]);
+
+#ifdef QUEUE_IO_URING
+	if (q->ringfd >= 0)
+		CloseRing(q);
+#endif
+
+	GPMF_CondFree(&q->work);
+	GPMF_CondFree(&q->done);
+	GPMF_MutexFree(&q->lock);
+	if (q->threads) free(q->threads);
+	free(q->slots);
+	free(q->freeslots);
+	free(q->finished);
+	free(q->pending);
+	free(q);
+}
+
+
 uint32_t WritePayload(size_t handle, uint32_t *payload, uint32_t payloadsize, uint32_t index)
 {
 	mp4object* mp4 = (mp4object*)handle;
@@ -160,6 +880,7 @@ uint32_t WritePayload(size_t handle, uint32_t *payload, uint32_t payloadsize, ui
 			fseeko(mp4->mediafp, (off_t)mp4->metaoffsets[index], SEEK_SET);
 #endif
 			fwrite(payload, 1, payloadsize, mp4->mediafp);
+			fflush(mp4->mediafp); // GetPayload() reads beneath the FILE buffering
 			mp4->filepos = mp4->metaoffsets[index] + payloadsize;
 			return payloadsize;
 		}
@@ -170,16 +891,98 @@ uint32_t WritePayload(size_t handle, uint32_t *payload, uint32_t payloadsize, ui
 
 
 
+static void MapMediaFile(mp4object *mp4, int32_t flags)
+{
+	if (mp4 == NULL || mp4->mediafp == NULL) return;
+	if (!(flags & MP4_FLAG_MEMORY_MAPPED) || (flags & MP4_FLAG_READ_WRITE_MODE)) return;
+	if (mp4->filesize == 0 || mp4->filesize > (uint64_t)SIZE_MAX) return;
+
+#ifdef _WINDOWS
+	HANDLE mapping = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(mp4->mediafp)), NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if (mapping)
+	{
+		mp4->mediamap = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+		if (mp4->mediamap)
+			mp4->mediamaphandle = (size_t)mapping;
+		else
+			CloseHandle(mapping);
+	}
+#else
+	// private and writable, so callers may still modify payloads in place (e.g. fuzzing) without touching the file
+	void *map = mmap(NULL, (size_t)mp4->filesize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(mp4->mediafp), 0);
+	if (map != MAP_FAILED)
+		mp4->mediamap = (uint8_t *)map;
+#endif
+}
+
+
+static void UnmapMediaFile(mp4object *mp4)
+{
+	if (mp4->mediamap)
+	{
+#ifdef _WINDOWS
+		UnmapViewOfFile(mp4->mediamap);
+		CloseHandle((HANDLE)mp4->mediamaphandle);
+		mp4->mediamaphandle = 0;
+#else
+		munmap(mp4->mediamap, (size_t)mp4->filesize);
+#endif
+		mp4->mediamap = NULL;
+	}
+}
+
+
+// Sequential reading while parsing, from the FILE or from the read position kept for an mp4io source.
+static size_t ReadSource(mp4object *mp4, void *data, size_t bytes)
+{
+	size_t got;
+
+	if (mp4->io.cbReadAt == NULL)
+		return fread(data, 1, bytes, mp4->mediafp);
+
+	got = ReadAt(mp4, data, bytes, mp4->iopos);
+	mp4->iopos += got;
+	return got;
+}
+
+
+static void SeekSource(mp4object *mp4, uint64_t pos)
+{
+	if (mp4->io.cbReadAt)
+		mp4->iopos = pos;
+	else
+#ifdef _WINDOWS
+		_fseeki64(mp4->mediafp, (__int64)pos, SEEK_SET);
+#else
+		fseeko(mp4->mediafp, (off_t)pos, SEEK_SET);
+#endif
+}
+
+
+static uint64_t TellSource(mp4object *mp4)
+{
+	if (mp4->io.cbReadAt)
+		return mp4->iopos;
+
+	return (uint64_t)LONGTELL(mp4->mediafp);
+}
+
+
 void LongSeek(mp4object *mp4, int64_t offset)
 {
 	if (mp4 && offset)
 	{
 		if (mp4->filepos + offset < mp4->filesize)
 		{
+			if (mp4->moovbuffer)
+				mp4->moovpos += offset;
+			else if (mp4->io.cbReadAt)
+				mp4->iopos += offset;
+			else
 #ifdef _WINDOWS
-			_fseeki64(mp4->mediafp, (__int64)offset, SEEK_CUR);
+				_fseeki64(mp4->mediafp, (__int64)offset, SEEK_CUR);
 #else
-			fseeko(mp4->mediafp, (off_t)offset, SEEK_CUR);
+				fseeko(mp4->mediafp, (off_t)offset, SEEK_CUR);
 #endif
 			mp4->filepos += offset;
 		}
@@ -191,6 +994,102 @@ void LongSeek(mp4object *mp4, int64_t offset)
 }
 
 
+static size_t ReadAtomData(mp4object *mp4, void *data, size_t bytes)
+{
+	if (mp4->moovbuffer)
+	{
+		if (mp4->moovpos >= mp4->moovsize)
+			return 0;
+		if (bytes > mp4->moovsize - mp4->moovpos)
+			bytes = (size_t)(mp4->moovsize - mp4->moovpos);
+
+		memcpy(data, mp4->moovbuffer + mp4->moovpos, bytes);
+		mp4->moovpos += bytes;
+		return bytes;
+	}
+
+	return ReadSource(mp4, data, bytes);
+}
+
+
+// Find the top level moov atom by hopping over the atom headers and read it in one go, so 
+// the sample tables can be parsed from memory rather than with many small stdio reads.
+static uint64_t LoadMoovAtom(mp4object *mp4)
+{
+	uint64_t pos = 0;
+	uint32_t atoms = 0;
+
+	while (pos + 8 <= mp4->filesize && atoms++ < 256)
+	{
+		uint32_t header[4], qttag, qtsize32;
+		uint64_t qtsize, headersize = 8;
+		size_t len;
+
+		SeekSource(mp4, pos);
+		len = ReadSource(mp4, header, sizeof(header));
+		if (len < 8) break;
+
+		qtsize32 = BYTESWAP32(header[0]);
+		qttag = header[1];
+
+		if (pos == 0 && qttag != MAKEID('f', 't', 'y', 'p')) break;
+		if (!VALID_FOURCC(qttag)) break;
+
+		if (qtsize32 == 1) // 64-bit Atom
+		{
+			uint64_t qtsize64;
+			if (len < 16) break;
+			memcpy(&qtsize64, &header[2], 8);
+			qtsize = BYTESWAP64(qtsize64);
+			headersize = 16;
+		}
+		else if (qtsize32 == 0) // extends to the end of the file
+			qtsize = mp4->filesize - pos;
+		else
+			qtsize = qtsize32;
+
+		if (qtsize < headersize || qtsize > mp4->filesize - pos) break;
+
+		if (qttag == MAKEID('m', 'o', 'o', 'v'))
+		{
+			if ((uint64_t)(size_t)qtsize != qtsize) break;
+
+			mp4->moovbuffer = (uint8_t *)malloc((size_t)qtsize);
+			if (mp4->moovbuffer == NULL) break;
+
+			SeekSource(mp4, pos);
+			if (ReadSource(mp4, mp4->moovbuffer, (size_t)qtsize) != qtsize)
+			{
+				free(mp4->moovbuffer);
+				mp4->moovbuffer = NULL;
+				break;
+			}
+
+			mp4->moovsize = qtsize;
+			mp4->moovpos = 0;
+			return pos;
+		}
+
+		pos += qtsize;
+	}
+
+	// fallback to walking the whole file with stdio
+	SeekSource(mp4, 0);
+	return 0;
+}
+
+
+static void FreeMoovAtom(mp4object *mp4)
+{
+	if (mp4->moovbuffer)
+	{
+		free(mp4->moovbuffer);
+		mp4->moovbuffer = NULL;
+	}
+	mp4->moovsize = mp4->moovpos = 0;
+}
+
+
 uint32_t GetPayloadSize(size_t handle, uint32_t index)
 {
 	mp4object *mp4 = (mp4object *)handle;
@@ -203,15 +1102,85 @@ uint32_t GetPayloadSize(size_t handle, uint32_t index)
 }
 
 
+// A local file behind the mp4io callbacks, standing in for caches and other sources that aren't files.
+static size_t FileIOReadAt(void *context, void *data, size_t bytes, uint64_t offset)
+{
+	return ReadFileAt((FILE *)context, data, bytes, offset);
+}
+
+
+static uint64_t FileIOGetSize(void *context)
+{
+#ifdef _WINDOWS
+	struct _stat64 st;
+	if (_fstat64(_fileno((FILE *)context), &st) != 0) return 0;
+#else
+	struct stat st;
+	if (fstat(fileno((FILE *)context), &st) != 0) return 0;
+#endif
+	return (uint64_t)st.st_size;
+}
+
+
+uint32_t OpenFileIO(char *filename, mp4io *io)
+{
+	FILE *fp;
+
+	if (filename == NULL || io == NULL) return 0;
+
+	memset(io, 0, sizeof(mp4io));
+#ifdef _WINDOWS
+	fopen_s(&fp, filename, "rb");
+#else
+	fp = fopen(filename, "rb");
+#endif
+	if (fp == NULL) return 0;
+
+	io->context = fp;
+	io->cbReadAt = FileIOReadAt;
+	io->cbGetSize = FileIOGetSize;
+	return 1;
+}
+
+
+void CloseFileIO(mp4io *io)
+{
+	if (io && io->context)
+	{
+		fclose((FILE *)io->context);
+		io->context = NULL;
+	}
+}
+
+
 #define MAX_NEST_LEVEL	20
 
-size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, int32_t flags)  //RAW or within MP4
+static mp4object *NewMP4Object(void)
 {
 	mp4object *mp4 = (mp4object *)malloc(sizeof(mp4object));
-	if (mp4 == NULL) return 0;
+	if (mp4 == NULL) return NULL;
 
 	memset(mp4, 0, sizeof(mp4object));
 
+	mp4->cachelock = malloc(sizeof(GPMF_mutex));
+	if (mp4->cachelock == NULL)
+	{
+		free(mp4);
+		return NULL;
+	}
+	GPMF_MutexInit((GPMF_mutex *)mp4->cachelock);
+
+	return mp4;
+}
+
+
+static size_t ParseMP4Source(mp4object *mp4, int32_t flags);
+
+size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, int32_t flags)  //RAW or within MP4
+{
+	mp4object *mp4 = NewMP4Object();
+	if (mp4 == NULL) return 0;
+
 #ifdef _WINDOWS
 	struct _stat64 mp4stat;
 	_stat64(filename, &mp4stat);
@@ -220,10 +1189,13 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 	stat(filename, &mp4stat);
 #endif
 	mp4->filesize = (uint64_t) mp4stat.st_size;
+	mp4->filetime = (uint64_t) mp4stat.st_mtime;
+	mp4->traktype = traktype;
+	mp4->traksubtype = traksubtype;
 //	printf("filesize = %ld\n", mp4->filesize);
 	if (mp4->filesize < 64) 
 	{
-		free(mp4);
+		CloseSource((size_t)mp4);
 		return 0;
 	}
 
@@ -234,7 +1206,37 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 	mp4->mediafp = fopen(filename, mode);
 #endif
 
-	if (mp4->mediafp)
+	return ParseMP4Source(mp4, flags);
+}
+
+
+size_t OpenMP4SourceIO(mp4io *io, uint32_t traktype, uint32_t traksubtype, int32_t flags)
+{
+	mp4object *mp4;
+
+	if (io == NULL || io->cbReadAt == NULL || io->cbGetSize == NULL) return 0;
+
+	mp4 = NewMP4Object();
+	if (mp4 == NULL) return 0;
+	mp4->io = *io;
+	mp4->filesize = io->cbGetSize(io->context);
+	mp4->traktype = traktype;
+	mp4->traksubtype = traksubtype;
+	if (mp4->filesize < 64)
+	{
+		CloseSource((size_t)mp4);
+		return 0;
+	}
+
+	return ParseMP4Source(mp4, flags); // with no FILE, mapping and writing are unavailable and their flags ignored
+}
+
+
+static size_t ParseMP4Source(mp4object *mp4, int32_t flags)
+{
+	uint32_t traktype = mp4->traktype, traksubtype = mp4->traksubtype;
+
+	if (mp4->mediafp || mp4->io.cbReadAt)
 	{
 		uint32_t qttag, qtsize32, skip, type = 0, subtype = 0, num;
 		size_t len;
@@ -244,11 +1246,12 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 		uint64_t maxfilesize = 0;
 		uint32_t required_tags = 0;
 
+		mp4->filepos = LoadMoovAtom(mp4); // when loaded, parsing starts at the moov atom and ends with it
 
 		do
 		{
-			len = fread(&qtsize32, 1, 4, mp4->mediafp);
-			len += fread(&qttag, 1, 4, mp4->mediafp);
+			len = ReadAtomData(mp4, &qtsize32, 4);
+			len += ReadAtomData(mp4, &qttag, 4);
 			mp4->filepos += len;
 
 			if (maxfilesize && mp4->filepos >= maxfilesize) 
@@ -274,7 +1277,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 
 				if (qtsize32 == 1) // 64-bit Atom
 				{
-					len = fread(&qtsize, 1, 8, mp4->mediafp);
+					len = ReadAtomData(mp4, &qtsize, 8);
 					mp4->filepos += len;
 					qtsize = BYTESWAP64(qtsize) - 8;
 				}
@@ -356,11 +1359,11 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					}
 					else if (qttag == MAKEID('m', 'v', 'h', 'd')) //mvhd  movie header
 					{
-						len = fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&mp4->clockdemon, 1, 4, mp4->mediafp); mp4->clockdemon = BYTESWAP32(mp4->clockdemon);
-						len += fread(&mp4->clockcount, 1, 4, mp4->mediafp); mp4->clockcount = BYTESWAP32(mp4->clockcount);
+						len = ReadAtomData(mp4, &skip, 4);
+						len += ReadAtomData(mp4, &skip, 4);
+						len += ReadAtomData(mp4, &skip, 4);
+						len += ReadAtomData(mp4, &mp4->clockdemon, 4); mp4->clockdemon = BYTESWAP32(mp4->clockdemon);
+						len += ReadAtomData(mp4, &mp4->clockcount, 4); mp4->clockcount = BYTESWAP32(mp4->clockcount);
 
 						mp4->filepos += len;
 						LongSeek(mp4, qtsize - 8 - len); // skip over mvhd
@@ -378,7 +1381,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					else if (qttag == MAKEID('m', 'd', 'h', 'd')) //mdhd  media header
 					{
 						media_header md;
-						len = fread(&md, 1, sizeof(md), mp4->mediafp);
+						len = ReadAtomData(mp4, &md, sizeof(md));
 						if (len == sizeof(md))
 						{
 							md.creation_time = BYTESWAP32(md.creation_time);
@@ -410,9 +1413,9 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					else if (qttag == MAKEID('h', 'd', 'l', 'r')) //hldr
 					{
 						uint32_t temp;
-						len = fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&temp, 1, 4, mp4->mediafp);  // type will be 'meta' for the correct trak.
+						len = ReadAtomData(mp4, &skip, 4);
+						len += ReadAtomData(mp4, &skip, 4);
+						len += ReadAtomData(mp4, &temp, 4);  // type will be 'meta' for the correct trak.
 
 						if (temp != MAKEID('a', 'l', 'i', 's') && temp != MAKEID('u', 'r', 'l', ' '))
 							type = temp;
@@ -426,14 +1429,14 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					else if (qttag == MAKEID('e', 'd', 't', 's')) //edit list
 					{
 						uint32_t elst,temp,readnum,i;
-						len = fread(&skip, 1, 4, mp4->mediafp);
-						len += fread(&elst, 1, 4, mp4->mediafp);
+						len = ReadAtomData(mp4, &skip, 4);
+						len += ReadAtomData(mp4, &elst, 4);
 						if (elst == MAKEID('e', 'l', 's', 't'))
 						{
-							len += fread(&temp, 1, 4, mp4->mediafp);
+							len += ReadAtomData(mp4, &temp, 4);
 							if (temp == 0)
 							{
-								len += fread(&readnum, 1, 4, mp4->mediafp);
+								len += ReadAtomData(mp4, &readnum, 4);
 								readnum = BYTESWAP32(readnum);
 								if (readnum <= (qtsize / 12) && mp4->trak_clockdemon)
 								{
@@ -442,9 +1445,9 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 									uint32_t segment_mediaRate; //point number that specifies the relative rate at which to play the media corresponding to this edit segment.This rate value cannot be 0 or negative.
 									for (i = 0; i < readnum; i++)
 									{
-										len += fread(&segment_duration, 1, 4, mp4->mediafp);
-										len += fread(&segment_mediaTime, 1, 4, mp4->mediafp);
-										len += fread(&segment_mediaRate, 1, 4, mp4->mediafp);
+										len += ReadAtomData(mp4, &segment_duration, 4);
+										len += ReadAtomData(mp4, &segment_mediaTime, 4);
+										len += ReadAtomData(mp4, &segment_mediaRate, 4);
 
 										segment_duration = BYTESWAP32(segment_duration);  // in MP4 clock base
 										segment_mediaTime = BYTESWAP32(segment_mediaTime); // in trak clock base
@@ -471,10 +1474,10 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					{
 						if (type == traktype) //like meta
 						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&subtype, 1, 4, mp4->mediafp);  // type will be 'meta' for the correct trak.
+							len = ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &subtype, 4);  // type will be 'meta' for the correct trak.
 							if (len == 16)
 							{
 								if (subtype != traksubtype) // not MP4 metadata 
@@ -494,8 +1497,8 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					{
 						if (type == traktype) // meta
 						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+							len = ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &num, 4);
 
 							num = BYTESWAP32(num);
 							if (num <= (qtsize/sizeof(SampleToChunk)))
@@ -511,7 +1514,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 									mp4->metastsc = (SampleToChunk *)malloc(num * sizeof(SampleToChunk));
 									if (mp4->metastsc)
 									{
-										len += fread(mp4->metastsc, 1, num * sizeof(SampleToChunk), mp4->mediafp);
+										len += ReadAtomData(mp4, mp4->metastsc, num * sizeof(SampleToChunk));
 
 										do
 										{
@@ -544,9 +1547,9 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 						{
 							uint32_t equalsamplesize;
 
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&equalsamplesize, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+							len = ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &equalsamplesize, 4);
+							len += ReadAtomData(mp4, &num, 4);
 
 							num = BYTESWAP32(num);
 							// if equalsamplesize != 0, it is the size of all the samples and the length should be 20 (size,fourcc,flags,samplesize,samplecount)
@@ -566,7 +1569,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 									{
 										if (equalsamplesize == 0)
 										{
-											len += fread(mp4->metasizes, 1, num * 4, mp4->mediafp);
+											len += ReadAtomData(mp4, mp4->metasizes, num * 4);
 											do
 											{
 												num--;
@@ -604,8 +1607,8 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					{
 						if (type == traktype) // meta
 						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+							len = ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &num, 4);
 							num = BYTESWAP32(num);
 							if (num <= ((qtsize - 8 - len) / sizeof(uint32_t)))
 							{
@@ -635,7 +1638,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 												uint64_t fileoffset = 0;
 												int stsc_pos = 0;
 												int stco_pos = 0;
-												len += fread(metaoffsets32, 1, num * 4, mp4->mediafp);
+												len += ReadAtomData(mp4, metaoffsets32, num * 4);
 												do
 												{
 													num--;
@@ -697,7 +1700,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 											metaoffsets32 = (uint32_t*)malloc(num * 4);
 											if (metaoffsets32)
 											{
-												size_t readlen = fread(metaoffsets32, 1, num * 4, mp4->mediafp);
+												size_t readlen = ReadAtomData(mp4, metaoffsets32, num * 4);
 												len += readlen;
 												do
 												{
@@ -731,8 +1734,8 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 					{
 						if (type == traktype) // meta
 						{
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+							len = ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &num, 4);
 							num = BYTESWAP32(num);
 
 							if(num == 0)
@@ -770,7 +1773,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 												uint64_t fileoffset = 0;
 												int stsc_pos = 0;
 												int stco_pos = 0;
-												len += fread(metaoffsets64, 1, num * 8, mp4->mediafp);
+												len += ReadAtomData(mp4, metaoffsets64, num * 8);
 												do
 												{
 													num--;
@@ -828,7 +1831,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 										mp4->metaoffsets = (uint64_t*)malloc(num * 8);
 										if (mp4->metaoffsets)
 										{
-											len += fread(mp4->metaoffsets, 1, num * 8, mp4->mediafp);
+											len += ReadAtomData(mp4, mp4->metaoffsets, num * 8);
 											do
 											{
 												num--;
@@ -852,8 +1855,8 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 						{
 							uint32_t samples = 0;
 							uint32_t entries = 0;
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+							len = ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &num, 4);
 							num = BYTESWAP32(num);
 
 							if (num <= (qtsize / 8) && num < 5184000) // number of frame in 24hours at 60fps (crude limiter for corrupted num data.))
@@ -864,9 +1867,9 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 								{
 									uint32_t samplecount;
 									uint32_t duration;
-									len += fread(&samplecount, 1, 4, mp4->mediafp);
+									len += ReadAtomData(mp4, &samplecount, 4);
 									samplecount = BYTESWAP32(samplecount);
-									len += fread(&duration, 1, 4, mp4->mediafp);
+									len += ReadAtomData(mp4, &duration, 4);
 									duration = BYTESWAP32(duration);
 
 									samples += samplecount;
@@ -888,8 +1891,8 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 						{
 							uint32_t totaldur = 0, samples = 0;
 							uint32_t entries = 0;
-							len = fread(&skip, 1, 4, mp4->mediafp);
-							len += fread(&num, 1, 4, mp4->mediafp);
+							len = ReadAtomData(mp4, &skip, 4);
+							len += ReadAtomData(mp4, &num, 4);
 							num = BYTESWAP32(num);
 							if (num <= (qtsize / 8))
 							{
@@ -911,9 +1914,9 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 								{
 									uint32_t samplecount;
 									uint32_t duration;
-									len += fread(&samplecount, 1, 4, mp4->mediafp);
+									len += ReadAtomData(mp4, &samplecount, 4);
 									samplecount = BYTESWAP32(samplecount);
-									len += fread(&duration, 1, 4, mp4->mediafp);
+									len += ReadAtomData(mp4, &duration, 4);
 									duration = BYTESWAP32(duration);
 
 									samples += samplecount;
@@ -947,6 +1950,8 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 
 		if (mp4)
 		{
+			FreeMoovAtom(mp4);
+
 			if (mp4->metasizes == NULL || mp4->metaoffsets == NULL)
 			{
 				CloseSource((size_t)mp4);
@@ -957,6 +1962,8 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 			if (mp4 != NULL)
 			{
 				mp4->indexcount = mp4->metasize_count;
+
+				MapMediaFile(mp4, flags);
 			}
 		}
 	}
@@ -965,7 +1972,7 @@ size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t traksubtype, in
 		//	printf("Could not open %s for input\n", filename);
 		//	exit(1);
 
-		free(mp4);
+		CloseSource((size_t)mp4);
 		mp4 = NULL;
 	}
 
@@ -1003,6 +2010,9 @@ void CloseSource(size_t handle)
 		return;
 	}
 
+	SetHandleCache(handle, NULL, NULL);
+	UnmapMediaFile(mp4);
+	FreeMoovAtom(mp4);
 	if (mp4->mediafp)
 	{
 		fclose(mp4->mediafp);
@@ -1023,6 +2033,11 @@ void CloseSource(size_t handle)
 		free(mp4->metastsc);
 		mp4->metastsc = 0;
 	}
+	if (mp4->cachelock)
+	{
+		GPMF_MutexFree((GPMF_mutex *)mp4->cachelock);
+		free(mp4->cachelock);
+	}
  
  	free(mp4);
 }
@@ -1097,14 +2112,50 @@ uint32_t GetEditListOffsetRationalTime(size_t handle, int32_t *offset_numerator,
 }
 
 
+void *GetHandleCache(size_t handle)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return NULL;
+
+	return mp4->cache;
+}
+
+
+// Threads sharing a handle hold this across GetHandleCache(), any use of the cache and SetHandleCache(), as the cache
+// they read may otherwise be released by another thread replacing it.
+void LockHandleCache(size_t handle, uint32_t lock)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL || mp4->cachelock == NULL) return;
+
+	if (lock)
+		GPMF_MutexLock((GPMF_mutex *)mp4->cachelock);
+	else
+		GPMF_MutexUnlock((GPMF_mutex *)mp4->cachelock);
+}
+
+
+void SetHandleCache(size_t handle, void *cache, void (*freecache)(void *cache))
+{
+	mp4object *mp4 = (mp4object *)handle;
+	if (mp4 == NULL) return;
+
+	if (mp4->cache && mp4->freecache && mp4->cache != cache)
+		mp4->freecache(mp4->cache);
+
+	mp4->cache = cache;
+	mp4->freecache = freecache;
+}
+
+
+
+static size_t ParseMP4SourceUDTA(mp4object *mp4, int32_t flags);
 
 size_t OpenMP4SourceUDTA(char *filename, int32_t flags)
 {
-	mp4object *mp4 = (mp4object *)malloc(sizeof(mp4object));
+	mp4object *mp4 = NewMP4Object();
 	if (mp4 == NULL) return 0;
 
-	memset(mp4, 0, sizeof(mp4object));
-
 #ifdef _WINDOWS
 	struct _stat64 mp4stat;
 	_stat64(filename, &mp4stat);
@@ -1115,7 +2166,7 @@ size_t OpenMP4SourceUDTA(char *filename, int32_t flags)
 	mp4->filesize = (uint64_t)mp4stat.st_size;
 	if (mp4->filesize < 64) 
 	{
-		free(mp4);
+		CloseSource((size_t)mp4);
 		return 0;
 	}
 
@@ -1126,7 +2177,33 @@ size_t OpenMP4SourceUDTA(char *filename, int32_t flags)
 	mp4->mediafp = fopen(filename, mode);
 #endif
 
-	if (mp4->mediafp)
+	return ParseMP4SourceUDTA(mp4, flags);
+}
+
+
+size_t OpenMP4SourceUDTAIO(mp4io *io, int32_t flags)
+{
+	mp4object *mp4;
+
+	if (io == NULL || io->cbReadAt == NULL || io->cbGetSize == NULL) return 0;
+
+	mp4 = NewMP4Object();
+	if (mp4 == NULL) return 0;
+	mp4->io = *io;
+	mp4->filesize = io->cbGetSize(io->context);
+	if (mp4->filesize < 64)
+	{
+		CloseSource((size_t)mp4);
+		return 0;
+	}
+
+	return ParseMP4SourceUDTA(mp4, flags);
+}
+
+
+static size_t ParseMP4SourceUDTA(mp4object *mp4, int32_t flags)
+{
+	if (mp4->mediafp || mp4->io.cbReadAt)
 	{
 		uint32_t qttag, qtsize32;
 		size_t len;
@@ -1139,8 +2216,8 @@ size_t OpenMP4SourceUDTA(char *filename, int32_t flags)
 
 		do
 		{
-			len = fread(&qtsize32, 1, 4, mp4->mediafp);
-			len += fread(&qttag, 1, 4, mp4->mediafp);
+			len = ReadSource(mp4, &qtsize32, 4);
+			len += ReadSource(mp4, &qttag, 4);
 			mp4->filepos += len;
 			
 			if (maxfilesize && mp4->filepos >= maxfilesize)
@@ -1161,7 +2238,7 @@ size_t OpenMP4SourceUDTA(char *filename, int32_t flags)
 
 				if (qtsize32 == 1) // 64-bit Atom
 				{
-					len += fread(&qtsize, 1, 8, mp4->mediafp);
+					len += ReadSource(mp4, &qtsize, 8);
 					mp4->filepos += len;
 					qtsize = BYTESWAP64(qtsize) - 8;
 				}
@@ -1209,9 +2286,11 @@ size_t OpenMP4SourceUDTA(char *filename, int32_t flags)
 					mp4->meta_clockdemon = 1;
 
 					mp4->metasizes[0] = (uint32_t)qtsize - 8;
-					mp4->metaoffsets[0] = (uint64_t) LONGTELL(mp4->mediafp);
+					mp4->metaoffsets[0] = TellSource(mp4);
 					mp4->metasize_count = 1;
 
+					MapMediaFile(mp4, flags);
+
 					return (size_t)mp4;  // not an MP4, RAW GPMF which has not inherent timing, assigning a during of 1second.
 				}
 				if (qttag != MAKEID('m', 'o', 'o', 'v') && //skip over all but these atoms
@@ -1237,3 +2316,228 @@ size_t OpenMP4SourceUDTA(char *filename, int32_t flags)
 	return (size_t)mp4;
 }
 
+
+
+#define MP4_INDEX_MAGIC		MAKEID('G', 'P', 'I', 'X')
+#define MP4_INDEX_VERSION	2
+#define MP4_INDEX_BYTEORDER	0x01020304	// as stored by the writer, another byte order reads it swapped
+
+typedef struct mp4index_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t filesize;
+	uint64_t filetime;
+	uint32_t traktype, traksubtype;
+	uint32_t indexcount;
+	int32_t metadataoffset_clockcount;
+	double videolength;
+	double metadatalength;
+	double basemetadataduration;
+	uint32_t clockdemon, clockcount;
+	uint32_t trak_clockdemon, trak_clockcount;
+	uint32_t meta_clockdemon, meta_clockcount;
+	uint32_t video_framerate_numerator;
+	uint32_t video_framerate_denominator;
+	uint32_t video_frames;
+	uint32_t byteorder;
+} mp4index_header;  // followed by indexcount sizes (uint32_t) then indexcount offsets (uint64_t), all in the writer's byte order
+
+
+// Appends a suffix to a name in a new allocation, the caller frees it. NULL if out of memory.
+static char *MP4IndexName(char *name, char *suffix)
+{
+	size_t len = strlen(name), suffixlen = strlen(suffix);
+	char *newname = (char *)malloc(len + suffixlen + 1);
+
+	if (newname)
+	{
+		memcpy(newname, name, len);
+		memcpy(newname + len, suffix, suffixlen + 1);
+	}
+	return newname;
+}
+
+
+uint32_t WriteMP4Index(size_t handle, char *indexname)
+{
+	mp4object *mp4 = (mp4object *)handle;
+	mp4index_header hdr;
+	char *tmpname;
+	FILE *fp = NULL;
+	uint32_t ok = 0;
+
+	if (mp4 == NULL || indexname == NULL) return MP4_ERROR_MEMORY;
+	if (mp4->indexcount == 0 || mp4->metasizes == NULL || mp4->metaoffsets == NULL || mp4->filetime == 0) return MP4_ERROR_MEMORY;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MP4_INDEX_MAGIC;
+	hdr.version = MP4_INDEX_VERSION;
+	hdr.filesize = mp4->filesize;
+	hdr.filetime = mp4->filetime;
+	hdr.traktype = mp4->traktype;
+	hdr.traksubtype = mp4->traksubtype;
+	hdr.indexcount = mp4->indexcount;
+	hdr.metadataoffset_clockcount = mp4->metadataoffset_clockcount;
+	hdr.videolength = mp4->videolength;
+	hdr.metadatalength = mp4->metadatalength;
+	hdr.basemetadataduration = mp4->basemetadataduration;
+	hdr.clockdemon = mp4->clockdemon;
+	hdr.clockcount = mp4->clockcount;
+	hdr.trak_clockdemon = mp4->trak_clockdemon;
+	hdr.trak_clockcount = mp4->trak_clockcount;
+	hdr.meta_clockdemon = mp4->meta_clockdemon;
+	hdr.meta_clockcount = mp4->meta_clockcount;
+	hdr.video_framerate_numerator = mp4->video_framerate_numerator;
+	hdr.video_framerate_denominator = mp4->video_framerate_denominator;
+	hdr.video_frames = mp4->video_frames;
+	hdr.byteorder = MP4_INDEX_BYTEORDER;
+
+	// write to a temporary file and rename, so concurrent readers never see a partial index
+	tmpname = MP4IndexName(indexname, ".tmp");
+	if (tmpname == NULL) return MP4_ERROR_MEMORY;
+#ifdef _WINDOWS
+	fopen_s(&fp, tmpname, "wb");
+#else
+	fp = fopen(tmpname, "wb");
+#endif
+	if (fp == NULL)
+	{
+		free(tmpname);
+		return MP4_ERROR_MEMORY;
+	}
+
+	if (fwrite(&hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+		fwrite(mp4->metasizes, 4, mp4->indexcount, fp) == mp4->indexcount &&
+		fwrite(mp4->metaoffsets, 8, mp4->indexcount, fp) == mp4->indexcount)
+		ok = 1;
+
+	if (fclose(fp) != 0) ok = 0;
+
+	if (ok)
+	{
+#ifdef _WINDOWS
+		remove(indexname);
+#endif
+		if (rename(tmpname, indexname) == 0)
+		{
+			free(tmpname);
+			return MP4_ERROR_OK;
+		}
+	}
+
+	remove(tmpname);
+	free(tmpname);
+	return MP4_ERROR_MEMORY;
+}
+
+
+static size_t ReadMP4Index(char *filename, char *indexname, uint32_t traktype, uint32_t traksubtype, int32_t flags)
+{
+	mp4object *mp4 = NULL;
+	mp4index_header hdr;
+	FILE *fp = NULL;
+	uint64_t indexsize;
+
+#ifdef _WINDOWS
+	struct _stat64 mp4stat, idxstat;
+	if (_stat64(filename, &mp4stat) != 0 || _stat64(indexname, &idxstat) != 0) return 0;
+#else
+	struct stat mp4stat, idxstat;
+	if (stat(filename, &mp4stat) != 0 || stat(indexname, &idxstat) != 0) return 0;
+#endif
+
+#ifdef _WINDOWS
+	fopen_s(&fp, indexname, "rb");
+#else
+	fp = fopen(indexname, "rb");
+#endif
+	if (fp == NULL) return 0;
+
+	if (fread(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr))
+		goto cleanup;
+
+	indexsize = sizeof(hdr) + (uint64_t)hdr.indexcount * 12;
+	if (hdr.magic != MP4_INDEX_MAGIC || hdr.version != MP4_INDEX_VERSION || hdr.byteorder != MP4_INDEX_BYTEORDER ||
+		hdr.filesize != (uint64_t)mp4stat.st_size || hdr.filetime != (uint64_t)mp4stat.st_mtime ||
+		hdr.traktype != traktype || hdr.traksubtype != traksubtype ||
+		hdr.indexcount == 0 || hdr.indexcount >= 5184000 || (uint64_t)idxstat.st_size != indexsize)
+		goto cleanup;
+
+	mp4 = NewMP4Object();
+	if (mp4 == NULL) goto cleanup;
+
+	mp4->metasizes = (uint32_t *)malloc(hdr.indexcount * 4);
+	mp4->metaoffsets = (uint64_t *)malloc(hdr.indexcount * 8);
+	if (mp4->metasizes == NULL || mp4->metaoffsets == NULL ||
+		fread(mp4->metasizes, 4, hdr.indexcount, fp) != hdr.indexcount ||
+		fread(mp4->metaoffsets, 8, hdr.indexcount, fp) != hdr.indexcount)
+	{
+		CloseSource((size_t)mp4);
+		mp4 = NULL;
+		goto cleanup;
+	}
+
+	mp4->filesize = hdr.filesize;
+	mp4->filetime = hdr.filetime;
+	mp4->traktype = hdr.traktype;
+	mp4->traksubtype = hdr.traksubtype;
+	mp4->indexcount = mp4->metasize_count = mp4->metastco_count = hdr.indexcount;
+	mp4->metadataoffset_clockcount = hdr.metadataoffset_clockcount;
+	mp4->videolength = hdr.videolength;
+	mp4->metadatalength = hdr.metadatalength;
+	mp4->basemetadataduration = hdr.basemetadataduration;
+	mp4->clockdemon = hdr.clockdemon;
+	mp4->clockcount = hdr.clockcount;
+	mp4->trak_clockdemon = hdr.trak_clockdemon;
+	mp4->trak_clockcount = hdr.trak_clockcount;
+	mp4->meta_clockdemon = hdr.meta_clockdemon;
+	mp4->meta_clockcount = hdr.meta_clockcount;
+	mp4->video_framerate_numerator = hdr.video_framerate_numerator;
+	mp4->video_framerate_denominator = hdr.video_framerate_denominator;
+	mp4->video_frames = hdr.video_frames;
+
+	{
+		const char *mode = (flags & MP4_FLAG_READ_WRITE_MODE) ? "rb+" : "rb";
+#ifdef _WINDOWS
+		fopen_s(&mp4->mediafp, filename, mode);
+#else
+		mp4->mediafp = fopen(filename, mode);
+#endif
+	}
+	if (mp4->mediafp == NULL)
+	{
+		CloseSource((size_t)mp4);
+		mp4 = NULL;
+		goto cleanup;
+	}
+
+	MapMediaFile(mp4, flags);
+
+cleanup:
+	fclose(fp);
+	return (size_t)mp4;
+}
+
+
+size_t OpenMP4SourceWithIndex(char *filename, char *indexname, uint32_t traktype, uint32_t traksubtype, int32_t flags)
+{
+	char *name;
+	size_t handle;
+
+	if (filename == NULL) return 0;
+
+	name = indexname ? indexname : MP4IndexName(filename, ".gpmfidx");
+	if (name == NULL) return 0;
+
+	handle = ReadMP4Index(filename, name, traktype, traksubtype, flags);
+	if (handle == 0)
+	{
+		handle = OpenMP4Source(filename, traktype, traksubtype, flags);
+		if (handle)
+			WriteMP4Index(handle, name);  // failing to write the index is not an error, the next open will scan the file again
+	}
+
+	if (name != indexname) free(name);
+	return handle;
+}
@@ -46,6 +46,14 @@ typedef struct SampleToChunk
 	uint32_t id;
 } SampleToChunk;
 
+typedef struct mp4io
+{
+	void *context;
+	size_t   (*cbReadAt)(void *context, void *data, size_t bytes, uint64_t offset);	// bytes read, fewer only at the end or on an error, called from several threads by payload queues
+	uint64_t (*cbGetSize)(void *context);
+} mp4io;
+
+
 #define MAX_TRACKS	16
 typedef struct mp4object
 {
@@ -71,11 +79,24 @@ typedef struct mp4object
 	FILE *mediafp;
 	uint64_t filesize;
 	uint64_t filepos;
+	uint8_t *mediamap;			// whole file mapped when opened with MP4_FLAG_MEMORY_MAPPED
+	size_t mediamaphandle;		// file mapping object (Windows only)
+	uint64_t filetime;			// modification time, used to validate index files
+	uint32_t traktype, traksubtype;
+	uint8_t *moovbuffer;		// whole moov atom, only held while OpenMP4Source() parses it
+	uint64_t moovsize;
+	uint64_t moovpos;			// read position within moovbuffer
+	void *cache;				// results kept with the handle by GetGPMFSampleRates(), released by CloseSource()
+	void (*freecache)(void *cache);
+	void *cachelock;			// GPMF_mutex taken by LockHandleCache()
+	mp4io io;					// the source when opened with OpenMP4SourceIO(), mediafp is then NULL
+	uint64_t iopos;				// sequential read position in io while parsing
 } mp4object;
 
 enum mp4flag
 {
 	MP4_FLAG_READ_WRITE_MODE = 1 << 0,
+	MP4_FLAG_MEMORY_MAPPED = 1 << 1,	// GetPayload() returns pointers into a private mapping of the file, no copies (ignored with MP4_FLAG_READ_WRITE_MODE)
 };
 
 typedef struct resObject
@@ -84,6 +105,15 @@ typedef struct resObject
 	uint32_t bufferSize;
 } resObject;
 
+typedef struct payloadCompletion
+{
+	uint32_t index;
+	uint32_t *payload;			// NULL when the read failed
+	uint32_t payloadsize;
+	size_t resHandle;			// the resource it was read into, free to reuse
+	void *user;					// as passed to SubmitPayload()
+} payloadCompletion;
+
 
 #define MAKEID(a,b,c,d)			(((d&0xff)<<24)|((c&0xff)<<16)|((b&0xff)<<8)|(a&0xff))
 #define STR2FOURCC(s)			((s[0]<<0)|(s[1]<<8)|(s[2]<<16)|(s[3]<<24))
@@ -122,6 +152,12 @@ typedef enum MP4READER_ERROR
 
 size_t OpenMP4Source(char *filename, uint32_t traktype, uint32_t subtype, int32_t flags);
 size_t OpenMP4SourceUDTA(char *filename, int32_t flags);
+size_t OpenMP4SourceIO(mp4io *io, uint32_t traktype, uint32_t subtype, int32_t flags); // reads through the callbacks, the context must outlive the handle
+size_t OpenMP4SourceUDTAIO(mp4io *io, int32_t flags);
+uint32_t OpenFileIO(char *filename, mp4io *io); // mp4io callbacks reading a local file
+void CloseFileIO(mp4io *io);
+size_t OpenMP4SourceWithIndex(char *filename, char *indexname, uint32_t traktype, uint32_t subtype, int32_t flags); // uses or creates a payload index file, indexname NULL for filename.gpmfidx
+uint32_t WriteMP4Index(size_t mp4Handle, char *indexname);
 void CloseSource(size_t mp4Handle);
 float GetDuration(size_t mp4Handle);
 uint32_t GetVideoFrameRateAndCount(size_t mp4Handle, uint32_t *numer, uint32_t *demon);
@@ -129,12 +165,21 @@ uint32_t GetNumberPayloads(size_t mp4Handle);
 uint32_t WritePayload(size_t mp4Handle, uint32_t* payload, uint32_t payloadsize, uint32_t index);
 size_t GetPayloadResource(size_t mp4Handle, size_t resHandle, uint32_t payloadBufferSize);
 void FreePayloadResource(size_t mp4Handle, size_t resHandle);
-uint32_t* GetPayload(size_t mp4Handle, size_t resHandle, uint32_t index);
+uint32_t* GetPayload(size_t mp4Handle, size_t resHandle, uint32_t index); // may be called from several threads on one handle, each with its own resource
+uint32_t GetPayloadRange(size_t mp4Handle, size_t resHandle, uint32_t first, uint32_t count, uint32_t **payloads); // count payloads from first with as few reads as possible, returns how many were read, NULL pointers for the rest
 uint32_t GetPayloadSize(size_t mp4Handle, uint32_t index);
 uint32_t GetPayloadTime(size_t mp4Handle, uint32_t index, double *in, double *out); //MP4 timestamps for the payload
 uint32_t GetPayloadRationalTime(size_t mp4Handle, uint32_t index, int32_t *in_numerator, int32_t *out_numerator, uint32_t *denominator);
 uint32_t GetEditListOffset(size_t mp4Handle, double *offset);
 uint32_t GetEditListOffsetRationalTime(size_t mp4Handle, int32_t *offset_numerator, uint32_t *denominator);
+size_t OpenPayloadQueue(size_t mp4Handle, uint32_t depth); // asynchronous reads, up to depth in flight, through io_uring on Linux or else a pool of threads
+uint32_t SubmitPayload(size_t queueHandle, size_t resHandle, uint32_t index, void *user); // returns 0 when the queue is full, the resource belongs to the queue until reaped. io_uring reads start together at the next ReapPayload()
+uint32_t ReapPayload(size_t queueHandle, uint32_t wait, payloadCompletion *done); // returns 1 with a finished read, wait to block while reads are in flight
+uint32_t PayloadsInFlight(size_t queueHandle);
+void ClosePayloadQueue(size_t queueHandle); // waits for outstanding reads
+void *GetHandleCache(size_t mp4Handle);
+void SetHandleCache(size_t mp4Handle, void *cache, void (*freecache)(void *cache)); // any previous cache is released
+void LockHandleCache(size_t mp4Handle, uint32_t lock); // serializes threads using the cache of one handle
 
 #ifdef __cplusplus
 }
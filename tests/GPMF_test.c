@@ -0,0 +1,654 @@
+/*! @file GPMF_test.c
+ *
+ *  @brief Checks the fast and parallel paths against the serial parser they replace
+ *
+ *  @version 1.0.0
+ *
+ *  (C) Copyright 2026 GoPro Inc (http://gopro.com/).
+ *
+ *  Licensed under either:
+ *  - Apache License, Version 2.0, http://www.apache.org/licenses/LICENSE-2.0
+ *  - MIT license, http://opensource.org/licenses/MIT
+ *  at your option.
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../GPMF_parser.h"
+#include "../GPMF_utils.h"
+#include "../demo/GPMF_mp4reader.h"
+
+#define TEST_MAX_STREAMS		128
+#define TEST_KLV_BUFFER			(1 << 20)		// bytes, larger than any KLV of the samples scaled to doubles
+#define TEST_SHOW_FAILURES		20
+
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+
+static void Check(int ok, const char *test, const char *file, uint32_t fourcc, uint32_t index)
+{
+	checks++;
+	if (!ok)
+	{
+		failures++;
+		if (failures <= TEST_SHOW_FAILURES)
+			printf("FAILED %s: %s %c%c%c%c at %d\n", test, file, PRINTF_4CC(fourcc), index);
+	}
+}
+
+
+static void SetCallbacks(size_t mp4handle, mp4callbacks *cb, mp4callbacks_ex *cbex)
+{
+	memset(cb, 0, sizeof(mp4callbacks));
+	cb->mp4handle = mp4handle;
+	cb->cbGetNumberPayloads = GetNumberPayloads;
+	cb->cbGetPayload = GetPayload;
+	cb->cbGetPayloadSize = GetPayloadSize;
+	cb->cbGetPayloadResource = GetPayloadResource;
+	cb->cbGetPayloadTime = GetPayloadTime;
+	cb->cbFreePayloadResource = FreePayloadResource;
+	cb->cbGetEditListOffsetRationalTime = GetEditListOffsetRationalTime;
+
+	memset(cbex, 0, sizeof(mp4callbacks_ex));
+	cbex->version = MP4CALLBACKS_EX_VERSION;
+	cbex->cbGetHandleCache = GetHandleCache;
+	cbex->cbSetHandleCache = SetHandleCache;
+	cbex->cbLockHandleCache = LockHandleCache;
+	cbex->cbGetPayloadRange = GetPayloadRange;
+	cbex->threadsafe = 1;
+}
+
+
+// The samples GPMF_ExtractStreams() takes from a payload, found with GPMF_FindNext(): every instance of the key at the
+// level of the first, skipping any changing shape. Appended to a buffer grown as needed.
+static uint32_t SerialSamples(uint32_t *payload, uint32_t payloadsize, uint32_t fourcc, uint32_t *elements, double **buffer, uint32_t *samples)
+{
+	GPMF_stream metadata_stream, *ms = &metadata_stream;
+	uint32_t added = 0;
+
+	if (GPMF_OK != GPMF_Init(ms, payload, payloadsize) || GPMF_OK != GPMF_FindNext(ms, fourcc, GPMF_RECURSE_LEVELS | GPMF_TOLERANT))
+		return 0;
+
+	do
+	{
+		uint32_t repeat = GPMF_Repeat(ms);
+		uint32_t structelements = GPMF_ElementsInStruct(ms);
+		double *grown;
+
+		if (repeat == 0 || structelements == 0)
+			continue;
+		if (*elements == 0)
+			*elements = structelements;
+		else if (*elements != structelements)
+			continue;
+
+		grown = (double *)realloc(*buffer, ((size_t)*samples + repeat) * structelements * sizeof(double));
+		if (grown == NULL)
+			break;
+		*buffer = grown;
+
+		if (GPMF_OK == GPMF_ScaledData(ms, &grown[(size_t)*samples * structelements], repeat * structelements * sizeof(double), 0, repeat, GPMF_TYPE_DOUBLE))
+		{
+			*samples += repeat;
+			added += repeat;
+		}
+	} while (GPMF_OK == GPMF_FindNext(ms, fourcc, GPMF_CURRENT_LEVEL | GPMF_TOLERANT));
+
+	return added;
+}
+
+
+// Compress -> decompress is lossless at quantize 1, and decoding in windows or after a seek matches decoding it whole
+static void TestCompression(char *file)
+{
+	size_t mp4handle = OpenMP4Source(file, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	size_t payloadres = 0;
+	uint32_t *compressed = (uint32_t *)malloc(TEST_KLV_BUFFER);
+	uint8_t *whole = (uint8_t *)malloc(TEST_KLV_BUFFER);
+	uint8_t *window = (uint8_t *)malloc(TEST_KLV_BUFFER);
+	uint32_t index, tested = 0;
+
+	Check(mp4handle && compressed && whole && window, "compression setup", file, 0, 0);
+	if (mp4handle && compressed && whole && window)
+	{
+		for (index = 0; index < GetNumberPayloads(mp4handle); index++)
+		{
+			GPMF_stream metadata_stream, *ms = &metadata_stream;
+			uint32_t payloadsize = GetPayloadSize(mp4handle, index);
+			uint32_t *payload;
+
+			payloadres = GetPayloadResource(mp4handle, payloadres, payloadsize);
+			payload = GetPayload(mp4handle, payloadres, index);
+			if (payload == NULL || GPMF_OK != GPMF_Init(ms, payload, payloadsize))
+				continue;
+
+			do
+			{
+				uint32_t typesizerepeat = ms->buffer[ms->pos + 1];
+				uint32_t samples = GPMF_SAMPLES(typesizerepeat);
+				uint32_t samplesize = GPMF_SAMPLE_SIZE(typesizerepeat);
+				uint32_t used = 0, pos, chunk, ok;
+				GPMF_stream compressed_stream;
+				GPMF_decompressor dc;
+
+				if (!strchr("bBsSlL", GPMF_SAMPLE_TYPE(typesizerepeat)) || samples < 2)
+					continue;
+				if (GPMF_OK != GPMF_Compress(ms, 1, compressed, TEST_KLV_BUFFER, &used))
+					continue; // not smaller compressed
+
+				GPMF_CopyState(ms, &compressed_stream);
+				compressed_stream.buffer = compressed;
+				compressed_stream.pos = 0;
+				compressed_stream.buffer_size_longs = used / 4;
+				tested++;
+
+				ok = (GPMF_OK == GPMF_Decompress(&compressed_stream, (uint32_t *)whole, TEST_KLV_BUFFER));
+				Check(ok && 0 == memcmp(whole, &ms->buffer[ms->pos + 2], samples * samplesize), "compress round trip", file, ms->buffer[ms->pos], index);
+
+				// odd sized windows, then a seek back to the middle
+				ok = (GPMF_OK == GPMF_DecompressInit(&compressed_stream, &dc));
+				for (pos = 0; ok && pos < samples; pos += chunk)
+				{
+					chunk = samples - pos < 7 ? samples - pos : 7;
+					ok = (GPMF_OK == GPMF_DecompressNext(&dc, window + pos * samplesize, chunk * samplesize, chunk));
+				}
+				Check(ok && 0 == memcmp(whole, window, samples * samplesize), "windowed decompress", file, ms->buffer[ms->pos], index);
+
+				memset(window, 0, samples * samplesize);
+				ok = ok && GPMF_OK == GPMF_DecompressSeek(&dc, samples / 2) &&
+					GPMF_OK == GPMF_DecompressNext(&dc, window, (samples - samples / 2) * samplesize, samples - samples / 2);
+				Check(ok && 0 == memcmp(whole + (samples / 2) * samplesize, window, (samples - samples / 2) * samplesize), "seek decompress", file, ms->buffer[ms->pos], index);
+			} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS));
+		}
+	}
+
+	Check(tested > 0, "compressible KLVs", file, 0, 0);
+
+	if (payloadres) FreePayloadResource(mp4handle, payloadres);
+	if (mp4handle) CloseSource(mp4handle);
+	if (compressed) free(compressed);
+	if (whole) free(whole);
+	if (window) free(window);
+}
+
+
+// Every KLV scales the same through a context, caller scratch and columns, and formats the same with a context
+static void TestScaling(char *file)
+{
+	size_t mp4handle = OpenMP4Source(file, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	size_t payloadres = 0;
+	double *serial = (double *)malloc(TEST_KLV_BUFFER);
+	double *fast = (double *)malloc(TEST_KLV_BUFFER);
+	GPMF_scratch *scratch = (GPMF_scratch *)malloc(sizeof(GPMF_scratch));
+	uint32_t index;
+
+	Check(mp4handle && serial && fast && scratch, "scaling setup", file, 0, 0);
+	if (mp4handle && serial && fast && scratch)
+	{
+		for (index = 0; index < GetNumberPayloads(mp4handle); index++)
+		{
+			GPMF_stream metadata_stream, *ms = &metadata_stream;
+			uint32_t payloadsize = GetPayloadSize(mp4handle, index);
+			uint32_t *payload;
+
+			payloadres = GetPayloadResource(mp4handle, payloadres, payloadsize);
+			payload = GetPayload(mp4handle, payloadres, index);
+			if (payload == NULL || GPMF_OK != GPMF_Init(ms, payload, payloadsize))
+				continue;
+
+			do
+			{
+				uint32_t fourcc = GPMF_Key(ms);
+				uint32_t samples = GPMF_Repeat(ms);
+				uint32_t elements = GPMF_ElementsInStruct(ms);
+				uint32_t size = samples * elements * sizeof(double);
+				GPMF_stream_context ctx;
+				GPMF_column columns[GPMF_SCRATCH_TILE];
+				GPMF_ERR ret, ret_fast;
+				uint32_t i, j, same;
+
+				if (GPMF_Type(ms) == GPMF_TYPE_NEST || samples == 0 || elements == 0 || size > TEST_KLV_BUFFER)
+					continue;
+
+				GPMF_InitContext(&ctx);
+				GPMF_UpdateContext(ms, &ctx);
+
+				memset(serial, 0, size);
+				memset(fast, 0, size);
+				ret = GPMF_ScaledData(ms, serial, TEST_KLV_BUFFER, 0, samples, GPMF_TYPE_DOUBLE);
+				ret_fast = GPMF_ScaledDataEx(ms, &ctx, scratch, fast, TEST_KLV_BUFFER, 0, samples, GPMF_TYPE_DOUBLE);
+				Check(ret == ret_fast && 0 == memcmp(serial, fast, size), "scaled with context and scratch", file, fourcc, index);
+
+				if (ret == GPMF_OK && elements <= GPMF_SCRATCH_TILE)
+				{
+					memset(fast, 0, size);
+					for (i = 0; i < elements; i++)
+					{
+						columns[i].buffer = &fast[(size_t)i * samples];
+						columns[i].stride = 0;
+					}
+
+					same = (GPMF_OK == GPMF_ScaledDataColumns(ms, &ctx, columns, elements, 0, samples, GPMF_TYPE_DOUBLE));
+					for (j = 0; same && j < samples; j++)
+						for (i = 0; i < elements; i++)
+							same = same && 0 == memcmp(&serial[(size_t)j * elements + i], &fast[(size_t)i * samples + j], sizeof(double));
+					Check(same, "scaled columns", file, fourcc, index);
+				}
+
+				size = GPMF_FormattedDataSize(ms);
+				if (size && size <= TEST_KLV_BUFFER)
+				{
+					memset(serial, 0, size);
+					memset(fast, 0, size);
+					ret = GPMF_FormattedData(ms, serial, TEST_KLV_BUFFER, 0, samples);
+					ret_fast = GPMF_FormattedDataWithContext(ms, &ctx, fast, TEST_KLV_BUFFER, 0, samples);
+					Check(ret == ret_fast && 0 == memcmp(serial, fast, size), "formatted with context", file, fourcc, index);
+				}
+			} while (GPMF_OK == GPMF_Next(ms, GPMF_RECURSE_LEVELS | GPMF_TOLERANT));
+		}
+	}
+
+	if (payloadres) FreePayloadResource(mp4handle, payloadres);
+	if (mp4handle) CloseSource(mp4handle);
+	if (serial) free(serial);
+	if (fast) free(fast);
+	if (scratch) free(scratch);
+}
+
+
+// A batch of every stream, through the payload's directory or without one, matches each stream found with GPMF_FindNext()
+static void TestBatch(char *file)
+{
+	size_t mp4handle = OpenMP4Source(file, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	size_t payloadres = 0;
+	GPMF_directory *dir = (GPMF_directory *)malloc(sizeof(GPMF_directory));
+	GPMF_batch_request *requests = (GPMF_batch_request *)calloc(GPMF_DIRECTORY_LIMIT, sizeof(GPMF_batch_request));
+	uint8_t *buffers = (uint8_t *)malloc((size_t)GPMF_DIRECTORY_LIMIT * TEST_KLV_BUFFER);
+	uint32_t index, i, pass;
+
+	Check(mp4handle && dir && requests && buffers, "batch setup", file, 0, 0);
+	if (mp4handle && dir && requests && buffers)
+	{
+		for (index = 0; index < GetNumberPayloads(mp4handle); index++)
+		{
+			GPMF_stream metadata_stream, *ms = &metadata_stream;
+			uint32_t payloadsize = GetPayloadSize(mp4handle, index);
+			uint32_t *payload;
+
+			payloadres = GetPayloadResource(mp4handle, payloadres, payloadsize);
+			payload = GetPayload(mp4handle, payloadres, index);
+			if (payload == NULL || GPMF_OK != GPMF_Init(ms, payload, payloadsize))
+				continue;
+
+			GPMF_BuildDirectory(ms, dir);
+
+			for (pass = 0; pass < 2; pass++)
+			{
+				for (i = 0; i < dir->entry_count; i++)
+				{
+					memset(&requests[i], 0, sizeof(GPMF_batch_request));
+					requests[i].fourcc = dir->entry[i].fourcc;
+					requests[i].type = GPMF_TYPE_DOUBLE;
+					requests[i].buffer = buffers + (size_t)i * TEST_KLV_BUFFER;
+					requests[i].buffersize = TEST_KLV_BUFFER;
+				}
+
+				GPMF_AttachDirectory(ms, pass ? NULL : dir);
+				GPMF_ScaledDataBatch(ms, requests, dir->entry_count);
+
+				for (i = 0; i < dir->entry_count; i++)
+				{
+					double *reference = NULL;
+					uint32_t elements = 0, samples = 0;
+
+					SerialSamples(payload, payloadsize, requests[i].fourcc, &elements, &reference, &samples);
+					Check(requests[i].samples == samples && (samples == 0 || (requests[i].elements == elements &&
+						0 == memcmp(reference, requests[i].buffer, (size_t)samples * elements * sizeof(double)))),
+						pass ? "batch by walk" : "batch by directory", file, requests[i].fourcc, index);
+					if (reference) free(reference);
+				}
+			}
+		}
+	}
+
+	if (payloadres) FreePayloadResource(mp4handle, payloadres);
+	if (mp4handle) CloseSource(mp4handle);
+	if (dir) free(dir);
+	if (requests) free(requests);
+	if (buffers) free(buffers);
+}
+
+
+// Extraction on one thread and on several, the pipeline's blocks, and sample tables all agree with the serial walk
+static void TestExtraction(char *file)
+{
+	size_t mp4handle = OpenMP4Source(file, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	mp4callbacks cb;
+	mp4callbacks_ex cbex;
+	GPMF_stream_rate rates[TEST_MAX_STREAMS];
+	GPMF_extracted_stream single[TEST_MAX_STREAMS], pooled[TEST_MAX_STREAMS], blocks[TEST_MAX_STREAMS];
+	double *reference[TEST_MAX_STREAMS];
+	uint32_t ref_elements[TEST_MAX_STREAMS], ref_samples[TEST_MAX_STREAMS], block_samples[TEST_MAX_STREAMS];
+	uint32_t stream_count = TEST_MAX_STREAMS, payload_count, index, i;
+	size_t payloadres = 0, pipeline = 0;
+	GPMF_sample_block *block;
+
+	Check(mp4handle != 0, "extraction setup", file, 0, 0);
+	if (mp4handle == 0)
+		return;
+
+	SetCallbacks(mp4handle, &cb, &cbex);
+	Check(GPMF_OK == GetGPMFSampleRates(cb, &cbex, 0, GPMF_SAMPLE_RATE_FAST, rates, &stream_count) && stream_count > 0, "stream list", file, 0, 0);
+	if (stream_count > TEST_MAX_STREAMS)
+		stream_count = TEST_MAX_STREAMS;
+
+	memset(reference, 0, sizeof(reference));
+	memset(ref_elements, 0, sizeof(ref_elements));
+	memset(ref_samples, 0, sizeof(ref_samples));
+	payload_count = GetNumberPayloads(mp4handle);
+	for (index = 0; index < payload_count; index++)
+	{
+		uint32_t payloadsize = GetPayloadSize(mp4handle, index);
+		uint32_t *payload;
+
+		payloadres = GetPayloadResource(mp4handle, payloadres, payloadsize);
+		payload = GetPayload(mp4handle, payloadres, index);
+		for (i = 0; payload && i < stream_count; i++)
+			SerialSamples(payload, payloadsize, rates[i].fourcc, &ref_elements[i], &reference[i], &ref_samples[i]);
+	}
+	if (payloadres) FreePayloadResource(mp4handle, payloadres);
+
+	memset(single, 0, sizeof(single));
+	memset(pooled, 0, sizeof(pooled));
+	for (i = 0; i < stream_count; i++)
+		single[i].fourcc = pooled[i].fourcc = rates[i].fourcc;
+
+	Check(GPMF_OK == GPMF_ExtractStreams(cb, NULL, single, stream_count, 1), "extract on one thread", file, 0, 0);
+	Check(GPMF_OK == GPMF_ExtractStreams(cb, &cbex, pooled, stream_count, 4), "extract on four threads", file, 0, 0);
+
+	for (i = 0; i < stream_count; i++)
+	{
+		size_t size = (size_t)ref_samples[i] * ref_elements[i] * sizeof(double);
+		uint32_t counted = 0;
+
+		for (index = 0; index < payload_count; index++)
+			counted += pooled[i].payload_samples[index];
+
+		Check(single[i].samples == ref_samples[i] && (size == 0 || 0 == memcmp(single[i].data, reference[i], size)), "extract on one thread", file, rates[i].fourcc, 0);
+		Check(pooled[i].samples == ref_samples[i] && (size == 0 || 0 == memcmp(pooled[i].data, reference[i], size)), "extract on four threads", file, rates[i].fourcc, 0);
+		Check(counted == pooled[i].samples, "extracted samples per payload", file, rates[i].fourcc, 0);
+	}
+
+	// the pipeline's blocks, concatenated in payload order
+	memset(blocks, 0, sizeof(blocks));
+	memset(block_samples, 0, sizeof(block_samples));
+	for (i = 0; i < stream_count; i++)
+		blocks[i].fourcc = rates[i].fourcc;
+
+	index = 0;
+	if (GPMF_OK == GPMF_OpenPipeline(cb, blocks, stream_count, 4, &pipeline))
+	{
+		while (GPMF_OK == GPMF_NextBlock(pipeline, &block))
+		{
+			Check(block->payload_index == index++, "pipeline order", file, 0, block->payload_index);
+			for (i = 0; i < block->stream_count; i++)
+			{
+				GPMF_extracted_stream *s = &block->streams[i];
+				size_t offset = (size_t)block_samples[i] * ref_elements[i];
+
+				Check(block_samples[i] + s->samples <= ref_samples[i] && (s->samples == 0 ||
+					0 == memcmp(s->data, reference[i] + offset, (size_t)s->samples * s->elements * sizeof(double))), "pipeline", file, rates[i].fourcc, block->payload_index);
+				block_samples[i] += s->samples;
+			}
+			GPMF_ReleaseBlock(pipeline, block);
+		}
+		GPMF_ClosePipeline(pipeline);
+	}
+	Check(index == payload_count, "pipeline blocks", file, 0, index);
+	for (i = 0; i < stream_count; i++)
+		Check(block_samples[i] == ref_samples[i], "pipeline samples", file, rates[i].fourcc, 0);
+
+	// sample tables: times map back to their samples, and reads match the extraction
+	for (i = 0; i < stream_count; i++)
+	{
+		GPMF_sample_table table;
+		uint32_t sample, first, count, total, same = 1;
+		double *buffer;
+
+		memset(&table, 0, sizeof(table));
+		table.fourcc = rates[i].fourcc;
+		if (GPMF_OK != GPMF_BuildSampleTable(cb, &table))
+		{
+			Check(0, "sample table", file, rates[i].fourcc, 0);
+			continue;
+		}
+
+		total = table.first_sample[table.payload_count];
+		Check(total == ref_samples[i], "sample table count", file, rates[i].fourcc, 0);
+
+		for (sample = 0; sample < total && same; sample++)
+			same = (GPMF_SampleAtTime(&table, GPMF_SampleTime(&table, sample), NULL) == sample);
+		Check(same, "sample time round trip", file, rates[i].fourcc, sample - 1);
+
+		if (total)
+		{
+			double start = GPMF_SampleTime(&table, 0);
+			double end = table.payload_out[table.payload_count - 1];
+
+			Check(GPMF_ERROR_FIND == GPMF_SampleRangeAtTime(&table, start - 2.0, start - 1.0, &first, &count), "range before the samples", file, rates[i].fourcc, 0);
+			Check(GPMF_ERROR_FIND == GPMF_SampleRangeAtTime(&table, end + 1.0, end + 2.0, &first, &count), "range after the samples", file, rates[i].fourcc, 0);
+			Check(GPMF_OK == GPMF_SampleRangeAtTime(&table, start - 1.0, end + 1.0, &first, &count) && first == 0 && count == total, "range covering the samples", file, rates[i].fourcc, 0);
+
+			buffer = (double *)malloc((size_t)total * table.elements * sizeof(double));
+			if (buffer)
+			{
+				first = total / 3;
+				count = total - first;
+				Check(GPMF_OK == GPMF_ReadSamples(cb, &table, first, count, buffer, count * table.elements * sizeof(double)) &&
+					0 == memcmp(buffer, reference[i] + (size_t)first * ref_elements[i], (size_t)count * ref_elements[i] * sizeof(double)), "read samples", file, rates[i].fourcc, first);
+				free(buffer);
+			}
+		}
+		GPMF_FreeSampleTable(&table);
+	}
+
+	GPMF_FreeExtractedStreams(single, stream_count);
+	GPMF_FreeExtractedStreams(pooled, stream_count);
+	for (i = 0; i < stream_count; i++)
+		if (reference[i]) free(reference[i]);
+	CloseSource(mp4handle);
+}
+
+
+// Payloads read by range, through a payload queue and from a memory mapping match GetPayload() on the file
+static void TestPayloadReads(char *file)
+{
+	size_t mp4handle = OpenMP4Source(file, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	size_t mapped = OpenMP4Source(file, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, MP4_FLAG_MEMORY_MAPPED);
+	size_t payloadres = 0, mappedres = 0, rangeres = 0, queue = 0, queueres[4] = { 0 };
+	uint32_t *range[5];
+	uint32_t payload_count, index, next, got, i;
+	payloadCompletion done;
+
+	Check(mp4handle && mapped, "payload reads setup", file, 0, 0);
+	if (mp4handle == 0 || mapped == 0)
+	{
+		if (mp4handle) CloseSource(mp4handle);
+		if (mapped) CloseSource(mapped);
+		return;
+	}
+
+	payload_count = GetNumberPayloads(mp4handle);
+	rangeres = GetPayloadResource(mp4handle, 0, 0);
+	for (index = 0; index < payload_count; index += got)
+	{
+		got = payload_count - index < 5 ? payload_count - index : 5;
+		Check(got == GetPayloadRange(mp4handle, rangeres, index, got, range), "payload range", file, 0, index);
+
+		for (i = 0; i < got; i++)
+		{
+			uint32_t payloadsize = GetPayloadSize(mp4handle, index + i);
+			uint32_t *payload;
+
+			payloadres = GetPayloadResource(mp4handle, payloadres, payloadsize);
+			payload = GetPayload(mp4handle, payloadres, index + i);
+			mappedres = GetPayloadResource(mapped, mappedres, payloadsize);
+
+			Check(payload && range[i] && 0 == memcmp(payload, range[i], payloadsize), "payload range", file, 0, index + i);
+			Check(payload && 0 == memcmp(payload, GetPayload(mapped, mappedres, index + i), payloadsize), "mapped payload", file, 0, index + i);
+		}
+	}
+
+	queue = OpenPayloadQueue(mp4handle, 4);
+	Check(queue != 0, "payload queue", file, 0, 0);
+	for (i = 0; i < 4; i++)
+		queueres[i] = GetPayloadResource(mp4handle, 0, 0);
+
+	got = 0;
+	for (next = 0; queue && (next < payload_count || PayloadsInFlight(queue)); )
+	{
+		for (i = 0; i < 4 && next < payload_count; i++)
+		{
+			if (queueres[i] && SubmitPayload(queue, queueres[i], next, &queueres[i]))
+			{
+				queueres[i] = 0;
+				next++;
+			}
+		}
+
+		while (ReapPayload(queue, 1, &done))
+		{
+			uint32_t payloadsize = GetPayloadSize(mp4handle, done.index);
+			uint32_t *payload;
+
+			payloadres = GetPayloadResource(mp4handle, payloadres, payloadsize);
+			payload = GetPayload(mp4handle, payloadres, done.index);
+			Check(payload && done.payload && done.payloadsize == payloadsize && 0 == memcmp(payload, done.payload, payloadsize), "queued payload", file, 0, done.index);
+
+			*(size_t *)done.user = done.resHandle;
+			got++;
+			if (PayloadsInFlight(queue) == 0)
+				break;
+		}
+	}
+	Check(got == payload_count, "queued payloads", file, 0, got);
+	if (queue) ClosePayloadQueue(queue);
+
+	for (i = 0; i < 4; i++)
+		if (queueres[i]) FreePayloadResource(mp4handle, queueres[i]);
+	if (payloadres) FreePayloadResource(mp4handle, payloadres);
+	if (mappedres) FreePayloadResource(mapped, mappedres);
+	if (rangeres) FreePayloadResource(mp4handle, rangeres);
+	CloseSource(mp4handle);
+	CloseSource(mapped);
+}
+
+
+// The payloads of a handle opened through its index file match those of a scan of the file
+static void CompareIndexed(char *file, char *indexname, const char *test)
+{
+	size_t scanned = OpenMP4Source(file, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	size_t indexed = OpenMP4SourceWithIndex(file, indexname, MOV_GPMF_TRAK_TYPE, MOV_GPMF_TRAK_SUBTYPE, 0);
+	size_t scannedres = 0, indexedres = 0;
+	uint32_t index, payload_count;
+
+	Check(scanned && indexed && GetNumberPayloads(scanned) == GetNumberPayloads(indexed), test, file, 0, 0);
+	if (scanned && indexed)
+	{
+		payload_count = GetNumberPayloads(scanned);
+		for (index = 0; index < payload_count && index < GetNumberPayloads(indexed); index++)
+		{
+			uint32_t payloadsize = GetPayloadSize(scanned, index);
+			double in = 0.0, out = 0.0, indexed_in = 0.0, indexed_out = 0.0;
+			uint32_t *payload, *indexed_payload;
+
+			scannedres = GetPayloadResource(scanned, scannedres, payloadsize);
+			indexedres = GetPayloadResource(indexed, indexedres, payloadsize);
+			payload = GetPayload(scanned, scannedres, index);
+			indexed_payload = GetPayload(indexed, indexedres, index);
+			GetPayloadTime(scanned, index, &in, &out);
+			GetPayloadTime(indexed, index, &indexed_in, &indexed_out);
+
+			Check(payloadsize == GetPayloadSize(indexed, index) && payload && indexed_payload && 0 == memcmp(payload, indexed_payload, payloadsize) &&
+				in == indexed_in && out == indexed_out, test, file, 0, index);
+		}
+	}
+
+	if (scannedres) FreePayloadResource(scanned, scannedres);
+	if (indexedres) FreePayloadResource(indexed, indexedres);
+	if (scanned) CloseSource(scanned);
+	if (indexed) CloseSource(indexed);
+}
+
+
+// An index file is built on the first open, used by the next, and a damaged one is replaced by scanning the file again
+static void TestIndexFile(char *file, char *folder)
+{
+	char indexname[1024];
+	uint8_t header[4];
+	FILE *fp;
+
+	snprintf(indexname, sizeof(indexname), "%s/%s.gpmfidx", folder, strrchr(file, '/') ? strrchr(file, '/') + 1 : file);
+	remove(indexname);
+
+	CompareIndexed(file, indexname, "index built");
+
+	fp = fopen(indexname, "rb");
+	Check(fp != NULL, "index written", file, 0, 0);
+	if (fp)
+		fclose(fp);
+
+	CompareIndexed(file, indexname, "index reopened");
+
+	// overwrite the start of the header, its magic
+	fp = fopen(indexname, "r+b");
+	if (fp)
+	{
+		memset(header, 0xff, sizeof(header));
+		fwrite(header, 1, sizeof(header), fp);
+		fclose(fp);
+	}
+	CompareIndexed(file, indexname, "damaged index");
+
+	remove(indexname);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char *samples[] = { "karma.mp4", "max-heromode.mp4" };
+	char file[1024];
+	uint32_t i;
+
+	if (argc != 3)
+	{
+		printf("usage: %s <samples folder> <folder for index files>\n", argv[0]);
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(samples) / sizeof(samples[0]); i++)
+	{
+		snprintf(file, sizeof(file), "%s/%s", argv[1], samples[i]);
+
+		TestCompression(file);
+		TestScaling(file);
+		TestBatch(file);
+		TestExtraction(file);
+		TestPayloadReads(file);
+		TestIndexFile(file, argv[2]);
+	}
+
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures ? 1 : 0;
+}